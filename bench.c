@@ -0,0 +1,541 @@
+#define _GNU_SOURCE  // wait4() and getline()
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define DEFAULT_FILES 2000          // Files in the generated corpus
+#define DEFAULT_MEAN_SIZE (256 << 10) // Mean file size in bytes
+#define DEFAULT_CORPUS_DIR "bench-corpus"
+#define DEFAULT_PARALLEL "./parallel"
+#define SAMPLE_TABLE_SIZE 4096      // Precomputed characters drawn from the letter distribution
+#define WRITE_CHUNK (1 << 20)       // Bytes generated per write()
+#define MAX_ARGS 64                 // Arguments of one parallel run
+
+/**
+ * How file sizes are drawn in the generated corpus.
+ */
+enum SizeDistribution {
+    SIZES_FIXED,    // Every file has the mean size
+    SIZES_UNIFORM,  // Uniform between 0 and twice the mean
+    SIZES_LOGNORMAL // Log-normal with the given mean: many small files, a few large ones
+};
+
+/**
+ * Benchmark settings, from the command line.
+ */
+struct BenchOptions {
+    int files;                // Number of files to generate
+    size_t meanSize;          // Mean file size
+    enum SizeDistribution distribution;
+    double skew;              // Zipf exponent of the letter frequencies, 0 for uniform
+    uint64_t seed;            // RNG seed, so corpora are reproducible
+    const char *corpusDir;    // Where the corpus lives
+    const char *parallelPath; // Binary under test
+    const char *jsonPath;     // JSON report, "-" for stdout, NULL for none
+    int workers;              // -j for every run, 0 for parallel's default
+    int runs;                 // Runs per configuration; the median is reported
+};
+
+/**
+ * One parallel configuration to measure.
+ */
+struct BenchConfig {
+    const char *name;
+    const char *args[8]; // Extra arguments, NULL-terminated
+};
+
+/**
+ * The configurations measured, one per engine and input/kernel path. All of
+ * them run without the result cache, which would otherwise turn every run
+ * after the first into a stat() benchmark.
+ */
+static const struct BenchConfig configs[] = {
+    { "processes-mmap-simd", { NULL } },
+    { "processes-read",      { "--input=read", NULL } },
+    { "processes-stream",    { "--input=stream", NULL } },
+    { "processes-scalar",    { "--kernel=scalar", NULL } },
+    { "processes-shm",       { "--transport=shm", NULL } },
+    { "processes-batched",   { "--schedule=batched", NULL } },
+    { "processes-lpt",       { "--schedule=lpt", NULL } },
+    { "threads-mmap-simd",   { "--engine=threads", NULL } },
+    { "threads-scalar",      { "--engine=threads", "--kernel=scalar", NULL } },
+};
+#define NUM_CONFIGS (int)(sizeof(configs) / sizeof(configs[0]))
+
+/**
+ * Measurements of one configuration.
+ */
+struct BenchResult {
+    double seconds;      // Median wall-clock time of the runs
+    double latencyP50;   // Per-file latency percentiles over all runs
+    double latencyP99;
+    long peakRssKb;      // Largest resident set of any process in any run
+    int failedRuns;      // Runs that didn't exit with status 0
+    size_t latencyCount; // Files that reported a latency
+};
+
+uint64_t rngState; // xorshift64* state
+
+/**
+ * Returns the next pseudo-random number (xorshift64*).
+ */
+uint64_t nextRandom(void) {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 2685821657736338717ull;
+}
+
+/**
+ * Returns a uniform random number in [0, 1).
+ */
+double nextUniform(void) {
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Draws a file size from the configured distribution.
+ */
+size_t drawSize(const struct BenchOptions *options) {
+    switch (options->distribution) {
+    case SIZES_UNIFORM:
+        return (size_t)(nextUniform() * 2 * options->meanSize);
+    case SIZES_LOGNORMAL: {
+        // sigma = 1.5 gives a long tail; mu is chosen so the mean comes out right
+        double sigma = 1.5;
+        double mu = log((double)options->meanSize) - sigma * sigma / 2;
+        double u1 = nextUniform(), u2 = nextUniform();
+        double normal = sqrt(-2 * log(1 - u1)) * cos(2 * M_PI * u2);
+        return (size_t)exp(mu + sigma * normal);
+    }
+    default:
+        return options->meanSize;
+    }
+}
+
+/**
+ * Fills the sampling table with characters drawn from the corpus alphabet:
+ * letters with Zipf-distributed frequencies in random case, with about one
+ * character in six a space, newline, digit or punctuation mark.
+ */
+void buildSampleTable(double skew, char table[SAMPLE_TABLE_SIZE]) {
+    static const char others[] = "      \n\n,.;:-'0123456789";
+    double weights[26], total = 0;
+    for (int i = 0; i < 26; i++) {
+        weights[i] = 1.0 / pow(i + 1, skew);
+        total += weights[i];
+    }
+
+    for (int n = 0; n < SAMPLE_TABLE_SIZE; n++) {
+        if (nextRandom() % 6 == 0) {
+            table[n] = others[nextRandom() % (sizeof(others) - 1)];
+            continue;
+        }
+        double pick = nextUniform() * total;
+        int letter = 0;
+        while (letter < 25 && pick >= weights[letter]) pick -= weights[letter++];
+        table[n] = (nextRandom() & 1 ? 'A' : 'a') + letter;
+    }
+}
+
+/**
+ * Generates the corpus, unless the directory already holds one made with the
+ * same settings. Writes the file list as files.txt for --files-from.
+ * @param totalBytes Receives the size of the corpus
+ * @return 0 on success, -1 on error
+ */
+int generateCorpus(const struct BenchOptions *options, uint64_t *totalBytes) {
+    char params[256], path[PATH_MAX];
+    snprintf(params, sizeof(params), "files=%d mean=%zu distribution=%d skew=%g seed=%" PRIu64 "\n",
+             options->files, options->meanSize, options->distribution, options->skew, options->seed);
+
+    // Reuse a matching corpus; its size is recorded next to the settings
+    snprintf(path, sizeof(path), "%s/params", options->corpusDir);
+    FILE *stamp = fopen(path, "r");
+    if (stamp) {
+        char existing[256];
+        int match = fgets(existing, sizeof(existing), stamp) && strcmp(existing, params) == 0 &&
+                    fscanf(stamp, "%" SCNu64, totalBytes) == 1;
+        fclose(stamp);
+        if (match) {
+            printf("Reusing corpus in %s.\n", options->corpusDir);
+            return 0;
+        }
+    }
+
+    if (mkdir(options->corpusDir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", options->corpusDir, strerror(errno));
+        return -1;
+    }
+    printf("Generating %d files in %s...\n", options->files, options->corpusDir);
+
+    rngState = options->seed ? options->seed : 1;
+    char table[SAMPLE_TABLE_SIZE];
+    buildSampleTable(options->skew, table);
+    char *buffer = (char *)malloc(WRITE_CHUNK);
+    snprintf(path, sizeof(path), "%s/files.txt", options->corpusDir);
+    FILE *list = fopen(path, "w");
+    if (!buffer || !list) {
+        perror("Error preparing corpus");
+        return -1;
+    }
+
+    *totalBytes = 0;
+    for (int i = 0; i < options->files; i++) {
+        snprintf(path, sizeof(path), "%s/f%06d.txt", options->corpusDir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+            free(buffer);
+            fclose(list);
+            return -1;
+        }
+        size_t size = drawSize(options);
+        for (size_t written = 0; written < size;) {
+            size_t n = size - written < WRITE_CHUNK ? size - written : WRITE_CHUNK;
+            for (size_t k = 0; k < n; k++) buffer[k] = table[nextRandom() % SAMPLE_TABLE_SIZE];
+            if (write(fd, buffer, n) != (ssize_t)n) {
+                fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+                close(fd);
+                free(buffer);
+                fclose(list);
+                return -1;
+            }
+            written += n;
+        }
+        close(fd);
+        fprintf(list, "%s\n", path);
+        *totalBytes += size;
+    }
+    free(buffer);
+    fclose(list);
+
+    snprintf(path, sizeof(path), "%s/params", options->corpusDir);
+    stamp = fopen(path, "w");
+    if (stamp) {
+        fprintf(stamp, "%s%" PRIu64 "\n", params, *totalBytes);
+        fclose(stamp);
+    }
+    return 0;
+}
+
+/**
+ * Compares two doubles for qsort().
+ */
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Returns the p-th percentile (0-100) of sorted values, nearest rank.
+ */
+double percentile(const double *sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t rank = (size_t)ceil(p / 100 * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Runs parallel once with a configuration over the corpus.
+ * @param latencies Per-file latencies are appended here, growing it as needed
+ * @param seconds Receives the wall-clock time of the run
+ * @param peakRssKb Receives the largest resident set of the run's process tree
+ * @return The exit status of parallel, or -1 if it couldn't be run
+ */
+int runOnce(const struct BenchOptions *options, const struct BenchConfig *config,
+            double **latencies, size_t *count, size_t *capacity, double *seconds, long *peakRssKb) {
+    char listArg[PATH_MAX + 16], outputArg[PATH_MAX + 16], workersArg[32];
+    snprintf(listArg, sizeof(listArg), "--files-from=%s/files.txt", options->corpusDir);
+    snprintf(outputArg, sizeof(outputArg), "--output-file=%s/results.bin", options->corpusDir);
+    snprintf(workersArg, sizeof(workersArg), "-j%d", options->workers);
+
+    const char *argv[MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = options->parallelPath;
+    if (options->workers > 0) argv[argc++] = workersArg;
+    argv[argc++] = "-v"; // One "... after <seconds> s" line per file
+    argv[argc++] = "--no-cache";
+    argv[argc++] = "--output=binary";
+    argv[argc++] = outputArg;
+    for (int i = 0; config->args[i]; i++) argv[argc++] = config->args[i];
+    argv[argc++] = listArg;
+    argv[argc] = NULL;
+
+    int output[2];
+    if (pipe(output) < 0) {
+        perror("Error creating pipe");
+        return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error forking");
+        return -1;
+    } else if (pid == 0) {
+        dup2(output[1], STDOUT_FILENO);
+        close(output[0]);
+        close(output[1]);
+        execv(options->parallelPath, (char *const *)argv);
+        perror("Error running parallel");
+        _exit(127);
+    }
+    close(output[1]);
+
+    // The parent and every thread report "... after <seconds> s" per file
+    FILE *stream = fdopen(output[0], "r");
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    while (getline(&line, &lineCapacity, stream) > 0) {
+        char *after = strstr(line, " after ");
+        double latency;
+        if (!after || sscanf(after, " after %lf s", &latency) != 1) continue;
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 1024;
+            *latencies = (double *)realloc(*latencies, *capacity * sizeof(double));
+            if (!*latencies) {
+                perror("Failed to allocate latencies");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*latencies)[(*count)++] = latency;
+    }
+    free(line);
+    fclose(stream);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("Error waiting for parallel");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *peakRssKb = usage.ru_maxrss; // Includes the workers, which parallel has reaped
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Runs a configuration options->runs times and summarises the runs.
+ */
+void runConfig(const struct BenchOptions *options, const struct BenchConfig *config,
+               struct BenchResult *result) {
+    double *latencies = NULL;
+    size_t count = 0, capacity = 0;
+    double times[options->runs];
+    memset(result, 0, sizeof(*result));
+
+    for (int run = 0; run < options->runs; run++) {
+        long rss = 0;
+        times[run] = 0;
+        if (runOnce(options, config, &latencies, &count, &capacity, &times[run], &rss) != 0) {
+            result->failedRuns++;
+        }
+        if (rss > result->peakRssKb) result->peakRssKb = rss;
+    }
+
+    qsort(times, options->runs, sizeof(double), compareDoubles);
+    result->seconds = times[options->runs / 2];
+    qsort(latencies, count, sizeof(double), compareDoubles);
+    result->latencyP50 = percentile(latencies, count, 50);
+    result->latencyP99 = percentile(latencies, count, 99);
+    result->latencyCount = count;
+    free(latencies);
+}
+
+/**
+ * Writes the JSON report.
+ */
+void writeJson(FILE *out, const struct BenchOptions *options, uint64_t totalBytes,
+               const struct BenchResult *results) {
+    static const char *distributions[] = { "fixed", "uniform", "lognormal" };
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"timestamp\": \"%s\",\n", stamp);
+    fprintf(out, "  \"corpus\": { \"files\": %d, \"bytes\": %" PRIu64 ", \"meanSize\": %zu, "
+                 "\"distribution\": \"%s\", \"skew\": %g, \"seed\": %" PRIu64 " },\n",
+            options->files, totalBytes, options->meanSize, distributions[options->distribution],
+            options->skew, options->seed);
+    fprintf(out, "  \"workers\": %d,\n", options->workers);
+    fprintf(out, "  \"runs\": %d,\n", options->runs);
+    fprintf(out, "  \"results\": [\n");
+    for (int i = 0; i < NUM_CONFIGS; i++) {
+        const struct BenchResult *r = &results[i];
+        fprintf(out, "    { \"name\": \"%s\", \"args\": \"", configs[i].name);
+        for (int a = 0; configs[i].args[a]; a++) {
+            fprintf(out, "%s%s", a ? " " : "", configs[i].args[a]);
+        }
+        fprintf(out, "\", \"seconds\": %.6f, \"gbPerSecond\": %.4f, \"filesPerSecond\": %.1f, "
+                     "\"latencyP50\": %.6f, \"latencyP99\": %.6f, \"latencySamples\": %zu, "
+                     "\"peakRssKb\": %ld, \"failedRuns\": %d }%s\n",
+                r->seconds, r->seconds > 0 ? totalBytes / r->seconds / 1e9 : 0,
+                r->seconds > 0 ? options->files / r->seconds : 0, r->latencyP50, r->latencyP99,
+                r->latencyCount, r->peakRssKb, r->failedRuns, i + 1 < NUM_CONFIGS ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ * @return The byte count, or 0 if the string is not a valid size
+ */
+size_t parseSize(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    return *end == '\0' ? (size_t)value : 0;
+}
+
+/**
+ * Prints the command-line help.
+ */
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--files=N] [--mean-size=BYTES] [--distribution=DIST] [--skew=S]\n"
+                    "          [--seed=N] [--corpus=DIR] [--parallel=PATH] [-j N] [--runs=N]\n"
+                    "          [--json=PATH]\n"
+                    "  --files=N           files in the generated corpus (default: 2000)\n"
+                    "  --mean-size=BYTES   mean file size, with optional K/M/G suffix (default: 256K)\n"
+                    "  --distribution=DIST file sizes: fixed, uniform or lognormal (default)\n"
+                    "  --skew=S            Zipf exponent of the letter frequencies (default: 1,\n"
+                    "                      0 for uniform letters)\n"
+                    "  --seed=N            RNG seed for the corpus (default: 1)\n"
+                    "  --corpus=DIR        corpus directory, reused if the settings match\n"
+                    "                      (default: bench-corpus)\n"
+                    "  --parallel=PATH     binary under test (default: ./parallel)\n"
+                    "  -j, --workers=N     workers for every run (default: parallel's default)\n"
+                    "  --runs=N            runs per configuration; the median is reported (default: 3)\n"
+                    "  --json=PATH         also write a JSON report to PATH (- for stdout)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct BenchOptions options = { DEFAULT_FILES, DEFAULT_MEAN_SIZE, SIZES_LOGNORMAL, 1.0, 1,
+                                    DEFAULT_CORPUS_DIR, DEFAULT_PARALLEL, NULL, 0, 3 };
+
+    static const struct option longOptions[] = {
+        { "files", required_argument, NULL, 'n' },
+        { "mean-size", required_argument, NULL, 's' },
+        { "distribution", required_argument, NULL, 'd' },
+        { "skew", required_argument, NULL, 'k' },
+        { "seed", required_argument, NULL, 'S' },
+        { "corpus", required_argument, NULL, 'c' },
+        { "parallel", required_argument, NULL, 'p' },
+        { "workers", required_argument, NULL, 'j' },
+        { "runs", required_argument, NULL, 'r' },
+        { "json", required_argument, NULL, 'J' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            options.files = atoi(optarg);
+            break;
+        case 's':
+            options.meanSize = parseSize(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "fixed") == 0) {
+                options.distribution = SIZES_FIXED;
+            } else if (strcmp(optarg, "uniform") == 0) {
+                options.distribution = SIZES_UNIFORM;
+            } else if (strcmp(optarg, "lognormal") == 0) {
+                options.distribution = SIZES_LOGNORMAL;
+            } else {
+                fprintf(stderr, "Error: unknown size distribution '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            options.skew = atof(optarg);
+            break;
+        case 'S':
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            options.corpusDir = optarg;
+            break;
+        case 'p':
+            options.parallelPath = optarg;
+            break;
+        case 'j':
+            options.workers = atoi(optarg);
+            break;
+        case 'r':
+            options.runs = atoi(optarg);
+            break;
+        case 'J':
+            options.jsonPath = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.files < 1 || options.meanSize == 0 || options.runs < 1 || options.workers < 0 ||
+        options.skew < 0) {
+        fprintf(stderr, "Error: invalid benchmark settings.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // With the JSON report on stdout, the table goes to stderr
+    FILE *table = options.jsonPath && strcmp(options.jsonPath, "-") == 0 ? stderr : stdout;
+    uint64_t totalBytes;
+    if (generateCorpus(&options, &totalBytes) < 0) exit(EXIT_FAILURE);
+    fprintf(table, "Corpus: %d files, %.1f MB. Runs per configuration: %d.\n",
+            options.files, totalBytes / 1e6, options.runs);
+    fprintf(table, "%-22s %9s %8s %10s %10s %10s %10s\n",
+            "configuration", "seconds", "GB/s", "files/s", "p50 ms", "p99 ms", "RSS MB");
+    fflush(table);
+
+    struct BenchResult results[NUM_CONFIGS];
+    for (int i = 0; i < NUM_CONFIGS; i++) {
+        runConfig(&options, &configs[i], &results[i]);
+        const struct BenchResult *r = &results[i];
+        fprintf(table, "%-22s %9.3f %8.3f %10.0f %10.3f %10.3f %10.1f%s\n", configs[i].name,
+                r->seconds, totalBytes / r->seconds / 1e9, options.files / r->seconds,
+                r->latencyP50 * 1e3, r->latencyP99 * 1e3, r->peakRssKb / 1024.0,
+                r->failedRuns ? "  (failed runs)" : "");
+        fflush(table);
+    }
+
+    if (options.jsonPath) {
+        FILE *out = strcmp(options.jsonPath, "-") == 0 ? stdout : fopen(options.jsonPath, "w");
+        if (!out) {
+            fprintf(stderr, "Error writing %s: %s\n", options.jsonPath, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        writeJson(out, &options, totalBytes, results);
+        if (out != stdout) fclose(out);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < NUM_CONFIGS; i++) failed |= results[i].failedRuns > 0;
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,235 @@
+/**
+ * The result cache: a shared memory-mapped table of histograms keyed by
+ * file identity and modification time.
+ */
+#include "engine.h"
+
+#define CACHE_FILE_NAME "parallel-histograms.cache" // Default cache file, under $XDG_CACHE_HOME or ~/.cache
+#define CACHE_INITIAL_SLOTS 65536 // Slots in a new cache file
+
+/**
+ * One slot of the cache table.
+ */
+struct CacheEntry {
+    struct CacheKey key;
+    uint32_t used;       // Set last, once the key and counts are written
+    uint32_t reserved;
+    uint64_t counts[26];
+};
+
+struct ResultCache cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, -1 };
+
+/**
+ * Size of a cache file with the given number of slots.
+ */
+static size_t cacheFileSize(uint64_t capacity) {
+    return sizeof(struct CacheFileHeader) + capacity * sizeof(struct CacheEntry);
+}
+
+/**
+ * Maps the cache file at its current capacity, if that changed since the last
+ * mapping (another run may have grown it). Call with the flock held.
+ * @return 0 on success, -1 if the cache can't be used
+ */
+static int mapCache(void) {
+    if (cache.header && cacheFileSize(cache.header->capacity) == cache.mappedSize) return 0;
+    if (cache.header) munmap(cache.header, cache.mappedSize);
+
+    // Map the header first to learn the capacity, then the whole table
+    cache.header = NULL;
+    struct CacheFileHeader header;
+    if (pread(cache.fd, &header, sizeof(header), 0) != sizeof(header)) return -1;
+    size_t size = cacheFileSize(header.capacity);
+    void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache.fd, 0);
+    if (mapped == MAP_FAILED) return -1;
+    cache.header = (struct CacheFileHeader *)mapped;
+    cache.mappedSize = size;
+    return 0;
+}
+
+/**
+ * Finds the slot of a file in the cache table: the one holding its (dev, ino),
+ * or the empty slot where it would go.
+ */
+static struct CacheEntry *findCacheEntry(const struct CacheKey *key) {
+    struct CacheEntry *entries = (struct CacheEntry *)(cache.header + 1);
+    uint64_t mask = cache.header->capacity - 1;
+    uint64_t h = (key->ino ^ (key->dev << 32 | key->dev >> 32)) * 0x9E3779B97F4A7C15ull;
+    for (h = (h ^ h >> 29) & mask;; h = (h + 1) & mask) {
+        if (!entries[h].used || (entries[h].key.dev == key->dev && entries[h].key.ino == key->ino)) {
+            return &entries[h];
+        }
+    }
+}
+
+/**
+ * Doubles the cache table in place. Call with the exclusive flock held.
+ * @return 0 on success, -1 if the file couldn't be grown
+ */
+static int growCache(void) {
+    uint64_t count = cache.header->count;
+    struct CacheEntry *saved = (struct CacheEntry *)malloc(count * sizeof(struct CacheEntry));
+    if (!saved) return -1;
+    struct CacheEntry *entries = (struct CacheEntry *)(cache.header + 1);
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < cache.header->capacity && n < count; i++) {
+        if (entries[i].used) saved[n++] = entries[i];
+    }
+
+    uint64_t capacity = cache.header->capacity * 2;
+    if (ftruncate(cache.fd, cacheFileSize(capacity)) < 0) {
+        free(saved);
+        return -1;
+    }
+    cache.header->capacity = capacity;
+    if (mapCache() < 0) {
+        free(saved);
+        return -1;
+    }
+    memset(cache.header + 1, 0, capacity * sizeof(struct CacheEntry));
+    for (uint64_t i = 0; i < n; i++) *findCacheEntry(&saved[i].key) = saved[i];
+    cache.header->count = n;
+    free(saved);
+    return 0;
+}
+
+/**
+ * Opens the result cache, creating the file if needed. Called after the
+ * workers have been forked, since flock() locks are shared with every
+ * process that inherits the open file. Problems disable the cache for this
+ * run rather than failing it.
+ */
+void openCache(void) {
+    if (cache.disabled) return;
+
+    char defaultPath[PATH_MAX];
+    const char *path = cache.path;
+    if (!path) {
+        const char *base = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        if (base && *base) {
+            snprintf(defaultPath, sizeof(defaultPath), "%s", base);
+        } else if (home && *home) {
+            snprintf(defaultPath, sizeof(defaultPath), "%s/.cache", home);
+        } else {
+            return;
+        }
+        mkdir(defaultPath, 0700); // Usually exists already
+        size_t length = strlen(defaultPath);
+        snprintf(defaultPath + length, sizeof(defaultPath) - length, "/%s", CACHE_FILE_NAME);
+        path = defaultPath;
+    }
+
+    cache.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache.fd < 0) {
+        fprintf(stderr, "Warning: not using cache %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    flock(cache.fd, LOCK_EX);
+    struct stat st;
+    struct CacheFileHeader header;
+    int usable = fstat(cache.fd, &st) == 0;
+    if (usable && st.st_size == 0) {
+        // New file: write an empty table
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.entrySize = sizeof(struct CacheEntry);
+        header.capacity = CACHE_INITIAL_SLOTS;
+        usable = ftruncate(cache.fd, cacheFileSize(header.capacity)) == 0 &&
+                 pwrite(cache.fd, &header, sizeof(header), 0) == sizeof(header);
+    } else if (usable) {
+        usable = pread(cache.fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == CACHE_VERSION &&
+                 header.entrySize == sizeof(struct CacheEntry) &&
+                 header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+                 (off_t)cacheFileSize(header.capacity) <= st.st_size;
+    }
+    usable = usable && mapCache() == 0;
+    flock(cache.fd, LOCK_UN);
+
+    if (!usable) {
+        fprintf(stderr, "Warning: not using cache %s: not a valid cache file "
+                        "(delete it to start over).\n", path);
+        close(cache.fd);
+        cache.fd = -1;
+        return;
+    }
+    cache.openedAt = time(NULL);
+    LOG(LEVEL_INFO, "Using result cache %s.\n", path);
+}
+
+/**
+ * Unmaps and closes the result cache.
+ */
+void closeCache(void) {
+    if (cache.fd == -1) return;
+    LOG(LEVEL_NOTICE, "Result cache answered %" PRIu64 " inputs.\n", cache.hits);
+    munmap(cache.header, cache.mappedSize);
+    close(cache.fd);
+    cache.fd = -1;
+}
+
+/**
+ * Fills in the cache key of a picked input, if results for it may be
+ * cached: a non-empty regular file. Empty files are cheap to count anyway,
+ * and /proc files report size 0 with an mtime that doesn't follow their contents.
+ */
+void setCacheKey(struct QueuedTask *input, const struct stat *st) {
+    input->cacheable = cache.fd != -1 && S_ISREG(st->st_mode) && st->st_size > 0;
+    if (!input->cacheable) return;
+    input->key.dev = st->st_dev;
+    input->key.ino = st->st_ino;
+    input->key.size = st->st_size;
+    input->key.mtimeSec = st->st_mtim.tv_sec;
+    input->key.mtimeNsec = st->st_mtim.tv_nsec;
+}
+
+/**
+ * Looks a file up in the result cache.
+ * @return 1 with counts filled in if the cache holds a result for this exact key, else 0
+ */
+int cacheLookup(const struct CacheKey *key, uint64_t counts[26]) {
+    int hit = 0;
+    STATS_BEGIN(timer);
+    pthread_mutex_lock(&cache.lock);
+    flock(cache.fd, LOCK_SH);
+    if (mapCache() == 0) {
+        struct CacheEntry *entry = findCacheEntry(key);
+        hit = entry->used && memcmp(&entry->key, key, sizeof(*key)) == 0;
+        if (hit) {
+            memcpy(counts, entry->counts, sizeof(entry->counts));
+            cache.hits++;
+        }
+    }
+    flock(cache.fd, LOCK_UN);
+    pthread_mutex_unlock(&cache.lock);
+    STATS_END(STAGE_CACHE, timer, 2);
+    return hit;
+}
+
+/**
+ * Stores a result in the cache, replacing any older result for the same
+ * file. Files modified since this run started are left out: another write
+ * within the same mtime tick could change them without changing the key.
+ */
+void cacheStore(const struct CacheKey *key, const uint64_t counts[26]) {
+    if (cache.fd == -1 || key->mtimeSec >= cache.openedAt - 1) return;
+    STATS_BEGIN(timer);
+    pthread_mutex_lock(&cache.lock);
+    flock(cache.fd, LOCK_EX);
+    if (mapCache() == 0 &&
+        ((cache.header->count + 1) * 2 <= cache.header->capacity || growCache() == 0)) {
+        struct CacheEntry *entry = findCacheEntry(key);
+        if (!entry->used) cache.header->count++;
+        entry->used = 0;
+        entry->key = *key;
+        memcpy(entry->counts, counts, sizeof(entry->counts));
+        entry->used = 1;
+    }
+    flock(cache.fd, LOCK_UN);
+    pthread_mutex_unlock(&cache.lock);
+    STATS_END(STAGE_CACHE, timer, 2);
+}
@@ -0,0 +1,333 @@
+/**
+ * The coordinator of a distributed run (--listen), which collects the
+ * results of its shards.
+ */
+#include "engine.h"
+
+#define MAX_WIRE_RECORD (64 << 20) // Longest record body the coordinator accepts
+
+struct Coordinator coordinator;
+
+/**
+ * Handles a HELLO record: claims the shard it names for the connection and
+ * checks the shard counts what the coordinator was started to save.
+ * @return 0 on success, -1 to drop the connection
+ */
+static int helloRecord(struct ShardConnection *c, const unsigned char *p, const unsigned char *end) {
+    uint64_t shard, shards, mode, numLabels;
+    if (c->shard >= 0 || getVarint(&p, end, &shard) < 0 || getVarint(&p, end, &shards) < 0 ||
+        getVarint(&p, end, &mode) < 0 || getVarint(&p, end, &numLabels) < 0 ||
+        numLabels != (uint64_t)(end - p) || shards < 1 || shards > MAX_SHARDS || shard >= shards) {
+        LOG(LEVEL_ERROR, "Error: a shard sent a malformed HELLO record.\n");
+        return -1;
+    }
+    if (coordinator.numShards == 0) {
+        coordinator.shards = (enum ShardState *)calloc(shards, sizeof(*coordinator.shards));
+        if (!coordinator.shards) {
+            perror("Failed to allocate shard states");
+            exit(EXIT_FAILURE);
+        }
+        coordinator.numShards = coordinator.shardsLeft = shards;
+    } else if (shards != (uint64_t)coordinator.numShards) {
+        LOG(LEVEL_ERROR, "Error: shard %" PRIu64 "/%" PRIu64 " doesn't match the other %d shards.\n",
+                         shard + 1, shards, coordinator.numShards);
+        return -1;
+    }
+    if (coordinator.shards[shard] != SHARD_WAITING) {
+        LOG(LEVEL_ERROR, "Error: shard %" PRIu64 "/%" PRIu64 " connected again.\n", shard + 1, shards);
+        return -1;
+    }
+    coordinator.shards[shard] = SHARD_CONNECTED;
+    c->shard = shard;
+
+    int ownLabels = classPolicy ? classPolicy->numClasses : 0;
+    if (mode != histogramMode || numLabels != (uint64_t)ownLabels ||
+        (ownLabels > 0 && memcmp(p, classPolicy->labels, ownLabels) != 0)) {
+        LOG(LEVEL_ERROR, "Error: shard %" PRIu64 "/%" PRIu64 " counts with other --histogram, --alphabet "
+                         "or --case options than the coordinator.\n", shard + 1, shards);
+        return -1;
+    }
+    LOG(LEVEL_INFO, "Shard %" PRIu64 "/%" PRIu64 " connected.\n", shard + 1, shards);
+    return 0;
+}
+
+/**
+ * Handles a RESULT record by saving the result it carries.
+ * @return 0 on success, -1 to drop the connection
+ */
+static int resultRecord(struct ShardConnection *c, const unsigned char *p, const unsigned char *end) {
+    uint64_t task, status, length, counts[26], numPairs = 0;
+    int ok = c->shard >= 0 && getVarint(&p, end, &task) == 0 && task <= INT_MAX &&
+             getVarint(&p, end, &status) == 0 && status < NUM_STATUSES &&
+             getVarint(&p, end, &length) == 0 && length <= (uint64_t)(end - p);
+    if (ok) {
+        if (length + 1 > coordinator.pathCapacity) {
+            free(coordinator.path);
+            coordinator.pathCapacity = length + 1;
+            coordinator.path = (char *)malloc(coordinator.pathCapacity);
+            if (!coordinator.path) {
+                perror("Failed to allocate result path");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(coordinator.path, p, length);
+        coordinator.path[length] = '\0';
+        p += length;
+    }
+    if (ok && status == 0) {
+        for (int i = 0; i < 26 && ok; i++) ok = getVarint(&p, end, &counts[i]) == 0;
+        ok = ok && getVarint(&p, end, &numPairs) == 0 && numPairs <= MAX_RESULT_PAIRS;
+        if (ok && numPairs > coordinator.pairsCapacity) {
+            free(coordinator.pairs);
+            coordinator.pairsCapacity = numPairs;
+            coordinator.pairs = (struct HistogramPair *)malloc(numPairs * sizeof(*coordinator.pairs));
+            if (!coordinator.pairs) {
+                perror("Failed to allocate histogram pairs");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (uint64_t i = 0; i < numPairs && ok; i++) {
+            uint64_t bucket = 0, count = 0; // Stored even when the record turns out malformed
+            ok = getVarint(&p, end, &bucket) == 0 && bucket <= UINT32_MAX && getVarint(&p, end, &count) == 0;
+            coordinator.pairs[i] = (struct HistogramPair){ bucket, 0, count };
+        }
+    }
+    if (!ok || p != end) {
+        LOG(LEVEL_ERROR, "Error: a shard sent a malformed RESULT record.\n");
+        return -1;
+    }
+
+    c->records++;
+    coordinator.merged++;
+    if (status == 0) {
+        LOG(LEVEL_INFO, "Coordinator received the histogram of %s from shard %d.\n", coordinator.path, c->shard + 1);
+        saveHistogram(getpid(), task, coordinator.path, counts, coordinator.pairs, numPairs);
+    } else {
+        LOG(LEVEL_ERROR, "Shard %d failed to process %s.\n", c->shard + 1, coordinator.path);
+        saveFailure(task, coordinator.path, status);
+    }
+    return 0;
+}
+
+/**
+ * Handles an END record: checks every result arrived and confirms it to
+ * the shard.
+ * @return 1 once the shard is done, -1 to drop the connection
+ */
+static int endRecord(struct ShardConnection *c, const unsigned char *p, const unsigned char *end) {
+    uint64_t records;
+    if (c->shard < 0 || getVarint(&p, end, &records) < 0 || p != end) {
+        LOG(LEVEL_ERROR, "Error: a shard sent a malformed END record.\n");
+        return -1;
+    }
+    if (records != c->records) {
+        LOG(LEVEL_ERROR, "Error: shard %d sent %" PRIu64 " results but announced %" PRIu64 ".\n",
+                         c->shard + 1, c->records, records);
+        return -1;
+    }
+    unsigned char reply[WIRE_HEADER_SIZE + VARINT_MAX];
+    size_t length = putVarint(reply + WIRE_HEADER_SIZE, c->records);
+    putWireHeader(reply, WIRE_END, length);
+    writeFull(c->fd, reply, WIRE_HEADER_SIZE + length); // The shard reports a reply that doesn't arrive
+    coordinator.shards[c->shard] = SHARD_DONE;
+    coordinator.shardsLeft--;
+    LOG(LEVEL_INFO, "Shard %d/%d finished with %" PRIu64 " results.\n", c->shard + 1, coordinator.numShards, records);
+    return 1;
+}
+
+/**
+ * Counts the shards sending results right now.
+ */
+static int connectedShards(void) {
+    int connected = 0;
+    for (int i = 0; i < coordinator.numShards; i++) connected += coordinator.shards[i] == SHARD_CONNECTED;
+    return connected;
+}
+
+/**
+ * Closes a connection; a shard that hadn't finished is counted as failed.
+ */
+static void closeShardConnection(struct ShardConnection *c) {
+    if (c->shard >= 0 && coordinator.shards[c->shard] == SHARD_CONNECTED) {
+        LOG(LEVEL_ERROR, "Error: shard %d/%d disconnected before finishing; its results are incomplete.\n",
+                         c->shard + 1, coordinator.numShards);
+        coordinator.shards[c->shard] = SHARD_FAILED;
+        coordinator.shardsLeft--;
+        coordinator.numFailed++;
+    }
+    close(c->fd); // Also removes it from the epoll set
+    free(c->buffer);
+    *c = (struct ShardConnection){ .fd = -1, .shard = -1 };
+}
+
+/**
+ * Reads what a connection has sent and handles every complete record.
+ */
+static void readShardConnection(struct ShardConnection *c) {
+    if (c->capacity - c->used < WIRE_FLUSH) {
+        size_t capacity = c->used + 2 * WIRE_FLUSH;
+        unsigned char *buffer = (unsigned char *)realloc(c->buffer, capacity);
+        if (!buffer) {
+            perror("Failed to allocate connection buffer");
+            exit(EXIT_FAILURE);
+        }
+        c->buffer = buffer;
+        c->capacity = capacity;
+    }
+    STATS_BEGIN(timer);
+    ssize_t n = read(c->fd, c->buffer + c->used, c->capacity - c->used);
+    STATS_END(STAGE_TRANSFER, timer, 1);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) {
+        closeShardConnection(c);
+        return;
+    }
+    c->used += n;
+
+    size_t offset = 0, needed = 0;
+    int rc = 0;
+    while (rc == 0 && c->used - offset >= WIRE_HEADER_SIZE) {
+        const unsigned char *header = c->buffer + offset;
+        size_t length = getLittle(header + 8, 4);
+        if (memcmp(header, "HSTR", 4) != 0 || getLittle(header + 4, 2) != WIRE_VERSION ||
+            length > MAX_WIRE_RECORD) {
+            LOG(LEVEL_ERROR, "Error: a shard sent a record of an unknown format or version.\n");
+            rc = -1;
+            break;
+        }
+        if (c->used - offset < WIRE_HEADER_SIZE + length) {
+            needed = WIRE_HEADER_SIZE + length;
+            break;
+        }
+        const unsigned char *body = header + WIRE_HEADER_SIZE;
+        switch (getLittle(header + 6, 2)) {
+        case WIRE_HELLO: rc = helloRecord(c, body, body + length); break;
+        case WIRE_RESULT: rc = resultRecord(c, body, body + length); break;
+        case WIRE_END: rc = endRecord(c, body, body + length); break;
+        default: break; // Types added by later versions of the same format are skipped
+        }
+        offset += WIRE_HEADER_SIZE + length;
+    }
+    if (rc != 0) {
+        closeShardConnection(c);
+        return;
+    }
+    memmove(c->buffer, c->buffer + offset, c->used - offset);
+    c->used -= offset;
+
+    // Room for the whole of a record that hasn't fully arrived
+    if (needed > c->capacity) {
+        unsigned char *buffer = (unsigned char *)realloc(c->buffer, needed);
+        if (!buffer) {
+            perror("Failed to allocate connection buffer");
+            exit(EXIT_FAILURE);
+        }
+        c->buffer = buffer;
+        c->capacity = needed;
+    }
+}
+
+/**
+ * Runs the coordinator: listens on listenAddress and saves the results shards
+ * send until every shard has finished or failed.
+ * @return The exit status, EXIT_FAILURE if any shard's results are incomplete
+ */
+int runCoordinator(void) {
+    struct addrinfo *addresses = resolveAddress(listenAddress, 1);
+    if (!addresses) exit(EXIT_FAILURE);
+    int listenFd = -1, error = 0;
+    for (struct addrinfo *a = addresses; a && listenFd < 0; a = a->ai_next) {
+        listenFd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (listenFd < 0) continue;
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listenFd, a->ai_addr, a->ai_addrlen) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+            error = errno;
+            close(listenFd);
+            listenFd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (listenFd < 0) {
+        LOG(LEVEL_ERROR, "Error listening on %s: %s\n", listenAddress, strerror(error));
+        exit(EXIT_FAILURE);
+    }
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        perror("Error creating event loop");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX; // Tag for the listening socket; connections use their slot
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    // A shard that goes away must fail its reply, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+    if (startStats(1) < 0) return EXIT_FAILURE;
+    startWriter();
+    if (binaryOutput) openResults();
+    LOG(LEVEL_INFO, "Coordinator listening on %s.\n", listenAddress);
+
+    while (!stopRequested && (coordinator.numShards == 0 || coordinator.shardsLeft > 0)) {
+        reportProgress(connectedShards(), coordinator.numShards, 0, 0);
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, progressTimeout());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u32 != UINT32_MAX) {
+                struct ShardConnection *c = &coordinator.connections[events[e].data.u32];
+                if (c->fd != -1) readShardConnection(c);
+                continue;
+            }
+
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            int slot = 0;
+            while (slot < coordinator.numConnections && coordinator.connections[slot].fd != -1) slot++;
+            if (slot == coordinator.numConnections) {
+                struct ShardConnection *connections = (struct ShardConnection *)realloc(
+                    coordinator.connections, (slot + 1) * sizeof(*connections));
+                if (!connections) {
+                    perror("Failed to allocate connection");
+                    exit(EXIT_FAILURE);
+                }
+                coordinator.connections = connections;
+                coordinator.numConnections++;
+            }
+            coordinator.connections[slot] = (struct ShardConnection){ .fd = fd, .shard = -1 };
+            ev.events = EPOLLIN;
+            ev.data.u32 = slot;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    reportProgress(0, coordinator.numShards, 0, 1);
+
+    // Connections that never said HELLO don't belong to any shard; after a
+    // stop the others count as failed
+    for (int i = 0; i < coordinator.numConnections; i++) {
+        if (coordinator.connections[i].fd != -1) closeShardConnection(&coordinator.connections[i]);
+    }
+    free(coordinator.connections);
+    free(coordinator.shards);
+    free(coordinator.path);
+    free(coordinator.pairs);
+    close(epollFd);
+    close(listenFd);
+    stopWriter();
+    if (binaryOutput) closeResults();
+    LOG(LEVEL_NOTICE, "Merged %" PRIu64 " results from %d shards.\n", coordinator.merged, coordinator.numShards);
+    if (coordinator.numFailed > 0) {
+        LOG(LEVEL_ERROR, "Error: %d of %d shards did not finish.\n", coordinator.numFailed, coordinator.numShards);
+    }
+    int status = finishRun();
+    reportStats();
+    return coordinator.numFailed > 0 ? EXIT_FAILURE : status;
+}
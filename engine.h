@@ -0,0 +1,714 @@
+/**
+ * Declarations shared by the files of the engine. Everything here has hidden
+ * visibility; what users of the library see is declared in histogram.h.
+ */
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#define _GNU_SOURCE  // POSIX.1-2008 plus the Linux extensions used here (memfd_create, eventfd, syscall)
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#ifndef WITH_ZLIB
+#define WITH_ZLIB 0 // gzip input; the makefile enables it, ZLIB=0 builds without
+#endif
+#ifndef WITH_ZSTD
+#define WITH_ZSTD 0 // zstd input; build with ZSTD=1 where libzstd is installed
+#endif
+#include "histogram.h"
+#ifndef ENABLE_STATS
+#define ENABLE_STATS 1 // Build with -DENABLE_STATS=0 to compile --stats out entirely
+#endif
+
+#define BUFFER_SIZE 1000 // Buffer size for reading data and lines
+#define MAX_WORKERS HISTOGRAM_MAX_WORKERS // Maximum number of workers in the pool
+#define MAX_EVENTS 64    // epoll events handled per wakeup
+#define RING_SLOTS 1024  // Result ring capacity; batches can fill it, and producers then wait for the parent
+#define DEFAULT_SCAN_THREADS 4  // Directory traversal threads with -r
+#define SCAN_QUEUE_SIZE 4096    // Discovered files waiting to be scheduled
+#define MAX_BATCH 64            // Tasks sent to a worker at once with --schedule=batched
+#define MAX_NUMA_NODES 64       // Nodes --numa=auto can place on; one word of node mask
+#define WIRE_VERSION 1          // Version of the records shards send their coordinator
+#define WIRE_HEADER_SIZE 12     // "HSTR", 16-bit version, 16-bit type, 32-bit body length
+#define WIRE_FLUSH (64 << 10)   // Record bytes a shard buffers before sending them
+#define VARINT_MAX 10           // Longest LEB128 encoding of a 64-bit value
+#define MAX_SHARDS HISTOGRAM_MAX_SHARDS // Largest N of --shard=K/N
+#define SCHEDULE_WINDOW 4096    // Inputs sorted by size at a time with --schedule=lpt
+#define MAX_CLASSES 255          // Classes of a custom alphabet; one more index means "not counted"
+#define MAX_RESULT_PAIRS (BUCKET_INVALID + 1 + 256 + MAX_CLASSES) // Most buckets one histogram can have
+
+/**
+ * Result message sent from a worker back to the parent over its result pipe.
+ * Version 1 was a bare array of 26 int counts; version 2 adds this header and
+ * widens the counts to 64 bits so letters past 2^31 occurrences don't wrap.
+ * Version 3 follows the message with numPairs HistogramPair records, which
+ * carry the byte and codepoint buckets of --histogram=bytes and utf8 and the
+ * classes of --alphabet and --case.
+ */
+#define RESULT_VERSION 3
+struct ResultMessage {
+    uint32_t version;    // RESULT_VERSION
+    int32_t task;        // Task number this result belongs to
+    int32_t status;      // A TaskStatus: 0 on success
+    uint32_t numPairs;   // HistogramPair records that follow, 0 with --histogram=letters
+    uint64_t counts[26]; // Letter counts (a-z)
+};
+
+/**
+ * Records a shard sends its coordinator over TCP (--coordinator, --listen).
+ * They carry what a ResultMessage and its pairs carry, in a compact form
+ * that doesn't depend on either host: a WIRE_HEADER_SIZE header of the bytes
+ * "HSTR", the WIRE_VERSION, the type and the body length, all little-endian,
+ * followed by a body of LEB128 varints:
+ *   HELLO  shard, shards, histogram mode, number of class labels, the labels
+ *   RESULT task, status, path length, path bytes; if status is 0 also the
+ *          26 counts, numPairs and numPairs (bucket, count) pairs
+ *   END    number of RESULT records sent
+ * The coordinator answers END with an END of the records it merged.
+ */
+enum WireType {
+    WIRE_HELLO = 1,
+    WIRE_RESULT = 2,
+    WIRE_END = 3
+};
+
+/**
+ * Header of the persistent result cache. The file is an open-addressed hash
+ * table of CacheEntry slots keyed on (dev, ino), mapped with MAP_SHARED by
+ * every run that uses it. flock() on the file serialises runs: shared for
+ * lookups, exclusive for stores and for growing the table.
+ */
+#define CACHE_MAGIC "HISTCACH"
+#define CACHE_VERSION 2 // Bump whenever the counts a file produces change meaning (2: decompressed input)
+struct CacheFileHeader {
+    char magic[8];       // CACHE_MAGIC
+    uint32_t version;    // CACHE_VERSION
+    uint32_t entrySize;  // sizeof(struct CacheEntry)
+    uint64_t capacity;   // Number of slots, a power of two
+    uint64_t count;      // Slots in use, at most half the capacity
+    uint64_t reserved[4];
+};
+
+/**
+ * Identity of an input as far as the cache is concerned. A file whose size
+ * or modification time differs from its cached key is counted again.
+ */
+struct CacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+};
+
+/**
+ * One slot of the shared-memory result ring. The sequence number tells
+ * producers and the consumer whose turn the slot is (Vyukov bounded queue):
+ * equal to the enqueue position when free, position + 1 once published.
+ */
+struct RingSlot {
+    _Atomic uint64_t sequence;
+    int32_t worker;               // Slot of the worker that published the result
+    uint32_t reserved;
+    struct ResultMessage message;
+};
+
+/**
+ * Multi-producer, single-consumer ring of result records, shared between the
+ * parent and every worker through a memfd mapping created before the fork.
+ * Workers publish with atomic stores only; the parent consumes without any
+ * syscall and is woken through an eventfd only if it said it was going to
+ * sleep. A worker that dies between taking a position and publishing it is
+ * found through claims, so the parent can skip its slot.
+ */
+struct ResultRing {
+    _Atomic uint64_t head;            // Next enqueue position (workers)
+    char headPad[56];                 // Keep producers and consumer on separate cache lines
+    _Atomic uint64_t tail;            // Next dequeue position (parent only)
+    _Atomic int consumerWaiting;      // Set while the parent may block in epoll_wait()
+    char tailPad[52];
+    struct RingSlot slots[RING_SLOTS];
+    _Atomic uint64_t claims[MAX_WORKERS]; // Per worker: 1 + the position it is taking, 0 once published
+};
+
+/**
+ * An input on its way to a worker.
+ */
+struct QueuedTask {
+    char *path;   // Owned
+    int task;     // Task number
+    off_t size;   // File size when the schedule needed it, -1 if unknown or not a regular file
+    int cacheable;        // Whether key is valid and the result should be cached
+    struct CacheKey key;
+    int homeNode;         // 1 + NUMA node caching most of the file with --numa=auto, 0 if unknown
+    int attempts;         // Attempts already made; nonzero for retries
+};
+
+/**
+ * A task a worker has been sent but not yet reported.
+ */
+struct InFlightTask {
+    int task;     // Task number
+    char *path;   // Input path, owned
+    int cacheable;        // Whether to cache the result under key
+    struct CacheKey key;
+    int attempts;         // Attempts made before this one
+    off_t offset;         // Range dispatched, for a retry
+    off_t length;         // -1 for the whole file
+};
+
+/**
+ * A task waiting to be tried again.
+ */
+struct RetryTask {
+    struct QueuedTask input; // Owns its path
+    off_t offset;            // Range of a split input ...
+    off_t length;            // ... or -1 for the whole file
+    struct timespec due;     // Not dispatched before this
+};
+
+/**
+ * Grow-only buffer that a worker reads whole inputs into. It keeps its
+ * largest size for the rest of the run, so once it has grown to the largest
+ * input, reading a file allocates nothing.
+ */
+struct Arena {
+    char *base;      // Anonymous mapping, NULL until first use
+    size_t capacity; // Multiple of ARENA_ALIGN
+};
+
+/**
+ * Compression format of an input, recognised by its magic bytes.
+ */
+enum Compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP, // One or more gzip members
+    COMPRESSION_BGZF, // Blocked gzip (bgzip): members whose headers give their size
+    COMPRESSION_ZSTD  // One or more zstd frames
+};
+
+/**
+ * A class kernel adds the bytes in Data to the class counts of an alphabet
+ * policy, through the policy's byte-to-class table.
+ */
+typedef void (*ClassKernel)(const unsigned char *Data, size_t Size, uint64_t *counts);
+
+/**
+ * An alphabet and case policy (--alphabet, --case) other than the default
+ * case-folded a-z, which keeps the SIMD letter kernels.
+ */
+struct ClassPolicy {
+    const char *name;
+    const unsigned char *table; // Byte -> class index, numClasses if not counted
+    const unsigned char *labels; // Character labelling each class, ascending
+    int numClasses;
+    ClassKernel kernel;          // Specialised for this table
+};
+
+/**
+ * CPUs and NUMA nodes available to the run, read from sysfs. Worker w runs
+ * on cpus[w % numCpus]; the list takes each node in turn, so consecutive
+ * workers are spread over the nodes.
+ */
+struct Topology {
+    int numCpus;                        // CPUs in this process's affinity mask
+    int cpus[CPU_SETSIZE];
+    int nodeOfCpu[CPU_SETSIZE];
+    int numNodes;                       // Highest node with usable CPUs, plus one
+    int nodeWorkers[MAX_NUMA_NODES];    // Workers placed on each node
+};
+
+/**
+ * Identity of a directory, to avoid symlink loops with --symlinks=follow.
+ */
+struct DirId {
+    dev_t dev;
+    ino_t ino;
+};
+
+
+/**
+ * Parent-side state of one child process: a pool worker or a one-off "SIG"
+ * child. Workers occupy the first numWorkers entries of the children array.
+ */
+struct ChildContext {
+    pid_t pid;
+    int resultFd;            // Read end of the worker's result pipe, -1 if none
+    int taskFd;              // Write end of the worker's task pipe, -1 if none
+    struct InFlightTask tasks[MAX_BATCH]; // Tasks in flight, in the order the worker runs them
+    int numTasks;            // Number of tasks in flight, 0 if idle
+    int nextTask;            // Index in tasks of the next result due
+    struct timespec started; // When the tasks in flight were dispatched
+    int reaped;              // Set once the child has been reaped
+    int exitStatus;          // waitpid() status once reaped
+};
+
+// Checks the level before the arguments are even evaluated, so disabled
+// records cost one branch on the hot path
+#define LOG(level, ...) \
+    do { if ((level) <= logLevel) logMessage(level, __VA_ARGS__); } while (0)
+
+/**
+ * A large input whose byte ranges are counted by several workers. The partial
+ * histograms are summed here until every range has reported.
+ */
+struct SplitInput {
+    int task;            // Task number of the input
+    char *path;          // Path of the input, owned
+    int cacheable;       // Whether to cache the merged result under key
+    struct CacheKey key;
+    int partsLeft;       // Ranges dispatched or pending that haven't reported
+    int failed;          // Status of a failed range, 0 if none failed
+    uint64_t counts[26]; // Sum of the ranges reported so far
+};
+
+/**
+ * An open directory of the scan, kept open while subdirectories found in it
+ * wait on the stack, so they are opened relative to it with openat() rather
+ * than by resolving their whole path again.
+ */
+struct DirHandle {
+    int fd;
+    _Atomic int refs; // The listing thread, plus one per subdirectory not opened yet
+};
+
+/**
+ * A directory waiting on the scan stack.
+ */
+struct ScanDir {
+    char *path;                // Whole path, for the files found in it and for messages
+    size_t nameOffset;         // Start of its name in path, opened relative to parent
+    struct DirHandle *parent;  // NULL for a -r root
+};
+
+/**
+ * State of the recursive directory scan (-r). Traversal threads take
+ * directories off a shared stack, list them with getdents64() and push the
+ * files they find onto a bounded queue that the scheduler drains, so
+ * counting starts while the scan is still running.
+ */
+struct DirScan {
+    pthread_mutex_t lock;
+    pthread_cond_t dirsReady;     // Directories pushed or the scan finished
+    pthread_cond_t notFull;       // Files taken off the queue
+    pthread_cond_t notEmpty;      // Files pushed or the scan finished
+    char **roots;                 // Directories given with -r
+    int numRoots;
+    int numThreads;               // Traversal threads, --scan-threads
+    pthread_t *threads;
+    struct ScanDir *dirs;         // Directories waiting to be listed
+    int numDirs;
+    int dirCapacity;
+    int activeWalkers;            // Threads listing a directory right now
+    char *files[SCAN_QUEUE_SIZE]; // Discovered files, oldest at head
+    int head;
+    int count;
+    int done;                     // Set once every directory has been listed
+    _Atomic uint64_t failedDirs;  // Directories that could not be opened or listed
+    struct DirId *visited;        // Open-addressed set for SYMLINKS_FOLLOW
+    size_t visitedCount;
+    size_t visitedCapacity;
+    enum SymlinkPolicy symlinks;  // --symlinks
+    off_t minSize;                // --min-size
+    off_t maxSize;                // --max-size, -1 for no limit
+    int eventFd;                  // Written as files arrive in processes mode, else -1
+};
+
+/**
+ * Where input paths come from: the command line first, then the --files-from
+ * list. The list is read one entry at a time as the scheduler asks for work,
+ * so memory use doesn't depend on how many paths it holds.
+ */
+struct InputSource {
+    pthread_mutex_t lock;   // Threads mode pulls inputs from several threads
+    char **argv;            // Paths given on the command line
+    int argc;               // Number of command-line paths
+    int next;               // Next command-line path
+    const char *listPath;   // --files-from argument ("-" for stdin), or NULL
+    FILE *list;             // The open list, once reading has started
+    int delimiter;          // Entry separator in the list: '\n', or '\0' with --null
+    char *entry;            // getdelim() buffer
+    size_t entryCapacity;
+    int listDone;           // Set once the list has been read to the end
+    off_t listSize;         // Size of the list if it is a regular file, else 0
+    uint64_t listEntries;   // Entries read from the list so far
+    int exhausted;          // Set once every input has been handed out
+    int lastTask;           // Task number of the last input handed out
+};
+
+/**
+ * The persistent result cache as used by this process.
+ */
+struct ResultCache {
+    pthread_mutex_t lock;   // Threads mode shares one mapping between threads
+    const char *path;       // --cache, or NULL for the default location
+    int disabled;           // --no-cache
+    int fd;                 // The cache file, -1 if not in use
+    struct CacheFileHeader *header; // Mapping of the whole file
+    size_t mappedSize;
+    time_t openedAt;        // Files modified since then aren't stored
+    uint64_t hits;          // Lookups answered from the cache
+};
+
+/**
+ * Inputs read ahead for --schedule=lpt, as a max-heap on size.
+ */
+struct LptWindow {
+    pthread_mutex_t lock;  // Threads mode picks inputs from several threads
+    struct QueuedTask heap[SCHEDULE_WINDOW];
+    int count;
+};
+
+/**
+ * Binary results file being written. Counts rows go straight to the output
+ * file in arrival order; entries and path strings are spooled to temporary
+ * files and appended by closeResults(), so memory use doesn't grow with the
+ * number of files.
+ */
+struct ResultsWriter {
+    pthread_mutex_t lock;  // Taken by appendResult(); threads mode calls it concurrently
+    FILE *out;             // The results file
+    FILE *entries;         // Spooled struct ResultsEntry records
+    FILE *strings;         // Spooled path string table
+    FILE *pairs;           // Spooled struct HistogramPair records
+    uint64_t numFiles;
+    uint64_t stringsSize;
+    uint64_t numPairs;
+    uint64_t total[26];    // Sum of every counted file
+};
+
+/**
+ * Connection of a shard to its coordinator. Results are encoded into one
+ * buffer and sent WIRE_FLUSH bytes at a time, so a shard makes a syscall per
+ * few thousand small files rather than one per file.
+ */
+struct Uplink {
+    pthread_mutex_t lock;  // Threads mode sends results from several threads
+    int fd;                // Socket to the coordinator, -1 without --coordinator
+    unsigned char *buffer; // Encoded records not sent yet
+    size_t used;
+    size_t capacity;
+    uint64_t records;      // RESULT records encoded so far
+};
+
+/**
+ * An in-process run started by histogramStart(), which hands every result
+ * to a callback instead of saving it.
+ */
+struct Embedding {
+    HistogramCallback callback;      // NULL unless such a run is active
+    void *context;                   // Passed to the callback
+    pthread_t engine;                // Thread running runThreadEngine()
+    struct sigaction savedBusAction; // SIGBUS action to restore at the end
+};
+
+/**
+ * Progress of one shard as seen by the coordinator.
+ */
+enum ShardState {
+    SHARD_WAITING,   // Not connected yet
+    SHARD_CONNECTED, // Sending results
+    SHARD_DONE,      // Sent END with every result
+    SHARD_FAILED     // Disconnected early or broke the format; its results are incomplete
+};
+
+/**
+ * A connection accepted by the coordinator.
+ */
+struct ShardConnection {
+    int fd;                // -1 once closed
+    int shard;             // Shard named by the HELLO record, -1 before it
+    unsigned char *buffer; // Bytes received and not handled yet
+    size_t used;
+    size_t capacity;
+    uint64_t records;      // RESULT records merged
+};
+
+/**
+ * State of the coordinator (--listen), which merges the results of every
+ * shard into one set of outputs. Each record is saved by the same
+ * saveHistogram() and saveFailure() a single host uses, so the binary
+ * results file and its total come out as if one host had counted every input.
+ */
+struct Coordinator {
+    struct ShardConnection *connections;
+    int numConnections;
+    enum ShardState *shards; // Allocated by the first HELLO, which says how many there are
+    int numShards;
+    int shardsLeft;          // Shards neither done nor failed
+    int numFailed;
+    uint64_t merged;         // Results saved
+    char *path;              // NUL-terminated copy of the path being saved
+    size_t pathCapacity;
+    struct HistogramPair *pairs; // Pairs of the result being saved
+    uint32_t pairsCapacity;
+};
+
+/**
+ * What the progress reporter keeps between reports.
+ */
+struct ProgressState {
+    struct timespec started; // Start of the run
+    struct timespec last;    // Time of the last report
+    uint64_t lastBytes;      // Bytes counted by then
+    double rate;             // Bytes per second, smoothed over the last few reports
+    int reports;             // Reports written so far
+};
+
+// histogram.c
+extern enum InputMode inputMode;                    // Input mode used by workers
+extern size_t chunkSize;                            // Read size in streaming mode
+extern int queueDepth;                              // Reads in flight per worker with --input=uring
+extern enum HistogramMode histogramMode;            // What histograms count (--histogram)
+extern int simulateDelay;                           // Demo mode: sleep after each task (--simulate-delay)
+extern int binaryOutput;                            // Write one results file instead of .hist files
+extern const char *resultsPath;                     // Results file in binary output mode
+extern int pinWorkers;                              // --pin: one CPU per worker
+extern enum NumaMode numaMode;                      // --numa
+extern int numaRouting;                             // Send inputs to workers on the node caching them
+extern int shardIndex;                              // --shard=K/N: count only the inputs of shard K - 1 ...
+extern int numShards;                               // ... of N, or every input if 0
+extern const char *coordinatorAddress;              // --coordinator: send results there instead of saving them
+extern const char *listenAddress;                   // --listen: run as the coordinator
+extern int maxRetries;                              // --retries
+extern volatile sig_atomic_t stopRequested;         // Set by SIGINT or SIGTERM: finish what is in flight, then save
+extern _Atomic uint64_t statusCounts[NUM_STATUSES]; // Inputs saved with each status
+extern _Atomic uint64_t lostOutputs;                // .hist files that could not be written
+extern _Atomic uint64_t inputsTaken;                // Inputs of this node handed out so far
+extern enum ProgressFormat progressFormat;          // --progress
+extern int progressFd;                              // --progress-fd
+extern enum SchedulePolicy schedulePolicy;          // --schedule
+extern int numWorkers;                              // Number of workers in the pool
+extern off_t splitThreshold;                        // Minimum size for splitting a file, 0 to disable
+void histogramDefaults(struct HistogramOptions *options);
+int histogramRun(const struct HistogramOptions *options, int numPaths, char **paths);
+int histogramStart(const struct HistogramOptions *options, HistogramCallback callback, void *context);
+int histogramSubmitPath(const char *path);
+int histogramSubmitBuffer(const char *name, const void *data, size_t size);
+int histogramFinish(void);
+
+// report.c
+extern enum LogLevel logLevel; // Set by -q and -v
+extern struct ProgressState progress;
+void logMessage(enum LogLevel level, const char *format, ...);
+int finishRun(void);
+int startProgress(void);
+int progressTimeout(void);
+void reportProgress(int busy, int workers, uint64_t queued, int final);
+
+#if ENABLE_STATS
+/**
+ * Stages that --stats times. Under mmap input the page faults that read the
+ * file happen inside the kernel, so they count as histogram time.
+ */
+enum Stage {
+    STAGE_FORK,      // fork() of workers and "SIG" children (parent)
+    STAGE_SCAN,      // getdents64() and fstatat() of the directory scan
+    STAGE_CACHE,     // Result cache lookups and stores
+    STAGE_OPEN,      // open() and fstat() of inputs
+    STAGE_READ,      // read(), pread(), mmap() and madvise() of inputs
+    STAGE_HISTOGRAM, // Histogram kernels
+    STAGE_DECOMPRESS, // gzip and zstd decoding
+    STAGE_TRANSFER,  // Task and result messages, both ends
+    STAGE_OUTPUT,    // .hist files and the binary results file
+    NUM_STAGES
+};
+
+/**
+ * Counters of one worker process or thread; slot 0 is shared by the parent's
+ * threads. Updated with relaxed atomics, and in processes mode kept in a
+ * shared mapping so the parent can read every worker's slot at the end.
+ */
+struct WorkerStats {
+    _Atomic uint64_t stageNanoseconds[NUM_STAGES];
+    _Atomic uint64_t stageCalls[NUM_STAGES]; // Syscalls made (kernel calls for the histogram stage)
+    _Atomic uint64_t bytes;          // Input bytes counted
+    _Atomic uint64_t files;          // Tasks completed
+    _Atomic uint64_t firstNanoseconds; // First and last activity since statsEpoch, +1 so 0 means none
+    _Atomic uint64_t lastNanoseconds;
+};
+
+/**
+ * Depth of a queue, sampled whenever something is added to it. Updated under
+ * the queue's own lock.
+ */
+struct QueueGauge {
+    uint64_t samples;
+    uint64_t sum;
+    uint64_t max;
+};
+
+#define STATS_BEGIN(timer) \
+    struct timespec timer; \
+    if (statsTable) clock_gettime(CLOCK_MONOTONIC, &timer)
+#define STATS_END(stage, timer, calls) \
+    do { if (statsTable) addStageTime(stage, &timer, calls); } while (0)
+#define STATS_ADD(field, n) \
+    do { if (statsTable) atomic_fetch_add_explicit(&currentStats()->field, n, memory_order_relaxed); } while (0)
+#define STATS_SAMPLE(gauge, depth) \
+    do { if (statsTable) sampleGauge(&gauge, depth); } while (0)
+
+extern enum StatsFormat statsFormat;                  // --stats
+extern struct WorkerStats *statsTable;                // Slot 0 for the parent, then one per worker
+extern _Thread_local struct WorkerStats *threadStats; // This thread's slot, NULL for slot 0
+extern struct QueueGauge busyGauge;                   // Workers busy, sampled at dispatch (parent)
+extern struct QueueGauge pendingGauge;                // Tasks in flight on a worker, sampled at dispatch
+extern struct QueueGauge writerGauge;                 // .hist files queued for the writer thread
+extern struct QueueGauge scanGauge;                   // Files queued by the directory scan
+struct WorkerStats *currentStats(void);
+void addStageTime(enum Stage stage, const struct timespec *start, uint64_t calls);
+void sampleGauge(struct QueueGauge *gauge, uint64_t depth);
+void countPlacement(int w, const struct QueuedTask *task);
+int startStats(int slots);
+void reportStats(void);
+#else
+#define STATS_BEGIN(timer)
+#define STATS_END(stage, timer, calls)
+#define STATS_ADD(field, n)
+#define STATS_SAMPLE(gauge, depth)
+#define startStats(slots) 0
+#define countPlacement(w, task)
+#define reportStats()
+#define statsFormat STATS_OFF
+#endif
+
+// scan.c
+extern struct DirScan scan;
+extern struct InputSource source;
+extern struct LptWindow lpt;
+void pushScannedFile(char *path);
+void startScan(int eventFd);
+void stopScan(void);
+int pickInput(struct QueuedTask *input, int wait);
+
+// cache.c
+extern struct ResultCache cache;
+void openCache(void);
+void closeCache(void);
+void setCacheKey(struct QueuedTask *input, const struct stat *st);
+int cacheLookup(const struct CacheKey *key, uint64_t counts[26]);
+void cacheStore(const struct CacheKey *key, const uint64_t counts[26]);
+
+// topology.c
+extern struct Topology topology;
+void readTopology(void);
+int workerNode(int w);
+void placeWorker(int w);
+int probeFileNode(const char *path, off_t size);
+
+// kernels.c
+extern const struct ClassPolicy *classPolicy; // --alphabet/--case policy, NULL for case-folded a-z
+extern const char *histogramKernelName;       // Name of the selected kernel
+void HistogramAccumulate(const char *Data, size_t Size, uint64_t histogram[26]);
+int selectClassPolicy(const char *alphabet, int fold, const struct ClassPolicy **policy);
+int selectHistogramKernel(const char *name);
+void beginHistogram(uint64_t counts[26]);
+void endHistogram(uint64_t counts[26]);
+int collectPairs(const struct HistogramPair **pairs, uint32_t *count);
+
+// files.c
+extern _Thread_local char *chunkBuffer;               // Worker's streaming buffer, reused across files
+extern _Thread_local struct Arena inputArena;         // Worker's buffer for whole files, reused across files
+extern _Thread_local unsigned char *compressedBuffer; // Compressed input read from pipes, reused
+ssize_t readFull(int fd, void *buf, size_t len);
+int writeFull(int fd, const void *buf, size_t len);
+int failureStatus(int error);
+long retryDelay(int attempt);
+void sleepMilliseconds(long milliseconds);
+void releaseArena(struct Arena *arena);
+enum Compression detectCompression(const unsigned char *head, size_t n);
+int canSplitFile(const char *path, off_t size);
+enum Compression sniffFile(int fd);
+int processCompressed(int fd, enum Compression compression, size_t fileSize,
+                      off_t offset, off_t length, uint64_t counts[26]);
+int streamHistogram(int fd, uint64_t counts[26]);
+void handleBusError(int sig);
+int processFile(const char *path, uint64_t counts[26]);
+int processRange(const char *path, off_t offset, off_t length, uint64_t counts[26]);
+
+// uring.c
+int probeUring(void);
+void closeUring(void);
+int uringQueue(const char *path, off_t offset, off_t length);
+int uringFinish(int stream, uint64_t counts[26]);
+
+// transport.c
+extern struct ResultRing *resultRing; // Shared result ring with --transport=shm, else NULL
+extern int ringEventFd;               // Wakes the parent when the ring has results
+extern struct Uplink uplink;
+void createResultRing(void);
+void publishResult(int w, const struct ResultMessage *result);
+int consumeResult(int *w, struct ResultMessage *result);
+int skipAbandonedSlot(void);
+int sendResults(int resultFd, const char *out, size_t *used);
+uint64_t getLittle(const unsigned char *in, int bytes);
+size_t putVarint(unsigned char *out, uint64_t value);
+int getVarint(const unsigned char **in, const unsigned char *end, uint64_t *value);
+void putWireHeader(unsigned char *out, enum WireType type, size_t length);
+struct addrinfo *resolveAddress(const char *address, int passive);
+void connectCoordinator(void);
+void sendResult(int task, int status, const char *path, const uint64_t counts[26],
+                const struct HistogramPair *pairs, uint32_t numPairs);
+int closeUplink(void);
+
+// pool.c
+extern struct ChildContext *children;            // Every child process, indexed by slot
+extern struct QueuedTask pending[MAX_BATCH + 1]; // Inputs picked that no worker has taken yet
+extern struct RetryTask *retries;                // Tasks waiting for their retry
+void delayTask(int task);
+void skipQueued(int drainSource);
+int runProcessesMode(int useSharedRing);
+
+// output.c
+extern struct ResultsWriter results;
+extern struct Embedding embedding;
+void startWriter(void);
+void stopWriter(void);
+void openResults(void);
+void closeResults(void);
+void saveFailure(int task, const char *path, int status);
+void saveHistogram(pid_t pid, int task, const char *path, const uint64_t counts[26],
+                   const struct HistogramPair *pairs, uint32_t numPairs);
+
+// coordinator.c
+extern struct Coordinator coordinator;
+int runCoordinator(void);
+
+// threads.c
+void runThreadEngine(void);
+int runThreadsMode(void);
+
+#endif
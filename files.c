@@ -0,0 +1,713 @@
+/**
+ * Reading inputs: whole files, chunks, mappings, byte ranges and
+ * compressed streams.
+ */
+#include "engine.h"
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#define ARENA_ALIGN (2 << 20) // Input arenas grow in whole 2M huge pages
+#define RETRY_BACKOFF_MS 100    // Delay before the first retry; doubles with each one ...
+#define RETRY_BACKOFF_MAX_MS 5000 // ... up to this
+
+_Thread_local char *chunkBuffer = NULL; // Worker's streaming buffer, reused across files
+_Thread_local struct Arena inputArena;  // Worker's buffer for whole files, reused across files
+_Thread_local unsigned char *compressedBuffer = NULL; // Compressed input read from pipes, reused
+static _Thread_local sigjmp_buf mappingLost; // Where a SIGBUS on a mapped input returns to
+static _Thread_local volatile sig_atomic_t countingMapped = 0; // Set while a mapped input is counted
+
+/**
+ * Reads exactly len bytes from fd, retrying on short reads and EINTR.
+ * @return len on success, 0 on clean EOF before any byte, -1 on error or truncated message
+ */
+ssize_t readFull(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return done == 0 ? 0 : -1;
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Writes exactly len bytes to fd, retrying on short writes and EINTR.
+ * @return 0 on success, -1 on error
+ */
+int writeFull(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Returns the status of a task that failed with the given errno: shortages
+ * of descriptors, memory or buffers may pass, so those are worth a retry.
+ */
+int failureStatus(int error) {
+    switch (error) {
+    case EMFILE: case ENFILE: case ENOMEM: case ENOBUFS: case EAGAIN: case EINTR: case ETIMEDOUT:
+        return STATUS_RETRY;
+    default:
+        return STATUS_FAILED;
+    }
+}
+
+/**
+ * Delay before retry number attempt (1 for the first), in milliseconds.
+ */
+long retryDelay(int attempt) {
+    long delay = RETRY_BACKOFF_MS;
+    while (--attempt > 0 && delay < RETRY_BACKOFF_MAX_MS) delay *= 2;
+    return delay < RETRY_BACKOFF_MAX_MS ? delay : RETRY_BACKOFF_MAX_MS;
+}
+
+/**
+ * Sleeps for the given number of milliseconds, signals or not.
+ */
+void sleepMilliseconds(long milliseconds) {
+    struct timespec delay = { milliseconds / 1000, milliseconds % 1000 * 1000000 };
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {}
+}
+
+/**
+ * Grows an arena to at least size bytes, keeping its contents. The arena at
+ * least doubles each time and is rounded up to whole huge pages, which it
+ * asks the kernel to back it with, so large inputs cost fewer page faults
+ * and TLB misses. Growing moves the pages with mremap() rather than copying.
+ * @return The arena's base, or NULL if it can't grow
+ */
+static char *reserveArena(struct Arena *arena, size_t size) {
+    if (size <= arena->capacity) return arena->base;
+    size_t capacity = arena->capacity * 2 > size ? arena->capacity * 2 : size;
+    capacity = (capacity + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void *base = arena->base ? mremap(arena->base, arena->capacity, capacity, MREMAP_MAYMOVE)
+                             : mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to allocate memory for file data");
+        return NULL;
+    }
+    madvise(base, capacity, MADV_HUGEPAGE); // Only a hint; fails without THP support
+    arena->base = (char *)base;
+    arena->capacity = capacity;
+    return arena->base;
+}
+
+/**
+ * Unmaps an arena. Worker processes never need to, since they run until
+ * the pool shuts down; threads release theirs when they finish.
+ */
+void releaseArena(struct Arena *arena) {
+    if (arena->base) munmap(arena->base, arena->capacity);
+    arena->base = NULL;
+    arena->capacity = 0;
+}
+
+/**
+ * Reads everything left on fd into the worker's input arena, growing it as
+ * needed. Works for pipes, FIFOs and /proc files whose size isn't known up
+ * front.
+ * @param sizeHint Expected size in bytes, or 0 if unknown
+ * @param outSize Receives the number of bytes read
+ * @return The data, valid until the next readAll() on this thread; NULL on error
+ */
+static char *readAll(int fd, size_t sizeHint, size_t *outSize) {
+    // One spare byte, so that a file that didn't grow ends with a 0-byte read
+    // instead of an arena twice its size
+    size_t used = 0;
+    char *data = reserveArena(&inputArena, sizeHint + 1);
+    if (!data) return NULL;
+
+    for (;;) {
+        if (used == inputArena.capacity) {
+            data = reserveArena(&inputArena, used + 1);
+            if (!data) return NULL;
+        }
+        STATS_BEGIN(timer);
+        ssize_t n = read(fd, data + used, inputArena.capacity - used);
+        STATS_END(STAGE_READ, timer, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Error reading file");
+            return NULL;
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    *outSize = used;
+    return data;
+}
+
+/**
+ * Returns the worker's chunk buffer, allocating it on first use.
+ * @return The buffer of chunkSize bytes, or NULL if it can't be allocated
+ */
+static char *getChunkBuffer(void) {
+    if (!chunkBuffer) {
+        chunkBuffer = (char *)malloc(chunkSize);
+        if (!chunkBuffer) perror("Failed to allocate streaming buffer");
+    }
+    return chunkBuffer;
+}
+
+/**
+ * Recognises a compressed input from its first bytes.
+ * @param n Bytes available in head; 18 are enough to tell BGZF from gzip
+ */
+enum Compression detectCompression(const unsigned char *head, size_t n) {
+    if (n >= 4 && head[0] == 0x28 && head[1] == 0xB5 && head[2] == 0x2F && head[3] == 0xFD) {
+        return COMPRESSION_ZSTD;
+    }
+    if (n < 2 || head[0] != 0x1F || head[1] != 0x8B) return COMPRESSION_NONE;
+    // BGZF: FEXTRA with XLEN 6 holding one "BC" subfield of length 2
+    if (n >= 18 && (head[3] & 4) && head[10] == 6 && head[11] == 0 &&
+        head[12] == 'B' && head[13] == 'C' && head[14] == 2 && head[15] == 0) {
+        return COMPRESSION_BGZF;
+    }
+    return COMPRESSION_GZIP;
+}
+
+/**
+ * Size of the BGZF block at data, from its BSIZE field.
+ * @return Block size, or 0 if data doesn't start with a BGZF block
+ */
+static size_t bgzfBlockSize(const unsigned char *data, size_t size) {
+    if (size < 18 || detectCompression(data, 18) != COMPRESSION_BGZF) return 0;
+    size_t blockSize = (data[16] | (size_t)data[17] << 8) + 1;
+    return blockSize <= size ? blockSize : 0;
+}
+
+/**
+ * Size of the zstd frame (or skippable frame) at data.
+ * @return Frame size, or 0 if data doesn't start with a complete frame
+ */
+static size_t zstdFrameSize(const unsigned char *data, size_t size) {
+#if WITH_ZSTD
+    size_t frameSize = ZSTD_findFrameCompressedSize(data, size);
+    return ZSTD_isError(frameSize) ? 0 : frameSize;
+#else
+    (void)data;
+    (void)size;
+    return 0;
+#endif
+}
+
+/**
+ * Compressed bytes on their way to a decoder: a span already in memory
+ * (a mapping, or a chunk read while sniffing a pipe), then whatever fd
+ * still has, read through the thread's compressed buffer.
+ */
+struct CompressedInput {
+    const unsigned char *data; // Bytes not yet handed to the decoder
+    size_t size;
+    int fd;                    // Source of more bytes, -1 once data is all there is
+};
+
+#if WITH_ZLIB || WITH_ZSTD
+/**
+ * Hands the next piece of compressed input to a decoder.
+ * @param piece Receives the bytes; at most 1G at a time, for zlib's 32-bit counters
+ * @return Bytes in piece, 0 at the end of the input, -1 on a read error
+ */
+static ssize_t nextCompressed(struct CompressedInput *in, const unsigned char **piece) {
+    if (in->size == 0 && in->fd >= 0) {
+        if (!compressedBuffer) {
+            compressedBuffer = (unsigned char *)malloc(chunkSize);
+            if (!compressedBuffer) {
+                perror("Failed to allocate decompression buffer");
+                return -1;
+            }
+        }
+        ssize_t n;
+        do {
+            STATS_BEGIN(timer);
+            n = read(in->fd, compressedBuffer, chunkSize);
+            STATS_END(STAGE_READ, timer, 1);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            perror("Error reading file");
+            return -1;
+        }
+        if (n == 0) in->fd = -1;
+        in->data = compressedBuffer;
+        in->size = n;
+    }
+    size_t n = in->size < (1u << 30) ? in->size : (1u << 30);
+    *piece = in->data;
+    in->data += n;
+    in->size -= n;
+    return n;
+}
+#endif
+
+/**
+ * Decompresses gzip members back to back and counts their contents, one
+ * chunk buffer of output at a time. Concatenated members (cat a.gz b.gz,
+ * pigz, BGZF) are all read.
+ * @param limit Stop at the first member that would start this many bytes or
+ *              more into the input, -1 to read to the end; ranges of a BGZF
+ *              file use it to take only the blocks that start inside them
+ * @return 0 on success, 1 on a read error or corrupt or truncated data
+ */
+static int gunzipHistogram(struct CompressedInput *in, off_t limit, uint64_t counts[26]) {
+#if WITH_ZLIB
+    static _Thread_local z_stream z; // Reused across files, like the zstd context
+    static _Thread_local int ready = 0;
+    if (!getChunkBuffer()) return 1;
+    if (!ready) {
+        memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, 15 + 16) != Z_OK) { // 16: expect the gzip wrapper
+            LOG(LEVEL_ERROR, "Error initialising zlib.\n");
+            return 1;
+        }
+        ready = 1;
+    } else {
+        inflateReset(&z);
+    }
+    z.avail_in = 0;
+
+    int status = 0, inMember = 0;
+    uint64_t consumed = 0;
+    uInt outSize = chunkSize < UINT_MAX ? chunkSize : UINT_MAX;
+    for (;;) {
+        if (z.avail_in == 0) {
+            const unsigned char *piece;
+            ssize_t n = nextCompressed(in, &piece);
+            if (n <= 0) {
+                if (n < 0 || inMember) {
+                    if (n == 0) LOG(LEVEL_ERROR, "Error: truncated gzip data.\n");
+                    status = 1;
+                }
+                break;
+            }
+            z.next_in = (Bytef *)piece;
+            z.avail_in = n;
+        }
+
+        z.next_out = (Bytef *)chunkBuffer;
+        z.avail_out = outSize;
+        uInt before = z.avail_in;
+        inMember = 1;
+        STATS_BEGIN(timer);
+        int rc = inflate(&z, Z_NO_FLUSH);
+        STATS_END(STAGE_DECOMPRESS, timer, 0);
+        consumed += before - z.avail_in;
+        HistogramAccumulate(chunkBuffer, outSize - z.avail_out, counts);
+
+        if (rc == Z_STREAM_END) {
+            inMember = 0;
+            if (limit >= 0 && consumed >= (uint64_t)limit) break;
+            inflateReset(&z); // Another member may follow
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            LOG(LEVEL_ERROR, "Error: corrupt gzip data (%s).\n", z.msg ? z.msg : "unknown error");
+            status = 1;
+            break;
+        }
+    }
+    return status;
+#else
+    (void)in;
+    (void)limit;
+    (void)counts;
+    LOG(LEVEL_ERROR, "Error: gzip input needs a build with ZLIB=1.\n");
+    return 1;
+#endif
+}
+
+/**
+ * Decompresses zstd frames back to back and counts their contents, one chunk
+ * buffer of output at a time.
+ * @return 0 on success, 1 on a read error or corrupt or truncated data
+ */
+static int unzstdHistogram(struct CompressedInput *in, uint64_t counts[26]) {
+#if WITH_ZSTD
+    static _Thread_local ZSTD_DCtx *context = NULL; // Reused across files
+    if (!getChunkBuffer()) return 1;
+    if (!context) context = ZSTD_createDCtx();
+    if (!context) {
+        LOG(LEVEL_ERROR, "Error initialising zstd.\n");
+        return 1;
+    }
+    ZSTD_DCtx_reset(context, ZSTD_reset_session_only);
+
+    ZSTD_inBuffer input = { NULL, 0, 0 };
+    size_t hint = 0; // 0 between frames
+    int status = 0, pending = 0;
+    for (;;) {
+        if (input.pos == input.size && !pending) {
+            const unsigned char *piece;
+            ssize_t n = nextCompressed(in, &piece);
+            if (n <= 0) {
+                status = n < 0;
+                break;
+            }
+            input.src = piece;
+            input.size = n;
+            input.pos = 0;
+        }
+
+        ZSTD_outBuffer output = { chunkBuffer, chunkSize, 0 };
+        STATS_BEGIN(timer);
+        hint = ZSTD_decompressStream(context, &output, &input);
+        STATS_END(STAGE_DECOMPRESS, timer, 0);
+        if (ZSTD_isError(hint)) {
+            LOG(LEVEL_ERROR, "Error: corrupt zstd data (%s).\n", ZSTD_getErrorName(hint));
+            return 1;
+        }
+        HistogramAccumulate(chunkBuffer, output.pos, counts);
+        pending = output.pos == output.size && hint != 0; // The decoder may hold more output
+    }
+    if (status == 0 && hint != 0) {
+        LOG(LEVEL_ERROR, "Error: truncated zstd data.\n");
+        status = 1;
+    }
+    return status;
+#else
+    (void)in;
+    (void)counts;
+    LOG(LEVEL_ERROR, "Error: zstd input needs a build with ZSTD=1.\n");
+    return 1;
+#endif
+}
+
+/**
+ * Decompresses an input with the decoder for its format.
+ */
+static int decompressHistogram(enum Compression compression, struct CompressedInput *in, off_t limit,
+                        uint64_t counts[26]) {
+    if (compression == COMPRESSION_ZSTD) return unzstdHistogram(in, counts);
+    return gunzipHistogram(in, limit, counts);
+}
+
+/**
+ * Counts the decompressed contents of the frames (zstd) or blocks (BGZF) of
+ * a mapped file that start in [offset, offset + length). The frame
+ * boundaries are found by walking the frame headers from the start of the
+ * file, which touches a few bytes per frame and decodes nothing, so every
+ * range of a split compressed file is counted independently.
+ * @return 0 on success, 1 on corrupt data
+ */
+static int decompressRange(enum Compression compression, const unsigned char *data, size_t size,
+                    off_t offset, off_t length, uint64_t counts[26]) {
+    size_t start = 0;
+    while (start < (size_t)offset) {
+        size_t frameSize = compression == COMPRESSION_ZSTD ? zstdFrameSize(data + start, size - start)
+                                                           : bgzfBlockSize(data + start, size - start);
+        if (frameSize == 0) {
+            LOG(LEVEL_ERROR, "Error: corrupt frame header in compressed input.\n");
+            return 1;
+        }
+        start += frameSize;
+    }
+    if (start >= (size_t)(offset + length) || start >= size) return 0; // No frame starts here
+
+    struct CompressedInput in = { data + start, size - start, -1 };
+    if (compression == COMPRESSION_ZSTD) {
+        // zstd frames don't stop the decoder, so hand it exactly our frames
+        size_t end = start;
+        while (end < (size_t)(offset + length) && end < size) {
+            size_t frameSize = zstdFrameSize(data + end, size - end);
+            if (frameSize == 0) {
+                LOG(LEVEL_ERROR, "Error: corrupt frame header in compressed input.\n");
+                return 1;
+            }
+            end += frameSize;
+        }
+        in.size = end - start;
+    }
+    return decompressHistogram(compression, &in, offset + length - start, counts);
+}
+
+/**
+ * Tells whether a large file can be split into ranges that workers count
+ * independently: uncompressed files can, BGZF and zstd files with more than
+ * one frame can (at frame boundaries), plain gzip can't.
+ */
+int canSplitFile(const char *path, off_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    unsigned char head[18];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    enum Compression compression = detectCompression(head, n > 0 ? n : 0);
+    int splittable = compression == COMPRESSION_NONE || (compression == COMPRESSION_BGZF && WITH_ZLIB);
+    if (compression == COMPRESSION_ZSTD && WITH_ZSTD) {
+        void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            size_t frameSize = zstdFrameSize((const unsigned char *)mapped, size);
+            splittable = frameSize > 0 && frameSize < (size_t)size;
+            munmap(mapped, size);
+        }
+    }
+    close(fd);
+    return splittable;
+}
+
+/**
+ * Sniffs an open regular file for compression.
+ */
+enum Compression sniffFile(int fd) {
+    unsigned char head[18];
+    STATS_BEGIN(timer);
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    STATS_END(STAGE_READ, timer, 1);
+    return detectCompression(head, n > 0 ? n : 0);
+}
+
+/**
+ * Counts the decompressed contents of a compressed regular file, or of the
+ * frames starting in a range of it. The file is mapped whatever --input
+ * says, since the decoder produces its output a chunk at a time anyway;
+ * whole files that can't be mapped are read through the compressed buffer.
+ * @param length Length of the range, or -1 for the whole file
+ */
+int processCompressed(int fd, enum Compression compression, size_t fileSize,
+                      off_t offset, off_t length, uint64_t counts[26]) {
+    STATS_BEGIN(mapTimer);
+    void *mapped = fileSize > 0 ? mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (mapped != MAP_FAILED) posix_madvise(mapped, fileSize, POSIX_MADV_SEQUENTIAL);
+    STATS_END(STAGE_READ, mapTimer, mapped != MAP_FAILED ? 2 : 1);
+
+    int status;
+    if (mapped == MAP_FAILED) {
+        if (length >= 0) {
+            perror("Error mapping compressed file");
+            return 1;
+        }
+        struct CompressedInput in = { NULL, 0, fd };
+        status = decompressHistogram(compression, &in, -1, counts);
+    } else if (length >= 0) {
+        status = decompressRange(compression, (const unsigned char *)mapped, fileSize, offset, length,
+                                 counts);
+    } else {
+        struct CompressedInput in = { (const unsigned char *)mapped, fileSize, -1 };
+        status = decompressHistogram(compression, &in, -1, counts);
+    }
+    if (mapped != MAP_FAILED) munmap(mapped, fileSize);
+    return status;
+}
+
+/**
+ * Streams fd through the worker's chunk buffer and accumulates its letters.
+ * Memory use is one chunk no matter how large the input is, and short reads
+ * are simply counted and followed by the next read. A gzip or zstd stream
+ * is recognised by its first chunk and decompressed on the fly.
+ * @param counts Histogram to add to
+ * @return 0 on success, 1 on allocation or read error
+ */
+int streamHistogram(int fd, uint64_t counts[26]) {
+    if (!getChunkBuffer()) return 1;
+
+    for (int first = 1;; first = 0) {
+        STATS_BEGIN(timer);
+        ssize_t n = read(fd, chunkBuffer, chunkSize);
+        STATS_END(STAGE_READ, timer, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Error reading file");
+            return 1;
+        }
+        if (n == 0) return 0;
+        enum Compression compression = first ? detectCompression((unsigned char *)chunkBuffer, n)
+                                              : COMPRESSION_NONE;
+        if (compression != COMPRESSION_NONE) {
+            // The chunk read so far becomes compressed input, and the other
+            // buffer takes the decoder's output
+            unsigned char *head = (unsigned char *)chunkBuffer;
+            chunkBuffer = (char *)compressedBuffer;
+            compressedBuffer = head;
+            struct CompressedInput in = { head, n, fd };
+            return decompressHistogram(compression, &in, -1, counts);
+        }
+        HistogramAccumulate(chunkBuffer, n, counts);
+    }
+}
+
+/**
+ * SIGBUS handler. A mapped input that shrinks under the mapping raises
+ * SIGBUS on the first page past its new end; while such an input is being
+ * counted, that fails the task instead of killing the worker (or, with
+ * threads, the whole run). Any other SIGBUS keeps its default action.
+ */
+void handleBusError(int sig) {
+    if (countingMapped) siglongjmp(mappingLost, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Counts a mapped input, guarded by handleBusError().
+ * @return 0 on success, STATUS_RETRY if the file shrank while being counted
+ */
+static int accumulateMapped(const char *path, const char *data, size_t size, uint64_t counts[26]) {
+    if (sigsetjmp(mappingLost, 1) != 0) {
+        countingMapped = 0;
+        LOG(LEVEL_ERROR, "Error reading file %s: it shrank while being counted.\n", path);
+        return STATUS_RETRY;
+    }
+    countingMapped = 1;
+    HistogramAccumulate(data, size, counts);
+    countingMapped = 0;
+    return 0;
+}
+
+/**
+ * Computes the histogram of one input file.
+ * Regular files are mapped read-only in INPUT_MMAP mode and read whole in
+ * INPUT_READ mode; everything else, including files that can't be mapped
+ * (pipes, FIFOs, /proc files, empty files), is streamed in chunks. gzip and
+ * zstd inputs are recognised by their magic bytes and decompressed.
+ * @param path Path of the file to read
+ * @param counts Output array of 26 letter counts; the wide buckets are left
+ *               for collectPairs()
+ * @return 0 on success, 1 if the file could not be read
+ */
+int processFile(const char *path, uint64_t counts[26]) {
+    LOG(LEVEL_DEBUG, "Opening file: %s\n", path);
+    STATS_BEGIN(openTimer);
+    int fileDescriptor = open(path, O_RDONLY);
+    if (fileDescriptor < 0) {
+        int error = errno;
+        LOG(LEVEL_ERROR, "Error opening file %s: %s\n", path, strerror(error));
+        return failureStatus(error);
+    }
+
+    struct stat st;
+    int statResult = fstat(fileDescriptor, &st);
+    STATS_END(STAGE_OPEN, openTimer, 2);
+    if (statResult < 0) {
+        perror("Error reading file status");
+        close(fileDescriptor);
+        return 1;
+    }
+
+    beginHistogram(counts);
+    size_t fileSize = S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+    enum Compression compression = fileSize > 0 ? sniffFile(fileDescriptor) : COMPRESSION_NONE;
+    if (compression != COMPRESSION_NONE) {
+        int status = processCompressed(fileDescriptor, compression, fileSize, 0, -1, counts);
+        endHistogram(counts);
+        close(fileDescriptor);
+        return status;
+    }
+    void *mapped = MAP_FAILED;
+    if (inputMode == INPUT_MMAP && fileSize > 0) {
+        // Fails on e.g. filesystems without mmap support; read() is used then
+        STATS_BEGIN(mapTimer);
+        mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (mapped != MAP_FAILED) {
+            posix_madvise(mapped, fileSize, POSIX_MADV_SEQUENTIAL);
+            posix_madvise(mapped, fileSize, POSIX_MADV_WILLNEED);
+        }
+        STATS_END(STAGE_READ, mapTimer, mapped != MAP_FAILED ? 3 : 1);
+    }
+
+    int status = 0;
+    LOG(LEVEL_DEBUG, "Calculating histogram for file: %s\n", path);
+    if (mapped != MAP_FAILED) {
+        status = accumulateMapped(path, mapped, fileSize, counts);
+        munmap(mapped, fileSize);
+    } else if (inputMode == INPUT_READ) {
+        // Read file content into memory
+        char *fileData = readAll(fileDescriptor, fileSize, &fileSize);
+        enum Compression compression = fileData ? detectCompression((unsigned char *)fileData, fileSize)
+                                                : COMPRESSION_NONE;
+        if (compression != COMPRESSION_NONE) {
+            struct CompressedInput in = { (unsigned char *)fileData, fileSize, -1 };
+            status = decompressHistogram(compression, &in, -1, counts);
+        } else if (fileData) {
+            HistogramAccumulate(fileData, fileSize, counts);
+        } else {
+            status = failureStatus(errno);
+        }
+    } else {
+        status = streamHistogram(fileDescriptor, counts);
+    }
+    endHistogram(counts);
+    close(fileDescriptor);
+    return status;
+}
+
+/**
+ * Computes the histogram of bytes [offset, offset + length) of a regular file.
+ * In INPUT_MMAP mode just that range is mapped; otherwise it is read with
+ * pread() through the worker's chunk buffer, so ranges of one file can be
+ * counted by several workers at once. In a compressed file the range takes
+ * the frames that start inside it instead.
+ * @param counts Output array of 26 letter counts
+ * @return 0 on success, 1 if the range could not be read
+ */
+int processRange(const char *path, off_t offset, off_t length, uint64_t counts[26]) {
+    LOG(LEVEL_DEBUG, "Opening file: %s (bytes %lld-%lld)\n", path,
+                     (long long)offset, (long long)(offset + length - 1));
+    STATS_BEGIN(openTimer);
+    int fileDescriptor = open(path, O_RDONLY);
+    STATS_END(STAGE_OPEN, openTimer, 1);
+    if (fileDescriptor < 0) {
+        int error = errno;
+        LOG(LEVEL_ERROR, "Error opening file %s: %s\n", path, strerror(error));
+        return failureStatus(error);
+    }
+
+    beginHistogram(counts);
+    enum Compression compression = sniffFile(fileDescriptor);
+    if (compression != COMPRESSION_NONE) {
+        struct stat st;
+        int status = fstat(fileDescriptor, &st) < 0 ||
+                     processCompressed(fileDescriptor, compression, st.st_size, offset, length, counts);
+        endHistogram(counts);
+        close(fileDescriptor);
+        return status;
+    }
+    void *mapped = MAP_FAILED;
+    off_t pageOffset = offset % sysconf(_SC_PAGESIZE); // mmap offsets must be page aligned
+    if (inputMode == INPUT_MMAP && length > 0) {
+        STATS_BEGIN(mapTimer);
+        mapped = mmap(NULL, length + pageOffset, PROT_READ, MAP_PRIVATE,
+                      fileDescriptor, offset - pageOffset);
+        if (mapped != MAP_FAILED) {
+            posix_madvise(mapped, length + pageOffset, POSIX_MADV_SEQUENTIAL);
+            posix_madvise(mapped, length + pageOffset, POSIX_MADV_WILLNEED);
+        }
+        STATS_END(STAGE_READ, mapTimer, mapped != MAP_FAILED ? 3 : 1);
+    }
+
+    int status = 0;
+    if (mapped != MAP_FAILED) {
+        status = accumulateMapped(path, (const char *)mapped + pageOffset, length, counts);
+        munmap(mapped, length + pageOffset);
+    } else if (!getChunkBuffer()) {
+        status = 1;
+    } else {
+        off_t done = 0;
+        while (done < length) {
+            size_t want = length - done < (off_t)chunkSize ? (size_t)(length - done) : chunkSize;
+            STATS_BEGIN(timer);
+            ssize_t n = pread(fileDescriptor, chunkBuffer, want, offset + done);
+            STATS_END(STAGE_READ, timer, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                perror("Error reading file");
+                status = 1;
+                break;
+            }
+            if (n == 0) break; // File shrank since the parent looked at it
+            HistogramAccumulate(chunkBuffer, n, counts);
+            done += n;
+        }
+    }
+    endHistogram(counts);
+    close(fileDescriptor);
+    return status;
+}
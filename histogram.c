@@ -0,0 +1,428 @@
+/**
+ * The library interface of histogram.h, the options of the run and the
+ * signals that stop it.
+ */
+#include "engine.h"
+
+#define DEFAULT_CHUNK_SIZE (1 << 20) // Default read size in streaming mode
+#define DEFAULT_SPLIT_THRESHOLD (256 << 20) // Files at least this large are split across workers
+#define DEFAULT_RESULTS_FILE "results.bin" // Output file in --output=binary mode
+#define DEFAULT_QUEUE_DEPTH 8   // Reads each worker keeps in flight with --input=uring
+#define MAX_QUEUE_DEPTH HISTOGRAM_MAX_QUEUE_DEPTH
+#define DEFAULT_RETRIES 2       // Attempts after the first for inputs that failed transiently
+#define FD_RESERVE 64           // Descriptors kept free of workers: event loop, outputs, cache, scan
+
+enum InputMode inputMode = INPUT_MMAP; // Input mode used by workers
+size_t chunkSize = DEFAULT_CHUNK_SIZE; // Read size in streaming mode
+int queueDepth = DEFAULT_QUEUE_DEPTH;  // Reads in flight per worker with --input=uring
+enum HistogramMode histogramMode = HISTOGRAM_LETTERS; // What histograms count (--histogram)
+int simulateDelay = 0;                 // Demo mode: sleep after each task (--simulate-delay)
+int binaryOutput = 0;                  // Write one results file instead of .hist files
+const char *resultsPath = DEFAULT_RESULTS_FILE; // Results file in binary output mode
+int pinWorkers = 0;                    // --pin: one CPU per worker
+enum NumaMode numaMode = NUMA_OFF;     // --numa
+int numaRouting = 0;                   // Send inputs to workers on the node caching them
+int shardIndex = 0;                    // --shard=K/N: count only the inputs of shard K - 1 ...
+int numShards = 0;                     // ... of N, or every input if 0
+const char *coordinatorAddress = NULL; // --coordinator: send results there instead of saving them
+const char *listenAddress = NULL;      // --listen: run as the coordinator
+int maxRetries = DEFAULT_RETRIES;      // --retries
+volatile sig_atomic_t stopRequested = 0; // Set by SIGINT or SIGTERM: finish what is in flight, then save
+_Atomic uint64_t statusCounts[NUM_STATUSES]; // Inputs saved with each status
+_Atomic uint64_t lostOutputs;          // .hist files that could not be written
+_Atomic uint64_t inputsTaken;          // Inputs of this node handed out so far
+enum ProgressFormat progressFormat = PROGRESS_OFF; // --progress
+int progressFd = STDERR_FILENO;        // --progress-fd
+
+// Work queue state (parent only)
+enum SchedulePolicy schedulePolicy = SCHEDULE_FIFO; // --schedule
+int numWorkers = 0;            // Number of workers in the pool
+off_t splitThreshold = DEFAULT_SPLIT_THRESHOLD; // Minimum size for splitting a file, 0 to disable
+
+/**
+ * SIGINT and SIGTERM handler. The first signal stops the run from handing
+ * out more inputs, so the tasks in flight finish and the results so far are
+ * saved; a second one stops at once, taking the workers along.
+ */
+static void requestStop(int sig) {
+    if (stopRequested) {
+        for (int w = 0; children && w < numWorkers; w++) {
+            if (children[w].pid > 0) kill(children[w].pid, SIGTERM);
+        }
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    stopRequested = 1;
+}
+
+/**
+ * Installs requestStop() and handleBusError(). With SA_RESTART reads and
+ * writes carry on through a signal; epoll_wait() still fails with EINTR,
+ * which wakes the event loop to look at stopRequested.
+ */
+static void installSignalHandlers(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = handleBusError;
+    sigaction(SIGBUS, &action, NULL);
+}
+
+/**
+ * Raises the soft open-file limit to the hard one and admits only as many
+ * workers as the limit has room for: a worker process holds one or two pipe
+ * ends in the parent, while threads share one descriptor table, each with
+ * the inputs it has open. FD_RESERVE descriptors, plus one per traversal
+ * thread, are left for everything else.
+ */
+static void admitWorkers(int useThreads, int useSharedRing) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return;
+    if (limit.rlim_cur < limit.rlim_max) {
+        struct rlimit raised = { limit.rlim_max, limit.rlim_max };
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) limit = raised;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY) return;
+
+    long perWorker = !useThreads                 ? (useSharedRing ? 1 : 2)
+                   : inputMode == INPUT_URING ? 2 + queueDepth // The ring and its open streams
+                                              : 1;
+    long budget = (long)limit.rlim_cur - FD_RESERVE - scan.numThreads;
+    if (budget >= numWorkers * perWorker) return;
+    int admitted = budget / perWorker > 1 ? budget / perWorker : 1;
+    LOG(LEVEL_NOTICE, "The open-file limit of %ld leaves room for %d of the %d workers.\n",
+                      (long)limit.rlim_cur, admitted, numWorkers);
+    numWorkers = admitted;
+}
+
+/**
+ * Fills in the options parallel runs with when given none.
+ */
+void histogramDefaults(struct HistogramOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->inputMode = INPUT_MMAP;
+    options->chunkSize = DEFAULT_CHUNK_SIZE;
+    options->queueDepth = DEFAULT_QUEUE_DEPTH;
+    options->kernel = "auto";
+    options->splitThreshold = DEFAULT_SPLIT_THRESHOLD;
+    options->schedule = SCHEDULE_FIFO;
+    options->histogramMode = HISTOGRAM_LETTERS;
+    options->alphabet = "letters";
+    options->foldCase = 1;
+    options->resultsPath = DEFAULT_RESULTS_FILE;
+    options->scanThreads = DEFAULT_SCAN_THREADS;
+    options->maxSize = -1;
+    options->symlinks = SYMLINKS_SKIP;
+    options->numa = NUMA_OFF;
+    options->retries = DEFAULT_RETRIES;
+    options->stats = STATS_OFF;
+    options->progress = PROGRESS_OFF;
+    options->progressFd = STDERR_FILENO;
+    options->logLevel = LEVEL_NOTICE;
+}
+
+/**
+ * Checks the options of a run and copies them into the engine's globals,
+ * selecting the histogram kernel and alphabet policy on the way. The
+ * command line has already rejected what it can parse; this catches the
+ * same mistakes for programs linking the library.
+ * @return 0, or -1 after logging what is wrong
+ */
+static int applyOptions(const struct HistogramOptions *options) {
+    logLevel = options->logLevel;
+    if (options->workers < 0 || options->chunkSize == 0 || options->queueDepth < 1 ||
+        options->queueDepth > MAX_QUEUE_DEPTH || options->splitThreshold < 0 || options->scanThreads < 1 ||
+        options->scanThreads > MAX_WORKERS || options->retries < 0 || options->retries > HISTOGRAM_MAX_RETRIES ||
+        options->progressFd < 0 || (options->numRoots > 0 && !options->roots)) {
+        LOG(LEVEL_ERROR, "Error: invalid worker count, chunk size, queue depth, split threshold, "
+                         "scan thread count, retry count or progress descriptor.\n");
+        return -1;
+    }
+    if (options->numShards < 0 || options->numShards > MAX_SHARDS ||
+        (options->numShards > 0 && (options->shard < 1 || options->shard > options->numShards))) {
+        LOG(LEVEL_ERROR, "Error: invalid shard %d/%d, expected K/N with 1 <= K <= N.\n", options->shard,
+                         options->numShards);
+        return -1;
+    }
+#if !ENABLE_STATS
+    if (options->stats != STATS_OFF || options->progress != PROGRESS_OFF) {
+        LOG(LEVEL_ERROR, "Error: --stats and --progress are not available, build with STATS=1.\n");
+        return -1;
+    }
+#endif
+    if (selectHistogramKernel(options->kernel) < 0) {
+        LOG(LEVEL_ERROR, "Error: Histogram kernel '%s' is unknown or not supported on this CPU.\n",
+                         options->kernel);
+        return -1;
+    }
+    if (selectClassPolicy(options->alphabet, options->foldCase, &classPolicy) < 0) {
+        LOG(LEVEL_ERROR, "Error: unknown or empty alphabet '%s'.\n", options->alphabet);
+        return -1;
+    }
+
+    inputMode = options->inputMode;
+    chunkSize = options->chunkSize;
+    queueDepth = options->queueDepth;
+    splitThreshold = options->splitThreshold;
+    schedulePolicy = options->schedule;
+    histogramMode = options->histogramMode;
+    binaryOutput = options->binaryOutput;
+    resultsPath = options->resultsPath;
+    cache.path = options->cachePath;
+    cache.disabled = options->noCache;
+    source.listPath = options->filesFrom;
+    source.delimiter = options->nullDelimited ? '\0' : '\n';
+    scan.roots = options->roots;
+    scan.numRoots = options->numRoots;
+    scan.numThreads = options->scanThreads;
+    scan.minSize = options->minSize;
+    scan.maxSize = options->maxSize;
+    scan.symlinks = options->symlinks;
+    pinWorkers = options->pin;
+    numaMode = options->numa;
+    shardIndex = options->numShards > 0 ? options->shard - 1 : 0;
+    numShards = options->numShards;
+    coordinatorAddress = options->coordinator;
+    listenAddress = options->listen;
+    maxRetries = options->retries;
+#if ENABLE_STATS
+    statsFormat = options->stats;
+#endif
+    progressFormat = options->progress;
+    progressFd = options->progressFd;
+    simulateDelay = options->simulateDelay;
+    return 0;
+}
+
+/**
+ * Runs parallel's whole job: checks the options, then counts on the process
+ * pool or the threads engine, or runs as the coordinator.
+ * @return The exit status
+ */
+int histogramRun(const struct HistogramOptions *options, int numPaths, char **paths) {
+    if (applyOptions(options) < 0) return EXIT_FAILURE;
+    source.argv = paths;
+    source.argc = numPaths;
+    int useThreads = options->useThreads;
+    int useSharedRing = options->sharedRing;
+
+    if (listenAddress) {
+        if (source.argc > 0 || source.listPath || scan.numRoots > 0 || numShards > 0 || coordinatorAddress) {
+            LOG(LEVEL_ERROR, "Error: --listen takes no inputs, --shard or --coordinator.\n");
+            return EXIT_FAILURE;
+        }
+    } else if (source.listPath || scan.numRoots > 0) {
+        LOG(LEVEL_INFO, "Starting program. Number of files provided: %d plus the %s\n", source.argc,
+                        source.listPath ? "file list" : "files found under the -r directories");
+    } else {
+        LOG(LEVEL_INFO, "Starting program. Number of files provided: %d\n", source.argc);
+    }
+
+    // Validate input arguments
+    if (!listenAddress && source.argc == 0 && !source.listPath && scan.numRoots == 0) {
+        LOG(LEVEL_ERROR, "Error: No input files provided.\n");
+        return EXIT_FAILURE;
+    }
+    installSignalHandlers();
+    if (startProgress() < 0) return EXIT_FAILURE;
+    if (listenAddress) return runCoordinator();
+
+    // A shard with a coordinator saves nothing itself; without --shard it is
+    // the only one
+    if (coordinatorAddress) {
+        binaryOutput = 0;
+        if (numShards == 0) numShards = 1;
+    }
+    if (inputMode == INPUT_URING && probeUring() < 0) {
+        LOG(LEVEL_NOTICE, "io_uring is not available (%s); using --input=stream.\n", strerror(errno));
+        inputMode = INPUT_STREAM;
+    }
+    if (classPolicy) {
+        LOG(LEVEL_INFO, "Using %s alphabet kernel.\n", classPolicy->name);
+    } else {
+        LOG(LEVEL_INFO, "Using %s histogram kernel.\n", histogramKernelName);
+    }
+
+    // The cache, split merging and the fixed-size ring slots hold letter
+    // counts only
+    if (histogramMode != HISTOGRAM_LETTERS || classPolicy) {
+        if (useSharedRing) {
+            LOG(LEVEL_ERROR, "Error: --histogram=bytes and utf8, --alphabet and --case need "
+                             "--transport=pipe.\n");
+            return EXIT_FAILURE;
+        }
+        cache.disabled = 1;
+        splitThreshold = 0;
+    }
+    long requestedWorkers = options->workers > 0 ? options->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (requestedWorkers < 1) requestedWorkers = 1;
+    if (requestedWorkers > MAX_WORKERS) requestedWorkers = MAX_WORKERS;
+    numWorkers = requestedWorkers;
+    admitWorkers(useThreads, useSharedRing);
+
+    // More workers than inputs only helps if some input will be split; with
+    // a file list or a directory scan the number of inputs isn't known up front
+    if (!source.listPath && scan.numRoots == 0 && numWorkers > source.argc) {
+        int splittable = 0;
+        for (int i = 0; i < source.argc && !splittable; i++) {
+            struct stat st;
+            splittable = splitThreshold > 0 && stat(source.argv[i], &st) == 0 &&
+                         S_ISREG(st.st_mode) && st.st_size >= splitThreshold;
+        }
+        if (!splittable) numWorkers = source.argc;
+    }
+
+    // Workers are placed by index, so the topology is read once, here
+    if (pinWorkers || numaMode != NUMA_OFF || statsFormat != STATS_OFF) readTopology();
+    if (numaMode == NUMA_AUTO && topology.numNodes < 2) {
+        LOG(LEVEL_INFO, "Only one NUMA node; --numa=auto only places workers on its CPUs.\n");
+    }
+    for (int w = 0; w < numWorkers; w++) topology.nodeWorkers[workerNode(w)]++;
+    numaRouting = numaMode == NUMA_AUTO && topology.numNodes > 1 && !useThreads;
+
+    if (startStats(numWorkers + 1) < 0) return EXIT_FAILURE;
+    return useThreads ? runThreadsMode() : runProcessesMode(useSharedRing);
+}
+
+/**
+ * Body of the engine thread of an in-process run.
+ */
+static void *runEmbeddedEngine(void *arg) {
+    (void)arg;
+    runThreadEngine();
+    return NULL;
+}
+
+/**
+ * Starts an in-process run: the threads engine, fed through the scan queue
+ * instead of a directory scan, on a thread of its own so the caller is free
+ * to submit inputs. Results go to the callback instead of any output.
+ * @return 0, or -1 if the options are invalid, a run is already active or the
+ *         stats table or progress descriptor could not be set up
+ */
+int histogramStart(const struct HistogramOptions *options, HistogramCallback callback, void *context) {
+    if (embedding.callback) {
+        LOG(LEVEL_ERROR, "Error: an in-process run is already active.\n");
+        return -1;
+    }
+    if (applyOptions(options) < 0) return -1;
+    if (!callback || source.listPath || scan.numRoots > 0 || binaryOutput || numShards > 0 ||
+        coordinatorAddress || listenAddress) {
+        LOG(LEVEL_ERROR, "Error: an in-process run needs a callback, and takes no file list, directories, "
+                         "binary output, shard, coordinator or listen address.\n");
+        return -1;
+    }
+    if (inputMode == INPUT_URING && probeUring() < 0) {
+        LOG(LEVEL_NOTICE, "io_uring is not available (%s); using --input=stream.\n", strerror(errno));
+        inputMode = INPUT_STREAM;
+    }
+    if (histogramMode != HISTOGRAM_LETTERS || classPolicy) {
+        cache.disabled = 1;
+        splitThreshold = 0;
+    }
+
+    // Whatever an earlier run in this process left behind
+    for (int status = 0; status < NUM_STATUSES; status++) statusCounts[status] = 0;
+    lostOutputs = 0;
+    inputsTaken = 0;
+    stopRequested = 0;
+    source.argc = source.next = source.lastTask = source.exhausted = 0;
+    scan.head = scan.count = scan.done = 0;
+    scan.failedDirs = 0;
+    scan.eventFd = -1;
+    cache.hits = 0;
+
+    long requestedWorkers = options->workers > 0 ? options->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (requestedWorkers < 1) requestedWorkers = 1;
+    if (requestedWorkers > MAX_WORKERS) requestedWorkers = MAX_WORKERS;
+    numWorkers = requestedWorkers;
+    admitWorkers(1, 0);
+    if (pinWorkers || numaMode != NUMA_OFF || statsFormat != STATS_OFF) readTopology();
+    memset(topology.nodeWorkers, 0, sizeof(topology.nodeWorkers));
+    for (int w = 0; w < numWorkers; w++) topology.nodeWorkers[workerNode(w)]++;
+    numaRouting = 0;
+    if (startStats(numWorkers + 1) < 0 || startProgress() < 0) return -1;
+    openCache();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = handleBusError;
+    sigaction(SIGBUS, &action, &embedding.savedBusAction);
+
+    embedding.callback = callback;
+    embedding.context = context;
+    int rc = pthread_create(&embedding.engine, NULL, runEmbeddedEngine, NULL);
+    if (rc != 0) {
+        LOG(LEVEL_ERROR, "Error creating the engine thread: %s\n", strerror(rc));
+        embedding.callback = NULL;
+        sigaction(SIGBUS, &embedding.savedBusAction, NULL);
+        closeCache();
+        reportStats();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queues a path for the threads of the active in-process run.
+ * @return 0, or -1 if no run is active or the path could not be copied
+ */
+int histogramSubmitPath(const char *path) {
+    if (!embedding.callback) return -1;
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("Failed to allocate input path");
+        return -1;
+    }
+    pushScannedFile(copy);
+    return 0;
+}
+
+/**
+ * Counts a buffer on the calling thread and reports it as task 0.
+ * @return 0, or -1 if no run is active
+ */
+int histogramSubmitBuffer(const char *name, const void *data, size_t size) {
+    if (!embedding.callback) return -1;
+    uint64_t counts[26];
+    beginHistogram(counts);
+    HistogramAccumulate((const char *)data, size, counts);
+    endHistogram(counts);
+    const struct HistogramPair *pairs;
+    uint32_t numPairs;
+    if (collectPairs(&pairs, &numPairs) < 0) {
+        saveFailure(0, name, STATUS_RETRY);
+    } else {
+        saveHistogram(getpid(), 0, name, counts, pairs, numPairs);
+    }
+    return 0;
+}
+
+/**
+ * Ends the input of the active in-process run, waits for the engine to
+ * count what is queued and restores what histogramStart() changed.
+ * @return 0 if every input was counted, otherwise 1
+ */
+int histogramFinish(void) {
+    if (!embedding.callback) return EXIT_FAILURE;
+    pthread_mutex_lock(&scan.lock);
+    scan.done = 1;
+    pthread_cond_broadcast(&scan.notEmpty);
+    pthread_mutex_unlock(&scan.lock);
+    pthread_join(embedding.engine, NULL);
+
+    closeCache();
+    sigaction(SIGBUS, &embedding.savedBusAction, NULL);
+    int status = finishRun();
+    reportStats();
+    embedding.callback = NULL;
+    embedding.context = NULL;
+    return status;
+}
@@ -0,0 +1,259 @@
+/**
+ * libhistogram: letter histograms of files and buffers, and in the wide
+ * modes byte, UTF-8 and alphabet histograms too. It is the engine behind the
+ * parallel command, which is a thin command line over histogramRun().
+ *
+ * Programs embedding it count in process, without fork() or exec():
+ * histogramStart() starts a pool of threads, histogramSubmitPath() and
+ * histogramSubmitBuffer() hand it inputs, the callback receives every
+ * result, and histogramFinish() waits for the last one. The engine keeps
+ * its state in globals, so a process runs one run at a time.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__GNUC__)
+#define HISTOGRAM_API __attribute__((visibility("default"))) // The rest of the library is hidden
+#else
+#define HISTOGRAM_API
+#endif
+
+#define HISTOGRAM_MAX_WORKERS 1024    // Largest worker pool
+#define HISTOGRAM_MAX_QUEUE_DEPTH 256 // Largest queueDepth
+#define HISTOGRAM_MAX_SHARDS 65536    // Largest numShards
+#define HISTOGRAM_MAX_RETRIES 100     // Largest retries
+
+#define BUCKET_INVALID 0x110000  // Result bucket of malformed UTF-8 sequences
+#define BUCKET_BYTE(b) (0x200000 + (b)) // Result bucket of raw byte value b
+#define BUCKET_CLASS(c) (0x300000 + (c)) // Result bucket of the alphabet class labelled c
+
+/**
+ * Outcome of a task, as sent by workers and as stored in the binary results
+ * file. Inputs that fail with STATUS_RETRY or take down their worker are
+ * tried again, up to --retries times; the status of the last attempt is the
+ * one saved.
+ */
+enum TaskStatus {
+    STATUS_COUNTED = 0, // Counted
+    STATUS_FAILED = 1,  // Could not be read: missing, unreadable, corrupt
+    STATUS_RETRY = 2,   // Failed on a shortage that may pass, e.g. EMFILE or ENOMEM
+    STATUS_CRASHED = 3, // The worker counting it died
+    STATUS_SKIPPED = 4, // Never counted: the run was interrupted or lost every worker
+    NUM_STATUSES
+};
+
+/**
+ * One nonzero bucket of a byte, codepoint or alphabet histogram. Buckets
+ * below BUCKET_INVALID are Unicode codepoints, BUCKET_BYTE(b) is raw byte b
+ * and BUCKET_CLASS(c) is the --alphabet class labelled with character c.
+ * These histograms are sent and stored as arrays of pairs sorted by bucket,
+ * so a file with a few distinct characters costs a few pairs.
+ */
+struct HistogramPair {
+    uint32_t bucket;
+    uint32_t reserved; // Zero
+    uint64_t count;
+};
+
+/**
+ * How workers get file contents into memory.
+ */
+enum InputMode {
+    INPUT_MMAP,  // Map the file and count straight from the page cache
+    INPUT_READ,  // read() the whole file into the worker's input arena
+    INPUT_STREAM, // read() fixed-size chunks into one reused buffer
+    INPUT_URING   // Keep queueDepth chunk reads in flight through io_uring
+};
+
+/**
+ * Order in which the process pool hands out inputs (--schedule).
+ */
+enum SchedulePolicy {
+    SCHEDULE_FIFO,   // Source order
+    SCHEDULE_LPT,    // Largest first within a window of SCHEDULE_WINDOW inputs
+    SCHEDULE_BATCHED // Source order, with runs of small files sent as one batch
+};
+
+/**
+ * What a histogram counts (--histogram). Letters are always counted; the wide
+ * modes add buckets that travel as HistogramPair arrays.
+ */
+enum HistogramMode {
+    HISTOGRAM_LETTERS, // a-z, case folded
+    HISTOGRAM_BYTES,   // Plus every byte value
+    HISTOGRAM_UTF8     // Plus UTF-8 codepoints and malformed sequences, in the same pass
+};
+
+/**
+ * What the directory scan does with symbolic links.
+ */
+enum SymlinkPolicy {
+    SYMLINKS_SKIP,  // Ignore every symlink below the roots
+    SYMLINKS_FILES, // Count symlinks to regular files, don't descend into linked directories
+    SYMLINKS_FOLLOW // Follow all symlinks; directories already visited are skipped
+};
+
+/**
+ * What --numa does.
+ */
+enum NumaMode {
+    NUMA_OFF, // Leave memory placement to the kernel
+    NUMA_AUTO // Keep each worker and its memory on one node, route inputs to their node
+};
+
+/**
+ * Output format of the --stats report.
+ */
+enum StatsFormat {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+    STATS_PROMETHEUS
+};
+
+/**
+ * Format of the --progress reports.
+ */
+enum ProgressFormat {
+    PROGRESS_OFF,
+    PROGRESS_LINE, // One status line, redrawn in place on a terminal
+    PROGRESS_JSON  // One JSON object per line
+};
+
+/**
+ * Log levels, from -q (errors only) to -vv. The default prints just the
+ * errors and a summary at the end of the run.
+ */
+enum LogLevel {
+    LEVEL_ERROR,  // Failures, on stderr
+    LEVEL_NOTICE, // Run summary and warnings
+    LEVEL_INFO,   // One line per input (-v)
+    LEVEL_DEBUG   // Every open, dispatch and child event (-vv)
+};
+
+/**
+ * Settings of a run, one field per command-line option of parallel (see its
+ * --help). histogramDefaults() fills in what parallel uses without options.
+ */
+struct HistogramOptions {
+    int workers;                      // -j: pool size, 0 for one worker per online CPU
+    int useThreads;                   // --engine=threads: a pthread pool instead of worker processes
+    int sharedRing;                   // --transport=shm
+    enum InputMode inputMode;         // --input
+    size_t chunkSize;                 // --chunk-size
+    int queueDepth;                   // --queue-depth
+    const char *kernel;               // --kernel: "auto", "avx512", "avx2", "sse2", "neon" or "scalar"
+    off_t splitThreshold;             // --split-threshold, 0 to never split
+    enum SchedulePolicy schedule;     // --schedule
+    enum HistogramMode histogramMode; // --histogram
+    const char *alphabet;             // --alphabet: "letters", "alnum" or "chars:STRING"
+    int foldCase;                     // --case: 1 to fold, 0 for sensitive
+    int binaryOutput;                 // --output=binary
+    const char *resultsPath;          // --output-file
+    const char *cachePath;            // --cache, NULL for the default location
+    int noCache;                      // --no-cache
+    const char *filesFrom;            // --files-from, "-" for stdin, or NULL
+    int nullDelimited;                // -0
+    char **roots;                     // -r directories
+    int numRoots;
+    int scanThreads;                  // --scan-threads
+    off_t minSize;                    // --min-size
+    off_t maxSize;                    // --max-size, -1 for no limit
+    enum SymlinkPolicy symlinks;      // --symlinks
+    int pin;                          // --pin
+    enum NumaMode numa;               // --numa
+    int shard;                        // --shard=K/N: K, from 1 ...
+    int numShards;                    // ... and N, or 0 to count every input
+    const char *coordinator;          // --coordinator=HOST:PORT, or NULL
+    const char *listen;               // --listen=[HOST:]PORT, or NULL
+    int retries;                      // --retries
+    enum StatsFormat stats;           // --stats
+    enum ProgressFormat progress;     // --progress
+    int progressFd;                   // --progress-fd
+    int simulateDelay;                // --simulate-delay
+    enum LogLevel logLevel;           // -q, -v
+};
+
+/**
+ * The result of one input, as passed to a HistogramCallback. The pointers
+ * are only valid during the call.
+ */
+struct HistogramResult {
+    int task;                          // Number of the input, from 1 in submission order; 0 for buffers
+    const char *path;                  // Path of the input, or the name given with a buffer
+    int status;                        // A TaskStatus
+    const uint64_t *counts;            // Counts of a to z, NULL unless status is STATUS_COUNTED
+    const struct HistogramPair *pairs; // Buckets of the wide modes and alphabet classes, sorted
+    uint32_t numPairs;
+};
+
+/**
+ * Receives the results of an in-process run. It may run on several of the
+ * engine's threads at once, and on the thread calling histogramSubmitBuffer(),
+ * and must not submit inputs itself.
+ */
+typedef void (*HistogramCallback)(const struct HistogramResult *result, void *context);
+
+/**
+ * Fills in the default options: letters on one worker process per CPU, mmap
+ * input, .hist output files and the result cache.
+ */
+HISTOGRAM_API void histogramDefaults(struct HistogramOptions *options);
+
+/**
+ * Runs parallel's whole job: counts the given paths, the --files-from list
+ * and the -r directories and saves the results as the options say; or, with
+ * options->listen set, runs as the coordinator of a distributed run.
+ * SIGINT and SIGTERM stop the run, keeping the results so far.
+ * Like the command line it backs, it calls exit(EXIT_FAILURE) in the calling
+ * process when it can't set the run up (the event loop, the result ring, the
+ * writer thread, the results file, the coordinator connection, the scan
+ * threads), when it runs out of memory mid-run, or when a shard loses its
+ * coordinator; hosts that must survive those should run it in a child process
+ * or use histogramStart().
+ * @param paths Input paths, which must stay valid during the run
+ * @return The exit status: 0 if every input was counted and saved
+ */
+HISTOGRAM_API int histogramRun(const struct HistogramOptions *options, int numPaths, char **paths);
+
+/**
+ * Starts an in-process run on the threads engine, whatever options->useThreads
+ * says. Inputs come only from histogramSubmitPath() and histogramSubmitBuffer()
+ * and results go only to the callback, so filesFrom, roots, binaryOutput,
+ * shards, coordinator and listen must be left unset. The result cache is
+ * used unless options->noCache is set. A SIGBUS handler is installed until
+ * histogramFinish(), so a mapped file that shrinks while being counted fails
+ * its task instead of the process. The engine never exits the process: errors
+ * are returned, and an input it runs out of memory for is reported with
+ * STATUS_RETRY.
+ * @return 0, or -1 if the options are invalid, a run is already active or the
+ *         run could not be set up
+ */
+HISTOGRAM_API int histogramStart(const struct HistogramOptions *options, HistogramCallback callback,
+                                 void *context);
+
+/**
+ * Queues a file for the threads of the active run, waiting while several
+ * thousand are already queued. Safe to call from several threads.
+ * @return 0, or -1 if no run is active or the path could not be copied
+ */
+HISTOGRAM_API int histogramSubmitPath(const char *path);
+
+/**
+ * Counts a buffer on the calling thread and reports it to the callback
+ * before returning, with task 0 and name as its path.
+ * @return 0, or -1 if no run is active
+ */
+HISTOGRAM_API int histogramSubmitBuffer(const char *name, const void *data, size_t size);
+
+/**
+ * Waits until every submitted path has been reported, then ends the run.
+ * @return 0 if every input was counted, otherwise 1
+ */
+HISTOGRAM_API int histogramFinish(void);
+
+#endif
@@ -0,0 +1,662 @@
+/**
+ * The counting kernels: letter histograms in scalar code and SIMD, the
+ * alphabet class kernels, and the wide byte and UTF-8 tables.
+ */
+#include "engine.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define SIMD_BLOCK_VECTORS 255 // Vectors per block before 8-bit SIMD counters can overflow
+#define HISTOGRAM_LANES 4      // Sub-histograms used by the scalar kernel
+#define UTF8_DENSE_LIMIT 0x800   // Codepoints below this (1- and 2-byte UTF-8) get a dense table
+#define SPARSE_INITIAL_SLOTS 256 // Initial size of the hash holding the other codepoints
+
+/**
+ * Byte and codepoint counts of one input in the wide histogram modes. ASCII
+ * is never decoded: every byte below 0x80 is a codepoint of its own, so those
+ * are read off the byte counts at the end. The decoder state carries a
+ * multi-byte sequence over from one chunk to the next.
+ */
+struct WideHistogram {
+    uint64_t bytes[256];
+    uint64_t dense[UTF8_DENSE_LIMIT]; // Codepoints 0x80 up to UTF8_DENSE_LIMIT
+    uint64_t invalid;                 // Malformed or truncated sequences
+    struct HistogramPair *sparse;     // Open-addressed hash of the other codepoints, count 0 if free
+    uint32_t sparseCapacity;          // Power of two
+    uint32_t sparseCount;
+    uint32_t codepoint;               // Sequence being decoded
+    int need;                         // Continuation bytes still expected
+    unsigned char low, high;          // Allowed range of the next continuation byte
+};
+
+/**
+ * A histogram kernel adds the letters in Data to histogram. Every kernel must
+ * produce exactly the same counts as the scalar one.
+ */
+typedef void (*HistogramKernel)(const unsigned char *Data, size_t Size, uint64_t histogram[26]);
+
+static void wideAccumulate(struct WideHistogram *h, const unsigned char *data, size_t size); // Add bytes and codepoints
+static _Thread_local struct WideHistogram *wideHistogram = NULL; // Wide modes: tables of the file being counted
+static _Thread_local int histogramIncomplete = 0; // A wide table could not grow: collectPairs() fails
+const struct ClassPolicy *classPolicy = NULL; // --alphabet/--case policy, NULL for case-folded a-z
+static _Thread_local uint64_t classCounts[MAX_CLASSES + 1]; // Class counts of the file being counted
+static _Thread_local struct HistogramPair *pairBuffer = NULL; // Output of collectPairs(), reused
+static _Thread_local size_t pairCapacity = 0;
+static void histogramScalar(const unsigned char *Data, size_t Size, uint64_t histogram[26]);
+static HistogramKernel histogramKernel = histogramScalar; // Kernel picked by selectHistogramKernel()
+const char *histogramKernelName = "scalar";        // Name of the selected kernel
+
+/**
+ * Adds the letters (a-z) in input data to an existing histogram, so one
+ * histogram can be built up from consecutive chunks of a file.
+ * Counting is done by the kernel chosen at startup by selectHistogramKernel(),
+ * or in the wide modes into the thread's WideHistogram between
+ * beginHistogram() and endHistogram().
+ * @param Data Pointer to input character array
+ * @param Size Size of input data
+ * @param histogram Array of 26 counts to add to
+ */
+void HistogramAccumulate(const char *Data, size_t Size, uint64_t histogram[26]) {
+    STATS_BEGIN(timer);
+    if (wideHistogram) {
+        wideAccumulate(wideHistogram, (const unsigned char *)Data, Size); // Letters come from the bytes
+    } else if (classPolicy) {
+        classPolicy->kernel((const unsigned char *)Data, Size, classCounts);
+    } else {
+        histogramKernel((const unsigned char *)Data, Size, histogram);
+    }
+    STATS_END(STAGE_HISTOGRAM, timer, 1);
+    STATS_ADD(bytes, Size);
+}
+
+/**
+ * Scalar kernel. ORing in 0x20 folds upper case onto lower case, and a single
+ * unsigned compare then accepts exactly 'a'-'z', which is what isalpha() and
+ * tolower() do in the C locale this program runs in.
+ *
+ * Consecutive bytes are counted into HISTOGRAM_LANES separate sub-histograms,
+ * so runs of the same letter ("ee", "tt") increment different memory words
+ * instead of stalling on the previous store. The lanes are merged into the
+ * caller's histogram once per call, i.e. once per chunk.
+ */
+static void histogramScalar(const unsigned char *Data, size_t Size, uint64_t histogram[26]) {
+    uint64_t lanes[HISTOGRAM_LANES][26];
+    memset(lanes, 0, sizeof(lanes));
+
+    size_t i = 0;
+    for (; i + HISTOGRAM_LANES <= Size; i += HISTOGRAM_LANES) {
+        for (int lane = 0; lane < HISTOGRAM_LANES; lane++) {
+            unsigned letter = (unsigned)(Data[i + lane] | 0x20) - 'a';
+            if (letter < 26) lanes[lane][letter]++;
+        }
+    }
+    for (; i < Size; i++) {
+        unsigned letter = (unsigned)(Data[i] | 0x20) - 'a';
+        if (letter < 26) lanes[0][letter]++;
+    }
+
+    for (int letter = 0; letter < 26; letter++) {
+        uint64_t sum = 0;
+        for (int lane = 0; lane < HISTOGRAM_LANES; lane++) sum += lanes[lane][letter];
+        histogram[letter] += sum;
+    }
+}
+
+/*
+ * The SIMD kernels below all work the same way: the input is split into
+ * blocks of at most SIMD_BLOCK_VECTORS vectors, and for each pair of letters
+ * the block (hot in L1) is case-folded and compared against both letters,
+ * subtracting the all-ones compare results into 8-bit counters. The counters
+ * are widened and added to the histogram once per block, and the tail that
+ * doesn't fill a vector goes through the scalar kernel.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void histogramSSE2(const unsigned char *Data, size_t Size, uint64_t histogram[26]) {
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (Size >= 16) {
+        size_t vectors = Size / 16;
+        if (vectors > SIMD_BLOCK_VECTORS) vectors = SIMD_BLOCK_VECTORS;
+
+        for (int letter = 0; letter < 26; letter += 2) {
+            const __m128i first = _mm_set1_epi8('a' + letter);
+            const __m128i second = _mm_set1_epi8('a' + letter + 1);
+            __m128i count0 = zero, count1 = zero;
+            for (size_t v = 0; v < vectors; v++) {
+                __m128i bytes = _mm_loadu_si128((const __m128i *)(Data + 16 * v));
+                __m128i lower = _mm_or_si128(bytes, caseBit);
+                count0 = _mm_sub_epi8(count0, _mm_cmpeq_epi8(lower, first));
+                count1 = _mm_sub_epi8(count1, _mm_cmpeq_epi8(lower, second));
+            }
+            // psadbw against zero sums each group of 8 counters into a 64-bit lane
+            __m128i sum0 = _mm_sad_epu8(count0, zero);
+            __m128i sum1 = _mm_sad_epu8(count1, zero);
+            histogram[letter] += _mm_cvtsi128_si32(sum0) + _mm_cvtsi128_si32(_mm_srli_si128(sum0, 8));
+            histogram[letter + 1] += _mm_cvtsi128_si32(sum1) + _mm_cvtsi128_si32(_mm_srli_si128(sum1, 8));
+        }
+        Data += 16 * vectors;
+        Size -= 16 * vectors;
+    }
+    histogramScalar(Data, Size, histogram);
+}
+
+__attribute__((target("avx2")))
+static void histogramAVX2(const unsigned char *Data, size_t Size, uint64_t histogram[26]) {
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (Size >= 32) {
+        size_t vectors = Size / 32;
+        if (vectors > SIMD_BLOCK_VECTORS) vectors = SIMD_BLOCK_VECTORS;
+
+        for (int letter = 0; letter < 26; letter += 2) {
+            const __m256i first = _mm256_set1_epi8('a' + letter);
+            const __m256i second = _mm256_set1_epi8('a' + letter + 1);
+            __m256i count0 = zero, count1 = zero;
+            for (size_t v = 0; v < vectors; v++) {
+                __m256i bytes = _mm256_loadu_si256((const __m256i *)(Data + 32 * v));
+                __m256i lower = _mm256_or_si256(bytes, caseBit);
+                count0 = _mm256_sub_epi8(count0, _mm256_cmpeq_epi8(lower, first));
+                count1 = _mm256_sub_epi8(count1, _mm256_cmpeq_epi8(lower, second));
+            }
+            // Fold the four 64-bit lane sums down to one
+            __m256i sums = _mm256_add_epi64(_mm256_sad_epu8(count0, zero),
+                                            _mm256_slli_si256(_mm256_sad_epu8(count1, zero), 4));
+            __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+            half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+            histogram[letter] += _mm_cvtsi128_si32(half);
+            histogram[letter + 1] += _mm_cvtsi128_si32(_mm_srli_si128(half, 4));
+        }
+        Data += 32 * vectors;
+        Size -= 32 * vectors;
+    }
+    histogramScalar(Data, Size, histogram);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void histogramAVX512(const unsigned char *Data, size_t Size, uint64_t histogram[26]) {
+    const __m512i caseBit = _mm512_set1_epi8(0x20);
+    const __m512i one = _mm512_set1_epi8(1);
+    const __m512i zero = _mm512_setzero_si512();
+
+    while (Size >= 64) {
+        size_t vectors = Size / 64;
+        if (vectors > SIMD_BLOCK_VECTORS) vectors = SIMD_BLOCK_VECTORS;
+
+        for (int letter = 0; letter < 26; letter += 2) {
+            const __m512i first = _mm512_set1_epi8('a' + letter);
+            const __m512i second = _mm512_set1_epi8('a' + letter + 1);
+            __m512i count0 = zero, count1 = zero;
+            for (size_t v = 0; v < vectors; v++) {
+                __m512i bytes = _mm512_loadu_si512((const void *)(Data + 64 * v));
+                __m512i lower = _mm512_or_si512(bytes, caseBit);
+                count0 = _mm512_mask_add_epi8(count0, _mm512_cmpeq_epi8_mask(lower, first), count0, one);
+                count1 = _mm512_mask_add_epi8(count1, _mm512_cmpeq_epi8_mask(lower, second), count1, one);
+            }
+            histogram[letter] += _mm512_reduce_add_epi64(_mm512_sad_epu8(count0, zero));
+            histogram[letter + 1] += _mm512_reduce_add_epi64(_mm512_sad_epu8(count1, zero));
+        }
+        Data += 64 * vectors;
+        Size -= 64 * vectors;
+    }
+    histogramScalar(Data, Size, histogram);
+}
+
+#elif defined(__aarch64__)
+
+static void histogramNEON(const unsigned char *Data, size_t Size, uint64_t histogram[26]) {
+    const uint8x16_t caseBit = vdupq_n_u8(0x20);
+
+    while (Size >= 16) {
+        size_t vectors = Size / 16;
+        if (vectors > SIMD_BLOCK_VECTORS) vectors = SIMD_BLOCK_VECTORS;
+
+        for (int letter = 0; letter < 26; letter += 2) {
+            const uint8x16_t first = vdupq_n_u8('a' + letter);
+            const uint8x16_t second = vdupq_n_u8('a' + letter + 1);
+            uint8x16_t count0 = vdupq_n_u8(0), count1 = vdupq_n_u8(0);
+            for (size_t v = 0; v < vectors; v++) {
+                uint8x16_t lower = vorrq_u8(vld1q_u8(Data + 16 * v), caseBit);
+                count0 = vsubq_u8(count0, vceqq_u8(lower, first));
+                count1 = vsubq_u8(count1, vceqq_u8(lower, second));
+            }
+            histogram[letter] += vaddlvq_u8(count0);
+            histogram[letter + 1] += vaddlvq_u8(count1);
+        }
+        Data += 16 * vectors;
+        Size -= 16 * vectors;
+    }
+    histogramScalar(Data, Size, histogram);
+}
+
+#endif
+
+/*
+ * Alphabet policies other than case-folded a-z count through a 256-entry
+ * byte-to-class table. The tables of the built-in policies are constant
+ * initialisers expanded by the preprocessor, so the compiler sees every
+ * entry, and each policy gets its own copy of the counting loop with the
+ * table and the class count baked in. The policy is picked once per run.
+ */
+#define CLASS_TABLE_4(f, c) f(c), f(c + 1), f(c + 2), f(c + 3)
+#define CLASS_TABLE_16(f, c) CLASS_TABLE_4(f, c), CLASS_TABLE_4(f, c + 4), \
+                             CLASS_TABLE_4(f, c + 8), CLASS_TABLE_4(f, c + 12)
+#define CLASS_TABLE_64(f, c) CLASS_TABLE_16(f, c), CLASS_TABLE_16(f, c + 16), \
+                             CLASS_TABLE_16(f, c + 32), CLASS_TABLE_16(f, c + 48)
+#define CLASS_TABLE(f) { CLASS_TABLE_64(f, 0), CLASS_TABLE_64(f, 64), \
+                         CLASS_TABLE_64(f, 128), CLASS_TABLE_64(f, 192) }
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_UPPER(c) ((c) >= 'A' && (c) <= 'Z')
+#define IS_LOWER(c) ((c) >= 'a' && (c) <= 'z')
+
+// A-Z then a-z
+#define SENSITIVE_LETTERS_CLASS(c) \
+    (IS_UPPER(c) ? (c) - 'A' : IS_LOWER(c) ? 26 + (c) - 'a' : 52)
+
+// 0-9 then a-z, upper case folded
+#define FOLDED_ALNUM_CLASS(c) \
+    (IS_DIGIT(c) ? (c) - '0' : IS_UPPER(c) ? 10 + (c) - 'A' : IS_LOWER(c) ? 10 + (c) - 'a' : 36)
+
+// 0-9, A-Z, then a-z
+#define SENSITIVE_ALNUM_CLASS(c) \
+    (IS_DIGIT(c) ? (c) - '0' : IS_UPPER(c) ? 10 + (c) - 'A' : IS_LOWER(c) ? 36 + (c) - 'a' : 62)
+
+static const unsigned char sensitiveLettersTable[256] = CLASS_TABLE(SENSITIVE_LETTERS_CLASS);
+static const unsigned char foldedAlnumTable[256] = CLASS_TABLE(FOLDED_ALNUM_CLASS);
+static const unsigned char sensitiveAlnumTable[256] = CLASS_TABLE(SENSITIVE_ALNUM_CLASS);
+
+static unsigned char customTable[256]; // Built by buildCustomPolicy()
+static unsigned char customLabels[MAX_CLASSES];
+
+/**
+ * Defines a class kernel for one table. The bytes are counted into
+ * HISTOGRAM_LANES sub-histograms, one slot wider than the alphabet for the
+ * bytes that aren't counted, so the loop never branches.
+ */
+#define DEFINE_CLASS_KERNEL(name, table, classes)                                   \
+    void name(const unsigned char *Data, size_t Size, uint64_t *counts) {           \
+        uint64_t lanes[HISTOGRAM_LANES][(classes) + 1];                             \
+        memset(lanes, 0, sizeof(lanes));                                            \
+        size_t i = 0;                                                               \
+        for (; i + HISTOGRAM_LANES <= Size; i += HISTOGRAM_LANES) {                 \
+            for (int lane = 0; lane < HISTOGRAM_LANES; lane++) {                    \
+                lanes[lane][table[Data[i + lane]]]++;                               \
+            }                                                                       \
+        }                                                                           \
+        for (; i < Size; i++) lanes[0][table[Data[i]]]++;                           \
+        for (int c = 0; c < (classes); c++) {                                       \
+            uint64_t sum = 0;                                                       \
+            for (int lane = 0; lane < HISTOGRAM_LANES; lane++) sum += lanes[lane][c]; \
+            counts[c] += sum;                                                       \
+        }                                                                           \
+    }
+
+DEFINE_CLASS_KERNEL(histogramSensitiveLetters, sensitiveLettersTable, 52)
+
+DEFINE_CLASS_KERNEL(histogramFoldedAlnum, foldedAlnumTable, 36)
+
+DEFINE_CLASS_KERNEL(histogramSensitiveAlnum, sensitiveAlnumTable, 62)
+
+DEFINE_CLASS_KERNEL(histogramCustom, customTable, MAX_CLASSES) // Classes past the alphabet stay 0
+
+static const struct ClassPolicy builtinPolicies[] = {
+    { "letters/sensitive", sensitiveLettersTable,
+      (const unsigned char *)"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz", 52,
+      histogramSensitiveLetters },
+    { "alnum/fold", foldedAlnumTable,
+      (const unsigned char *)"0123456789abcdefghijklmnopqrstuvwxyz", 36, histogramFoldedAlnum },
+    { "alnum/sensitive", sensitiveAlnumTable,
+      (const unsigned char *)"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz", 62,
+      histogramSensitiveAlnum },
+};
+static struct ClassPolicy customPolicy = { "custom", customTable, customLabels, 0, histogramCustom };
+
+/**
+ * Builds the table of a custom alphabet: each distinct character of chars is
+ * a class, labelled by itself. With case folding a letter counts both of its
+ * cases and is labelled in lower case.
+ * @return The policy, or NULL if chars is empty
+ */
+static const struct ClassPolicy *buildCustomPolicy(const char *chars, int fold) {
+    int member[256] = { 0 };
+    for (const unsigned char *p = (const unsigned char *)chars; *p; p++) {
+        member[fold && IS_UPPER(*p) ? *p + ('a' - 'A') : *p] = 1;
+    }
+
+    // Classes in ascending label order, so pairs come out sorted
+    int numClasses = 0;
+    unsigned char classOf[256];
+    for (int c = 0; c < 256; c++) {
+        if (!member[c]) continue;
+        classOf[c] = numClasses;
+        customLabels[numClasses++] = c;
+    }
+    if (numClasses == 0) return NULL;
+    for (int c = 0; c < 256; c++) {
+        int label = fold && IS_UPPER(c) ? c + ('a' - 'A') : c;
+        customTable[c] = member[label] ? classOf[label] : MAX_CLASSES;
+    }
+    customPolicy.numClasses = numClasses;
+    return &customPolicy;
+}
+
+/**
+ * Picks the class policy for --alphabet and --case.
+ * @param alphabet "letters", "alnum" or "chars:" followed by the characters
+ * @param fold Whether upper case counts as lower case
+ * @param policy Receives the policy, NULL for the default case-folded a-z
+ * @return 0 on success, -1 if the alphabet is unknown or empty
+ */
+int selectClassPolicy(const char *alphabet, int fold, const struct ClassPolicy **policy) {
+    if (strcmp(alphabet, "letters") == 0) {
+        *policy = fold ? NULL : &builtinPolicies[0];
+    } else if (strcmp(alphabet, "alnum") == 0) {
+        *policy = fold ? &builtinPolicies[1] : &builtinPolicies[2];
+    } else if (strncmp(alphabet, "chars:", 6) == 0) {
+        *policy = buildCustomPolicy(alphabet + 6, fold);
+        if (!*policy) return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Picks the histogram kernel used by HistogramAccumulate().
+ * @param name "auto" for the best kernel this CPU supports, or one of
+ *             "avx512", "avx2", "sse2", "neon" or "scalar"
+ * @return 0 on success, -1 if the kernel is unknown or not supported here
+ */
+int selectHistogramKernel(const char *name) {
+    int best = strcmp(name, "auto") == 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((best || strcmp(name, "avx512") == 0) && __builtin_cpu_supports("avx512bw")) {
+        histogramKernel = histogramAVX512;
+        histogramKernelName = "avx512";
+        return 0;
+    }
+    if ((best || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        histogramKernel = histogramAVX2;
+        histogramKernelName = "avx2";
+        return 0;
+    }
+    if ((best || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        histogramKernel = histogramSSE2;
+        histogramKernelName = "sse2";
+        return 0;
+    }
+#elif defined(__aarch64__)
+    // Advanced SIMD is mandatory on AArch64
+    if (best || strcmp(name, "neon") == 0) {
+        histogramKernel = histogramNEON;
+        histogramKernelName = "neon";
+        return 0;
+    }
+#endif
+
+    if (best || strcmp(name, "scalar") == 0) {
+        histogramKernel = histogramScalar;
+        histogramKernelName = "scalar";
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Tells whether a 16-byte block is all ASCII, with one vector compare where
+ * the CPU has one.
+ */
+static int isAsciiBlock(const unsigned char *p) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0;
+#elif defined(__aarch64__)
+    return vmaxvq_u8(vld1q_u8(p)) < 0x80;
+#else
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    return ((a | b) & 0x8080808080808080ull) == 0;
+#endif
+}
+
+/**
+ * Counts one codepoint above U+007F.
+ */
+static void addCodepoint(struct WideHistogram *h, uint32_t codepoint) {
+    if (codepoint < UTF8_DENSE_LIMIT) {
+        h->dense[codepoint]++;
+        return;
+    }
+    if (2 * (h->sparseCount + 1) > h->sparseCapacity) {
+        // Grow at half load; rehash into a table twice the size
+        uint32_t capacity = h->sparseCapacity ? 2 * h->sparseCapacity : SPARSE_INITIAL_SLOTS;
+        struct HistogramPair *table = (struct HistogramPair *)calloc(capacity, sizeof(*table));
+        if (!table) {
+            if (!histogramIncomplete) perror("Failed to allocate codepoint table");
+            histogramIncomplete = 1;
+            return;
+        }
+        for (uint32_t i = 0; i < h->sparseCapacity; i++) {
+            if (!h->sparse[i].count) continue;
+            uint32_t j = (h->sparse[i].bucket * 2654435761u) & (capacity - 1);
+            while (table[j].count) j = (j + 1) & (capacity - 1);
+            table[j] = h->sparse[i];
+        }
+        free(h->sparse);
+        h->sparse = table;
+        h->sparseCapacity = capacity;
+    }
+    uint32_t j = (codepoint * 2654435761u) & (h->sparseCapacity - 1);
+    while (h->sparse[j].count && h->sparse[j].bucket != codepoint) j = (j + 1) & (h->sparseCapacity - 1);
+    if (!h->sparse[j].count) {
+        h->sparse[j].bucket = codepoint;
+        h->sparseCount++;
+    }
+    h->sparse[j].count++;
+}
+
+/**
+ * Feeds one byte that is either not ASCII or arrives mid-sequence to the
+ * UTF-8 decoder. Validation follows the Unicode table of well-formed
+ * sequences, so overlong forms, surrogates and values past U+10FFFF are
+ * malformed, and each maximal malformed subpart counts once as invalid.
+ */
+static void decodeByte(struct WideHistogram *h, unsigned char c) {
+    if (h->need) {
+        if (c >= h->low && c <= h->high) {
+            h->codepoint = (h->codepoint << 6) | (c & 0x3F);
+            h->low = 0x80;
+            h->high = 0xBF;
+            if (--h->need == 0) addCodepoint(h, h->codepoint);
+            return;
+        }
+        h->invalid++; // Truncated sequence; c starts afresh
+        h->need = 0;
+    }
+    if (c < 0x80) return; // Counted through the byte table
+    h->low = 0x80;
+    h->high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        h->codepoint = c & 0x1F;
+        h->need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        h->codepoint = c & 0x0F;
+        h->need = 2;
+        if (c == 0xE0) h->low = 0xA0;  // Overlong
+        if (c == 0xED) h->high = 0x9F; // Surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        h->codepoint = c & 0x07;
+        h->need = 3;
+        if (c == 0xF0) h->low = 0x90;  // Overlong
+        if (c == 0xF4) h->high = 0x8F; // Past U+10FFFF
+    } else {
+        h->invalid++; // Stray continuation byte, C0, C1 or F5-FF
+    }
+}
+
+/**
+ * Wide kernel: counts every byte and, with --histogram=utf8, decodes the
+ * codepoints in the same pass. Data is walked in 16-byte blocks; the bytes
+ * go into HISTOGRAM_LANES sub-histograms as in the scalar letter kernel, and
+ * a block that is all ASCII with no sequence pending skips the decoder.
+ */
+static void wideAccumulate(struct WideHistogram *h, const unsigned char *data, size_t size) {
+    static _Thread_local uint64_t lanes[HISTOGRAM_LANES][256];
+    int decode = histogramMode == HISTOGRAM_UTF8;
+    memset(lanes, 0, sizeof(lanes));
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const unsigned char *block = data + i;
+        for (int j = 0; j < 16; j += HISTOGRAM_LANES) {
+            lanes[0][block[j]]++;
+            lanes[1][block[j + 1]]++;
+            lanes[2][block[j + 2]]++;
+            lanes[3][block[j + 3]]++;
+        }
+        if (!decode || (!h->need && isAsciiBlock(block))) continue;
+        for (int j = 0; j < 16; j++) {
+            if (block[j] >= 0x80 || h->need) decodeByte(h, block[j]);
+        }
+    }
+    for (; i < size; i++) {
+        lanes[0][data[i]]++;
+        if (decode && (data[i] >= 0x80 || h->need)) decodeByte(h, data[i]);
+    }
+
+    for (int b = 0; b < 256; b++) {
+        h->bytes[b] += lanes[0][b] + lanes[1][b] + lanes[2][b] + lanes[3][b];
+    }
+}
+
+/**
+ * Starts the histogram of one input: clears the letter counts, the class
+ * counts of an alphabet policy and, in the wide modes, the calling thread's
+ * WideHistogram, which HistogramAccumulate() then fills instead.
+ */
+void beginHistogram(uint64_t counts[26]) {
+    memset(counts, 0, 26 * sizeof(uint64_t));
+    if (classPolicy) memset(classCounts, 0, classPolicy->numClasses * sizeof(uint64_t));
+    histogramIncomplete = 0;
+    if (histogramMode == HISTOGRAM_LETTERS) return;
+    struct WideHistogram *h = wideHistogram;
+    if (!h) {
+        h = (struct WideHistogram *)calloc(1, sizeof(*h));
+        if (!h) {
+            perror("Failed to allocate histogram");
+            histogramIncomplete = 1; // Only the letters get counted
+            return;
+        }
+        wideHistogram = h;
+        return;
+    }
+    memset(h->bytes, 0, sizeof(h->bytes));
+    memset(h->dense, 0, sizeof(h->dense));
+    if (h->sparseCount) memset(h->sparse, 0, h->sparseCapacity * sizeof(*h->sparse));
+    h->sparseCount = 0;
+    h->invalid = 0;
+    h->need = 0;
+}
+
+/**
+ * Finishes the histogram of one input. In the wide modes a sequence cut off
+ * by the end of the input counts as invalid, and the letter (or class)
+ * counts are summed from the byte counts, which gives exactly what the
+ * kernels would have counted. With an alphabet policy the letter counts are
+ * the letters among its classes, case folded; letters outside it stay 0.
+ */
+void endHistogram(uint64_t counts[26]) {
+    struct WideHistogram *h = wideHistogram;
+    if (h) {
+        if (h->need) h->invalid++;
+        h->need = 0;
+        if (!classPolicy) {
+            for (int letter = 0; letter < 26; letter++) {
+                counts[letter] = h->bytes['a' + letter] + h->bytes['A' + letter];
+            }
+        } else {
+            memset(classCounts, 0, sizeof(classCounts));
+            for (int b = 0; b < 256; b++) classCounts[classPolicy->table[b]] += h->bytes[b];
+        }
+    }
+    if (!classPolicy) return;
+    for (int c = 0; c < classPolicy->numClasses; c++) {
+        unsigned letter = (unsigned)(classPolicy->labels[c] | 0x20) - 'a';
+        if (letter < 26) counts[letter] += classCounts[c];
+    }
+}
+
+/**
+ * Appends a bucket to the calling thread's pair buffer, or marks the
+ * histogram incomplete if the buffer can't grow.
+ */
+static void addPair(size_t *numPairs, uint32_t bucket, uint64_t count) {
+    if (!count || histogramIncomplete) return;
+    if (*numPairs == pairCapacity) {
+        size_t capacity = pairCapacity ? 2 * pairCapacity : 1024;
+        struct HistogramPair *grown = (struct HistogramPair *)realloc(pairBuffer, capacity * sizeof(*grown));
+        if (!grown) {
+            perror("Failed to allocate histogram pairs");
+            histogramIncomplete = 1;
+            return;
+        }
+        pairBuffer = grown;
+        pairCapacity = capacity;
+    }
+    pairBuffer[*numPairs].bucket = bucket;
+    pairBuffer[*numPairs].reserved = 0;
+    pairBuffer[(*numPairs)++].count = count;
+}
+
+static int comparePairs(const void *a, const void *b) {
+    uint32_t x = ((const struct HistogramPair *)a)->bucket, y = ((const struct HistogramPair *)b)->bucket;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Lists the nonzero buckets of the thread's finished wide histogram and
+ * alphabet classes, sorted by bucket, in its pair buffer.
+ * @param pairs Receives the buffer, valid until the next call on this thread
+ * @param count Receives the number of pairs, 0 for plain letters
+ * @return 0, or -1 if memory ran out while counting or listing, which is a
+ *         failure of the input worth retrying
+ */
+int collectPairs(const struct HistogramPair **pairs, uint32_t *count) {
+    struct WideHistogram *h = wideHistogram;
+    size_t numPairs = 0;
+    *pairs = pairBuffer;
+    *count = 0;
+    if (histogramIncomplete) return -1;
+
+    if (h && histogramMode == HISTOGRAM_UTF8) {
+        for (uint32_t c = 0; c < 0x80; c++) addPair(&numPairs, c, h->bytes[c]);
+        for (uint32_t c = 0x80; c < UTF8_DENSE_LIMIT; c++) addPair(&numPairs, c, h->dense[c]);
+        size_t sparseStart = numPairs;
+        for (uint32_t i = 0; i < h->sparseCapacity; i++) {
+            addPair(&numPairs, h->sparse[i].bucket, h->sparse[i].count);
+        }
+        qsort(pairBuffer + sparseStart, numPairs - sparseStart, sizeof(*pairBuffer), comparePairs);
+        addPair(&numPairs, BUCKET_INVALID, h->invalid);
+    }
+    if (h) {
+        for (int b = 0; b < 256; b++) addPair(&numPairs, BUCKET_BYTE(b), h->bytes[b]);
+    }
+    if (classPolicy) {
+        for (int c = 0; c < classPolicy->numClasses; c++) {
+            addPair(&numPairs, BUCKET_CLASS(classPolicy->labels[c]), classCounts[c]);
+        }
+    }
+    if (histogramIncomplete) return -1;
+    *pairs = pairBuffer;
+    *count = numPairs;
+    return 0;
+}
@@ -0,0 +1,396 @@
+/**
+ * Where results go: .hist files through the writer thread, the binary
+ * results file, the coordinator uplink and the embedding callback.
+ */
+#include "engine.h"
+
+#define HIST_TEXT_MAX (26 * 23) // Longest .hist text: "x=" + 20 digits + newline per letter
+#define WRITER_QUEUE_SIZE 256   // .hist files the writer thread can have pending
+#define WRITER_BATCH 32         // .hist files the writer thread takes per wakeup
+
+/**
+ * Header of the binary results file written with --output=binary. All fields
+ * are native-endian and every section starts on an 8-byte boundary, so the
+ * file can be mmap()ed and indexed directly:
+ *
+ *   header | counts: numFiles x buckets uint64 | total: buckets uint64 |
+ *   entries: numFiles x struct ResultsEntry | pairs: struct HistogramPair |
+ *   strings: NUL-terminated paths
+ *
+ * Row i of counts belongs to entry i, and so do its numPairs pairs starting
+ * at firstPair. The header is written last, so a file from an interrupted
+ * run has no valid magic. Version 2 added the pairs. Statuses 2 to 4
+ * (STATUS_RETRY, STATUS_CRASHED and STATUS_SKIPPED) came later without a
+ * version bump, so readers should take any nonzero status as not counted.
+ */
+#define RESULTS_MAGIC "HISTRES\0"
+#define RESULTS_FILE_VERSION 2
+struct ResultsFileHeader {
+    char magic[8];          // RESULTS_MAGIC
+    uint32_t version;       // RESULTS_FILE_VERSION
+    uint32_t buckets;       // Counts per row (26)
+    uint64_t numFiles;      // Number of rows and entries
+    uint64_t countsOffset;  // Offset of the counts array
+    uint64_t totalOffset;   // Offset of the summed histogram
+    uint64_t entriesOffset; // Offset of the entries array
+    uint64_t stringsOffset; // Offset of the path string table
+    uint64_t stringsSize;   // Size of the string table in bytes
+    uint64_t pairsOffset;   // Offset of the pairs array
+    uint64_t numPairs;      // Pairs of every file, 0 with --histogram=letters
+};
+
+/**
+ * Per-file entry of the binary results file.
+ */
+struct ResultsEntry {
+    uint64_t pathOffset; // Offset of the path within the string table
+    uint32_t pathLength; // Length of the path, excluding the NUL
+    uint32_t status;     // An enum TaskStatus (histogram.h): 0 if counted
+    uint64_t firstPair;  // Index of the file's first pair in the pairs array
+    uint64_t numPairs;   // Number of pairs of the file
+};
+
+/**
+ * One .hist file waiting to be written, already formatted.
+ */
+struct HistWrite {
+    char filename[64];
+    size_t length;
+    char text[HIST_TEXT_MAX];
+    char *pairsText;       // Wide modes: formatted pairs, owned; NULL otherwise
+    size_t pairsLength;
+};
+
+/**
+ * Bounded queue feeding the writer thread, so the parent's event loop only
+ * formats results and never blocks on open()/write()/close().
+ */
+static struct WriterQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    struct HistWrite items[WRITER_QUEUE_SIZE];
+    int head;     // Oldest pending entry
+    int count;    // Number of pending entries
+    int closing;  // Set by stopWriter(); the thread drains the queue and exits
+    int running;  // Set while the writer thread exists
+    pthread_t thread;
+} writer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/**
+ * Formats a histogram as one "letter=count" line per letter.
+ * @param out Buffer of at least HIST_TEXT_MAX bytes
+ * @return Length of the text (not NUL terminated)
+ */
+static size_t formatHistogram(const uint64_t counts[26], char *out) {
+    char *p = out;
+    for (int letter = 0; letter < 26; letter++) {
+        char digits[20];
+        int n = 0;
+        uint64_t count = counts[letter];
+        do {
+            digits[n++] = '0' + count % 10;
+            count /= 10;
+        } while (count);
+
+        *p++ = 'a' + letter;
+        *p++ = '=';
+        while (n) *p++ = digits[--n];
+        *p++ = '\n';
+    }
+    return p - out;
+}
+
+/**
+ * Formats histogram pairs for a .hist file, one line per bucket after the
+ * letters: "U+00E9=count" for a codepoint, "invalid=count" for malformed
+ * UTF-8, "0x41=count" for a byte value and "A=count" for an alphabet class
+ * (or "\x01=count" if its label isn't printable).
+ * @param length Receives the length of the text
+ * @return Text to free(), NULL if there are no pairs or it could not be
+ *         allocated
+ */
+static char *formatPairs(const struct HistogramPair *pairs, uint32_t numPairs, size_t *length) {
+    *length = 0;
+    if (numPairs == 0) return NULL;
+    size_t capacity = (size_t)numPairs * 32; // "U+10FFFF=" + 20 digits + newline
+    char *text = (char *)malloc(capacity);
+    if (!text) return NULL;
+    for (uint32_t i = 0; i < numPairs; i++) {
+        uint32_t bucket = pairs[i].bucket;
+        char *p = text + *length;
+        if (bucket < BUCKET_INVALID) {
+            *length += sprintf(p, "U+%04" PRIX32 "=%" PRIu64 "\n", bucket, pairs[i].count);
+        } else if (bucket == BUCKET_INVALID) {
+            *length += sprintf(p, "invalid=%" PRIu64 "\n", pairs[i].count);
+        } else if (bucket >= BUCKET_CLASS(0)) {
+            unsigned label = bucket - BUCKET_CLASS(0);
+            *length += sprintf(p, label > ' ' && label < 0x7F ? "%c=%" PRIu64 "\n" : "\\x%02x=%" PRIu64 "\n",
+                               label, pairs[i].count);
+        } else {
+            *length += sprintf(p, "0x%02" PRIx32 "=%" PRIu64 "\n", bucket - BUCKET_BYTE(0), pairs[i].count);
+        }
+    }
+    return text;
+}
+
+/**
+ * Writes one formatted .hist file, replacing any previous contents, and
+ * frees its pairs text. Running out of descriptors is retried with backoff;
+ * a file that still can't be written is reported and counted, and the run
+ * goes on.
+ */
+static void writeHistogramFile(struct HistWrite *entry) {
+    STATS_BEGIN(timer);
+    int fd, attempt = 0;
+    while ((fd = open(entry->filename, O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1 &&
+           failureStatus(errno) == STATUS_RETRY && attempt < maxRetries) {
+        sleepMilliseconds(retryDelay(++attempt));
+    }
+    if (fd == -1) {
+        LOG(LEVEL_ERROR, "Error creating %s: %s\n", entry->filename, strerror(errno));
+        lostOutputs++;
+    } else if (writeFull(fd, entry->text, entry->length) < 0 ||
+               (entry->pairsText && writeFull(fd, entry->pairsText, entry->pairsLength) < 0)) {
+        LOG(LEVEL_ERROR, "Error writing %s: %s\n", entry->filename, strerror(errno));
+        lostOutputs++;
+    }
+    if (fd != -1) close(fd);
+    free(entry->pairsText);
+    entry->pairsText = NULL;
+    STATS_END(STAGE_OUTPUT, timer, 3);
+}
+
+/**
+ * Writer thread: takes pending .hist files off the queue in batches and
+ * writes them until stopWriter() has been called and the queue is empty.
+ */
+static void *runWriter(void *arg) {
+    static struct HistWrite batch[WRITER_BATCH];
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&writer.lock);
+        while (writer.count == 0 && !writer.closing) pthread_cond_wait(&writer.notEmpty, &writer.lock);
+        if (writer.count == 0) {
+            pthread_mutex_unlock(&writer.lock);
+            return NULL;
+        }
+        int taken = writer.count < WRITER_BATCH ? writer.count : WRITER_BATCH;
+        for (int i = 0; i < taken; i++) {
+            batch[i] = writer.items[writer.head];
+            writer.head = (writer.head + 1) % WRITER_QUEUE_SIZE;
+        }
+        writer.count -= taken;
+        pthread_cond_signal(&writer.notFull);
+        pthread_mutex_unlock(&writer.lock);
+
+        for (int i = 0; i < taken; i++) writeHistogramFile(&batch[i]);
+    }
+}
+
+/**
+ * Starts the writer thread. Must be called after the workers are forked.
+ */
+void startWriter(void) {
+    int rc = pthread_create(&writer.thread, NULL, runWriter, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "Error creating writer thread: %s\n", strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    writer.running = 1;
+}
+
+/**
+ * Waits for every queued .hist file to be written and stops the writer thread.
+ */
+void stopWriter(void) {
+    if (!writer.running) return;
+    pthread_mutex_lock(&writer.lock);
+    writer.closing = 1;
+    pthread_cond_signal(&writer.notEmpty);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+    writer.running = 0;
+}
+
+struct ResultsWriter results = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Creates the binary results file and its spool files.
+ */
+void openResults(void) {
+    results.out = fopen(resultsPath, "wb");
+    results.entries = tmpfile();
+    results.strings = tmpfile();
+    results.pairs = tmpfile();
+    if (!results.out || !results.entries || !results.strings || !results.pairs) {
+        perror("Error creating results file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Space for the header, which is filled in by closeResults()
+    struct ResultsFileHeader header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, results.out);
+}
+
+/**
+ * Appends one file's result to the binary results file.
+ * @param status A TaskStatus, 0 if counted
+ * @param counts Histogram of the file, ignored when status is nonzero
+ * @param pairs Wide buckets of the file, numPairs of them
+ */
+static void appendResult(const char *path, int status, const uint64_t counts[26],
+                  const struct HistogramPair *pairs, uint32_t numPairs) {
+    static const uint64_t zeroCounts[26];
+    struct ResultsEntry entry;
+    size_t length = strlen(path);
+
+    STATS_BEGIN(timer);
+    pthread_mutex_lock(&results.lock);
+    entry.pathOffset = results.stringsSize;
+    entry.pathLength = length;
+    entry.status = status;
+    if (status != 0) counts = zeroCounts;
+    entry.firstPair = results.numPairs;
+    entry.numPairs = numPairs;
+
+    fwrite(counts, sizeof(uint64_t), 26, results.out);
+    fwrite(&entry, sizeof(entry), 1, results.entries);
+    fwrite(pairs, sizeof(*pairs), numPairs, results.pairs);
+    results.numPairs += numPairs;
+    fwrite(path, 1, length + 1, results.strings);
+    results.stringsSize += length + 1;
+    results.numFiles++;
+    for (int i = 0; i < 26; i++) results.total[i] += counts[i];
+    pthread_mutex_unlock(&results.lock);
+    STATS_END(STAGE_OUTPUT, timer, 0); // Buffered; flushed by closeResults()
+}
+
+/**
+ * Copies a spool file to the end of the results file.
+ */
+static void appendSpool(FILE *spool) {
+    char buffer[1 << 16];
+    size_t n;
+    rewind(spool);
+    while ((n = fread(buffer, 1, sizeof(buffer), spool)) > 0) fwrite(buffer, 1, n, results.out);
+    fclose(spool);
+}
+
+/**
+ * Appends the total, the entries and the string table, then writes the header.
+ */
+void closeResults(void) {
+    struct ResultsFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESULTS_MAGIC, sizeof(header.magic));
+    header.version = RESULTS_FILE_VERSION;
+    header.buckets = 26;
+    header.numFiles = results.numFiles;
+    header.countsOffset = sizeof(header);
+    header.totalOffset = header.countsOffset + results.numFiles * 26 * sizeof(uint64_t);
+    header.entriesOffset = header.totalOffset + 26 * sizeof(uint64_t);
+    header.pairsOffset = header.entriesOffset + results.numFiles * sizeof(struct ResultsEntry);
+    header.numPairs = results.numPairs;
+    header.stringsOffset = header.pairsOffset + results.numPairs * sizeof(struct HistogramPair);
+    header.stringsSize = results.stringsSize;
+
+    STATS_BEGIN(timer);
+    fwrite(results.total, sizeof(uint64_t), 26, results.out);
+    appendSpool(results.entries);
+    appendSpool(results.pairs);
+    appendSpool(results.strings);
+    fflush(results.out);
+    fseek(results.out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, results.out);
+    if (ferror(results.out) || fclose(results.out) != 0) {
+        perror("Error writing results file");
+        exit(EXIT_FAILURE);
+    }
+    STATS_END(STAGE_OUTPUT, timer, 0);
+    LOG(LEVEL_NOTICE, "Saved %" PRIu64 " results to %s.\n", header.numFiles, resultsPath);
+}
+
+struct Embedding embedding;
+
+/**
+ * Passes a result to the callback of the in-process run.
+ */
+static void deliverResult(int task, const char *path, int status, const uint64_t counts[26],
+                   const struct HistogramPair *pairs, uint32_t numPairs) {
+    struct HistogramResult result = { task, path, status, status == STATUS_COUNTED ? counts : NULL,
+                                      pairs, numPairs };
+    embedding.callback(&result, embedding.context);
+}
+
+/**
+ * Records that an input could not be counted. Only the binary results file
+ * has a place for this; in .hist mode the missing file and the summary at the
+ * end of the run are the only trace. A shard with a coordinator sends it
+ * there instead, and an in-process run passes it to its callback.
+ * @param status Why, a nonzero TaskStatus
+ */
+void saveFailure(int task, const char *path, int status) {
+    statusCounts[status]++;
+    if (embedding.callback) {
+        deliverResult(task, path, status, NULL, NULL, 0);
+    } else if (uplink.fd >= 0) {
+        sendResult(task, status, path, NULL, NULL, 0);
+    } else if (binaryOutput) {
+        appendResult(path, status, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Saves the histogram of an input. In binary output mode it becomes the next
+ * row of the results file. Otherwise it is saved as "file<pid>-<task>.hist"
+ * with one "letter=count" line per letter (or, with an alphabet policy, one
+ * line per class counted), followed by the pairs of the wide modes; the file
+ * is formatted here and, with the writer thread running, queued and written
+ * asynchronously. A shard with a coordinator sends it there instead, and
+ * an in-process run passes it to its callback.
+ */
+void saveHistogram(pid_t pid, int task, const char *path, const uint64_t counts[26],
+                   const struct HistogramPair *pairs, uint32_t numPairs) {
+    statusCounts[STATUS_COUNTED]++;
+    if (embedding.callback) {
+        deliverResult(task, path, STATUS_COUNTED, counts, pairs, numPairs);
+        return;
+    }
+    if (uplink.fd >= 0) {
+        sendResult(task, 0, path, counts, pairs, numPairs);
+        LOG(LEVEL_DEBUG, "Sent the histogram of %s to the coordinator.\n", path);
+        return;
+    }
+    if (binaryOutput) {
+        appendResult(path, 0, counts, pairs, numPairs);
+        LOG(LEVEL_DEBUG, "Added the histogram of %s to %s.\n", path, resultsPath);
+        return;
+    }
+
+    struct HistWrite entry;
+    snprintf(entry.filename, sizeof(entry.filename), "file%d-%d.hist", pid, task);
+    entry.length = classPolicy ? 0 : formatHistogram(counts, entry.text); // Classes replace the letters
+    entry.pairsText = formatPairs(pairs, numPairs, &entry.pairsLength);
+    if (numPairs > 0 && !entry.pairsText) {
+        // Lost like a .hist file that can't be written, rather than saved without its pairs
+        LOG(LEVEL_ERROR, "Error writing %s: %s\n", entry.filename, strerror(ENOMEM));
+        lostOutputs++;
+        return;
+    }
+
+    if (!writer.running) {
+        writeHistogramFile(&entry);
+    } else {
+        pthread_mutex_lock(&writer.lock);
+        while (writer.count == WRITER_QUEUE_SIZE) pthread_cond_wait(&writer.notFull, &writer.lock);
+        writer.items[(writer.head + writer.count) % WRITER_QUEUE_SIZE] = entry;
+        writer.count++;
+        STATS_SAMPLE(writerGauge, writer.count);
+        pthread_cond_signal(&writer.notEmpty);
+        pthread_mutex_unlock(&writer.lock);
+    }
+    LOG(LEVEL_DEBUG, "Saved the histogram of %s to %s.\n", path, entry.filename);
+}
@@ -1,220 +1,432 @@
-#define _POSIX_C_SOURCE 200809L  // Ensures POSIX.1-2008 compatibility for functions like sigaction, lseek
+/**
+ * parallel: counts the letters of files with a pool of worker processes or
+ * threads. This is the command line; the engine is libhistogram.
+ */
+#define _GNU_SOURCE  // POSIX.1-2008 plus GNU getopt_long()
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
-#include <ctype.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-
-#define BUFFER_SIZE 1000 // Buffer size for reading data and lines
-#define MAX_FILES 100    // Maximum number of files the program can process
-
-// Function prototypes
-void sigchld(int sig);              // Signal handler for SIGCHLD
-int *Histogram(char *Data, int Size); // Calculate histogram of letters
-
-// Global variables
-int pipes[MAX_FILES][2]; // Array of pipes for each child process
-int pids[MAX_FILES];     // Array to store PIDs of child processes
-int numChildren = 0;     // Number of child processes created
-int numTerminated = 0;   // Number of child processes that have terminated
+#include "histogram.h"
 
 /**
- * SIGCHLD handler: called when a child process terminates.
- * Reads histogram data from the corresponding pipe and saves it to a file.
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ * @return The size in bytes, or 0 if the string is not a positive size
  */
-void sigchld(int sig) {
-    int child_status;
-    int characterCounts[26]; // Array to store letter counts (a-z)
-    char filename[BUFFER_SIZE]; // File name to save histogram
-    char line[BUFFER_SIZE];     // Line to write to file
-    pid_t child_pid;
-
-    // Loop to process all terminated children without blocking
-    while ((child_pid = waitpid(-1, &child_status, WNOHANG)) > 0) {
-        printf("Parent caught SIGCHLD from child process %d.\n", child_pid);
-        numTerminated++;
-
-        // Check if child exited normally
-        if (WIFEXITED(child_status)) {
-            int curPipe = -1; // Initialize pipe index
-
-            // Find the pipe corresponding to this child PID
-            for (int i = 0; i < MAX_FILES; i++) {
-                if (child_pid == pids[i]) {
-                    curPipe = i;
-                    break;
-                }
-            }
-
-            // If a valid pipe is found, read histogram data
-            if (curPipe != -1) {
-                ssize_t bytesRead = read(pipes[curPipe][0], characterCounts, sizeof(characterCounts));
-                if (bytesRead > 0) {
-                    printf("Parent read histogram from pipe %d ", curPipe);
-
-                    // Prepare filename and open it for writing
-                    sprintf(filename, "file%d.hist", child_pid);
-                    int fd = open(filename, O_CREAT | O_WRONLY, 0644);
-                    if (fd == -1) {
-                        perror("Error opening file");
-                        exit(EXIT_FAILURE);
-                    }
+size_t parseSize(const char *text) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *text == '-') return 0;
 
-                    // Write character counts (a-z) to file
-                    for (char letter = 'a'; letter <= 'z'; letter++) {
-                        int count = characterCounts[letter - 'a'];
-                        sprintf(line, "%c=%d\n", letter, count);
-                        write(fd, line, strlen(line));
-                    }
-                    close(fd);
-                    printf("and saved to file %s.\n", filename);
-                }
-                close(pipes[curPipe][0]); // Close read end of the pipe
-            } else {
-                printf("Error: Pipe for child %d not found.\n", child_pid);
-            }
-        } else if (WIFSIGNALED(child_status)) {
-            printf("Child %d terminated abnormally.\n", child_pid);
-        }
-    }
-
-    // Re-register the SIGCHLD handler
-    if (signal(SIGCHLD, sigchld) == SIG_ERR) {
-        perror("Error re-registering SIGCHLD handler");
-        exit(EXIT_FAILURE);
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
     }
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) return 0;
+    return (size_t)value << shift;
 }
 
-/**
- * Histogram function: calculates frequency of letters (a-z) in input data.
- * @param Data Pointer to input character array
- * @param Size Size of input data
- * @return Pointer to dynamically allocated array of size 26 containing counts
- */
-int *Histogram(char *Data, int Size) {
-    int *histogram = (int *)malloc(26 * sizeof(int));
-    if (!histogram) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
-    }
-
-    // Initialize all counts to 0
-    for (int i = 0; i < 26; i++) histogram[i] = 0;
-
-    // Count letters (case-insensitive)
-    for (int i = 0; i < Size; i++) {
-        char c = Data[i];
-        if (isalpha(c)) {
-            c = tolower(c);
-            histogram[c - 'a']++;
-        }
-    }
-
-    return histogram;
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-q | -v[v]] [-j N] [--input=MODE] [--chunk-size=BYTES] [--queue-depth=N]\n"
+                    "          [--kernel=NAME] [--split-threshold=BYTES] [--engine=ENGINE]\n"
+                    "          [--simulate-delay] [--output=MODE] [--output-file=PATH]\n"
+                    "          [--transport=TRANSPORT] [--schedule=POLICY] [--cache=PATH | --no-cache]\n"
+                    "          [--histogram=MODE] [--alphabet=SET] [--case=POLICY]\n"
+                    "          [--files-from=LIST [-0]] [--stats[=FORMAT]] [--pin] [--numa=MODE]\n"
+                    "          [--shard=K/N] [--coordinator=HOST:PORT] [--retries=N]\n"
+                    "          [--progress[=FORMAT] [--progress-fd=FD]]\n"
+                    "          [-r DIR [--scan-threads=N] [--min-size=BYTES] [--max-size=BYTES]\n"
+                    "          [--symlinks=POLICY]] [file...]\n"
+                    "  -q, --quiet         print errors only\n"
+                    "  -v, --verbose       print a line per input; -vv also traces every open,\n"
+                    "                      dispatch and child process (default: errors and a summary)\n"
+                    "  -j, --workers=N     number of worker processes (default: online CPUs)\n"
+                    "  --input=MODE        how workers load files: mmap (default), read, stream or\n"
+                    "                      uring (asynchronous chunk reads through io_uring)\n"
+                    "  --chunk-size=BYTES  read size in stream and uring modes, with optional K/M/G\n"
+                    "                      suffix (default: 1M)\n"
+                    "  --queue-depth=N     reads each worker keeps in flight in uring mode\n"
+                    "                      (default: 8)\n"
+                    "  --histogram=MODE    letters (default: a-z, case folded), bytes (also all 256\n"
+                    "                      byte values) or utf8 (also UTF-8 codepoints)\n"
+                    "  --alphabet=SET      characters counted: letters (default), alnum, or\n"
+                    "                      chars:STRING for the characters in STRING\n"
+                    "  --case=POLICY       fold (default: upper case counts as lower case) or\n"
+                    "                      sensitive\n"
+                    "  --kernel=NAME       histogram kernel: auto (default), avx512, avx2, sse2,\n"
+                    "                      neon or scalar\n"
+                    "  --split-threshold=BYTES\n"
+                    "                      split files at least this large into one byte range per\n"
+                    "                      worker (default: 256M, 0 disables)\n"
+                    "  --engine=ENGINE     processes (default): forked workers and pipes\n"
+                    "                      threads: one process, pthread pool with work stealing\n"
+                    "  --simulate-delay    demo mode: sleep 10 + 3 * (n - 1) seconds after the nth\n"
+                    "                      input, to watch concurrency and signals\n"
+                    "  --output=MODE       hist (default): one file<pid>-<n>.hist per input\n"
+                    "                      binary: one mmap-able results file for the whole run\n"
+                    "  --output-file=PATH  results file in binary mode (default: results.bin)\n"
+                    "  --transport=TRANSPORT\n"
+                    "                      how workers return results: pipe (default), or shm for\n"
+                    "                      one shared-memory ring with no per-result syscalls\n"
+                    "  --files-from=LIST   also read input paths from LIST (- for stdin), one per\n"
+                    "                      line, after any given on the command line\n"
+                    "  --schedule=POLICY   order of dispatch: fifo (default), lpt (largest first,\n"
+                    "                      4096 inputs at a time) or batched (small files go to\n"
+                    "                      workers in batches of up to 64)\n"
+                    "  --cache=PATH        result cache file (default: $XDG_CACHE_HOME or ~/.cache,\n"
+                    "                      /parallel-histograms.cache); unchanged files aren't read\n"
+                    "  --no-cache          neither use nor update the result cache\n"
+                    "  --pin               pin each worker to its own CPU, spread over the NUMA nodes\n"
+                    "  --numa=MODE         off (default) or auto: keep each worker and its memory on\n"
+                    "                      one node, and send files to the node caching them\n"
+                    "  --retries=N         attempts again, with growing delays, an input that\n"
+                    "                      failed for lack of resources or lost its worker\n"
+                    "                      (default: 2)\n"
+                    "  --stats[=FORMAT]    time every stage per worker and print the totals to\n"
+                    "                      stderr as text (default), json or prometheus\n"
+                    "  --progress[=FORMAT] report files done, throughput, ETA and busy workers\n"
+                    "                      as a status line (default) or json lines\n"
+                    "  --progress-fd=FD    descriptor for the progress reports (default: 2)\n"
+                    "  -0, --null          entries in LIST are NUL-separated, as from find -print0\n"
+                    "  -r, --recursive=DIR also count every regular file below DIR (repeatable),\n"
+                    "                      starting while the scan is still running\n"
+                    "  --scan-threads=N    directory traversal threads with -r (default: 4)\n"
+                    "  --min-size=BYTES, --max-size=BYTES\n"
+                    "                      only count scanned files within these sizes\n"
+                    "  --symlinks=POLICY   symlinks met while scanning: skip (default), files\n"
+                    "                      (follow links to files only) or follow\n"
+                    "  --shard=K/N         count only the inputs shard K of N gets by hashing their\n"
+                    "                      paths; give every node the same inputs\n"
+                    "  --coordinator=HOST:PORT\n"
+                    "                      send the results to a coordinator instead of saving them\n"
+                    "  --listen=[HOST:]PORT\n"
+                    "                      run as the coordinator: save the results every shard\n"
+                    "                      sends (run as %s --listen=PORT [output options])\n",
+            prog, prog);
 }
 
 int main(int argc, char *argv[]) {
-    printf("Starting program. Number of files provided: %d\n", argc - 1);
-
-    // Validate input arguments
-    if (argc == 1) {
-        printf("Error: No input files provided.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (argc > MAX_FILES + 1) {
-        printf("Error: Too many input files provided. Maximum allowed is %d.\n", MAX_FILES);
-        exit(EXIT_FAILURE);
-    }
-
-    // Register SIGCHLD handler using sigaction
-    printf("Registering SIGCHLD handler...\n");
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld;
-    sigaction(SIGCHLD, &sa, NULL);
-
-    // Loop over each file/command provided in arguments
-    for (int i = 1; i < argc; i++) {
-        printf("Processing file/command %s...\n", argv[i]);
+    struct HistogramOptions options;
+    histogramDefaults(&options);
 
-        // Create a pipe for this child
-        if (pipe(pipes[i - 1]) < 0) {
-            perror("Error creating pipe");
-            exit(EXIT_FAILURE);
+    static const struct option longOptions[] = {
+        { "workers", required_argument, NULL, 'j' },
+        { "input", required_argument, NULL, 'I' },
+        { "chunk-size", required_argument, NULL, 'C' },
+        { "queue-depth", required_argument, NULL, 'Q' },
+        { "kernel", required_argument, NULL, 'K' },
+        { "split-threshold", required_argument, NULL, 'S' },
+        { "engine", required_argument, NULL, 'E' },
+        { "simulate-delay", no_argument, NULL, 'D' },
+        { "output", required_argument, NULL, 'O' },
+        { "transport", required_argument, NULL, 'T' },
+        { "files-from", required_argument, NULL, 'F' },
+        { "null", no_argument, NULL, '0' },
+        { "recursive", required_argument, NULL, 'r' },
+        { "scan-threads", required_argument, NULL, 'R' },
+        { "min-size", required_argument, NULL, 'm' },
+        { "max-size", required_argument, NULL, 'M' },
+        { "symlinks", required_argument, NULL, 'L' },
+        { "schedule", required_argument, NULL, 'P' },
+        { "cache", required_argument, NULL, 'c' },
+        { "no-cache", no_argument, NULL, 'N' },
+        { "output-file", required_argument, NULL, 'o' },
+        { "stats", optional_argument, NULL, 's' },
+        { "histogram", required_argument, NULL, 'H' },
+        { "alphabet", required_argument, NULL, 'A' },
+        { "case", required_argument, NULL, 'X' },
+        { "pin", no_argument, NULL, 'p' },
+        { "numa", required_argument, NULL, 'U' },
+        { "shard", required_argument, NULL, 'Z' },
+        { "coordinator", required_argument, NULL, 'W' },
+        { "listen", required_argument, NULL, 'l' },
+        { "retries", required_argument, NULL, 'y' },
+        { "progress", optional_argument, NULL, 'g' },
+        { "progress-fd", required_argument, NULL, 'G' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+j:0r:qvh", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'j': {
+            char *end;
+            long workers = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || workers < 1) {
+                fprintf(stderr, "Error: invalid worker count '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options.workers = workers > HISTOGRAM_MAX_WORKERS ? HISTOGRAM_MAX_WORKERS : workers;
+            break;
         }
-
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("Error forking child process");
-            exit(EXIT_FAILURE);
-        } else if (pid == 0) { // Child process
-            printf("Child process started for %s\n", argv[i]);
-            close(pipes[i - 1][0]); // Close read end in child
-
-            // If the argument is not "SIG", process it as a file
-            if (strcmp(argv[i], "SIG") != 0) {
-                printf("Opening file: %s\n", argv[i]);
-                int fileDescriptor = open(argv[i], O_RDONLY);
-                if (fileDescriptor < 0) {
-                    fprintf(stderr, "Error opening file %s. Exiting with 1.\n", argv[i]);
-                    close(pipes[i - 1][1]);
-                    exit(1);
-                }
-
-                // Read file content into memory
-                off_t fileSize = lseek(fileDescriptor, 0, SEEK_END);
-                char *fileData = (char *)malloc(fileSize);
-                if (!fileData) {
-                    perror("Failed to allocate memory for file data");
-                    close(pipes[i - 1][1]);
-                    exit(1);
-                }
-                lseek(fileDescriptor, 0, SEEK_SET);
-                read(fileDescriptor, fileData, fileSize);
-                close(fileDescriptor);
-
-                // Calculate histogram and write to pipe
-                printf("Calculating histogram for file: %s\n", argv[i]);
-                int *calcHisto = Histogram(fileData, fileSize);
-                write(pipes[i - 1][1], calcHisto, 26 * sizeof(int));
-                free(calcHisto);
-                free(fileData);
-
-                // Optional sleep to simulate delay
-                printf("Child process sleeping for %d seconds.\n", 10 + 3 * (i - 1));
-                sleep(10 + 3 * (i - 1));
-
-                printf("Child process completed for %s. Exiting with 0.\n", argv[i]);
-                close(pipes[i - 1][1]);
-                exit(0);
-            } else { // If argument is "SIG", wait for signal
-                printf("Child process (PID: %d) waiting for signal.\n", getpid());
-                sleep(10);
-            }
-        } else { // Parent process
-            printf("Parent process created child with PID: %d for %s\n", pid, argv[i]);
-            close(pipes[i - 1][1]); // Close write end in parent
-            pids[i - 1] = pid;
-            numChildren++;
-
-            // If argument is "SIG", immediately send SIGINT to child
-            if (strcmp(argv[i], "SIG") == 0) {
-                printf("Parent sending SIGINT to child %d\n", pid);
-                kill(pid, SIGINT);
+        case 'I':
+            if (strcmp(optarg, "mmap") == 0) {
+                options.inputMode = INPUT_MMAP;
+            } else if (strcmp(optarg, "read") == 0) {
+                options.inputMode = INPUT_READ;
+            } else if (strcmp(optarg, "stream") == 0) {
+                options.inputMode = INPUT_STREAM;
+            } else if (strcmp(optarg, "uring") == 0) {
+                options.inputMode = INPUT_URING;
+            } else {
+                fprintf(stderr, "Error: unknown input mode '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            options.chunkSize = parseSize(optarg);
+            if (options.chunkSize == 0) {
+                fprintf(stderr, "Error: invalid chunk size '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
             }
+            break;
+        case 'Q': {
+            char *end;
+            long depth = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || depth < 1 || depth > HISTOGRAM_MAX_QUEUE_DEPTH) {
+                fprintf(stderr, "Error: invalid queue depth '%s' (1 to %d).\n", optarg,
+                        HISTOGRAM_MAX_QUEUE_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+            options.queueDepth = depth;
+            break;
+        }
+        case 'K':
+            options.kernel = optarg;
+            break;
+        case 'p':
+            options.pin = 1;
+            break;
+        case 'U':
+            if (strcmp(optarg, "auto") == 0) {
+                options.numa = NUMA_AUTO;
+            } else if (strcmp(optarg, "off") == 0) {
+                options.numa = NUMA_OFF;
+            } else {
+                fprintf(stderr, "Error: unknown NUMA mode '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            options.simulateDelay = 1;
+            break;
+        case 'O':
+            if (strcmp(optarg, "hist") == 0) {
+                options.binaryOutput = 0;
+            } else if (strcmp(optarg, "binary") == 0) {
+                options.binaryOutput = 1;
+            } else {
+                fprintf(stderr, "Error: unknown output mode '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            options.resultsPath = optarg;
+            break;
+        case 'F':
+            options.filesFrom = optarg;
+            break;
+        case '0':
+            options.nullDelimited = 1;
+            break;
+        case 'r':
+            options.roots = (char **)realloc(options.roots, (options.numRoots + 1) * sizeof(char *));
+            if (!options.roots) {
+                perror("Failed to allocate directory list");
+                exit(EXIT_FAILURE);
+            }
+            options.roots[options.numRoots++] = optarg;
+            break;
+        case 'R': {
+            char *end;
+            long threads = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || threads < 1 || threads > HISTOGRAM_MAX_WORKERS) {
+                fprintf(stderr, "Error: invalid scan thread count '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options.scanThreads = threads;
+            break;
+        }
+        case 'm':
+        case 'M': {
+            // "0" is a valid size here; anything else must parse
+            off_t size = strcmp(optarg, "0") == 0 ? 0 : (off_t)parseSize(optarg);
+            if (size == 0 && strcmp(optarg, "0") != 0) {
+                fprintf(stderr, "Error: invalid file size '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (opt == 'm') {
+                options.minSize = size;
+            } else {
+                options.maxSize = size;
+            }
+            break;
+        }
+        case 'c':
+            options.cachePath = optarg;
+            options.noCache = 0;
+            break;
+        case 'N':
+            options.noCache = 1;
+            break;
+        case 'P':
+            if (strcmp(optarg, "fifo") == 0) {
+                options.schedule = SCHEDULE_FIFO;
+            } else if (strcmp(optarg, "lpt") == 0) {
+                options.schedule = SCHEDULE_LPT;
+            } else if (strcmp(optarg, "batched") == 0) {
+                options.schedule = SCHEDULE_BATCHED;
+            } else {
+                fprintf(stderr, "Error: unknown schedule '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            if (strcmp(optarg, "skip") == 0) {
+                options.symlinks = SYMLINKS_SKIP;
+            } else if (strcmp(optarg, "files") == 0) {
+                options.symlinks = SYMLINKS_FILES;
+            } else if (strcmp(optarg, "follow") == 0) {
+                options.symlinks = SYMLINKS_FOLLOW;
+            } else {
+                fprintf(stderr, "Error: unknown symlink policy '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            if (strcmp(optarg, "pipe") == 0) {
+                options.sharedRing = 0;
+            } else if (strcmp(optarg, "shm") == 0) {
+                options.sharedRing = 1;
+            } else {
+                fprintf(stderr, "Error: unknown transport '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'E':
+            if (strcmp(optarg, "processes") == 0) {
+                options.useThreads = 0;
+            } else if (strcmp(optarg, "threads") == 0) {
+                options.useThreads = 1;
+            } else {
+                fprintf(stderr, "Error: unknown engine '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            // "0" turns splitting off; anything else must be a valid size
+            options.splitThreshold = strcmp(optarg, "0") == 0 ? 0 : (off_t)parseSize(optarg);
+            if (options.splitThreshold == 0 && strcmp(optarg, "0") != 0) {
+                fprintf(stderr, "Error: invalid split threshold '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if (!optarg || strcmp(optarg, "text") == 0) {
+                options.stats = STATS_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                options.stats = STATS_JSON;
+            } else if (strcmp(optarg, "prometheus") == 0) {
+                options.stats = STATS_PROMETHEUS;
+            } else {
+                fprintf(stderr, "Error: unknown stats format '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            if (!optarg || strcmp(optarg, "line") == 0) {
+                options.progress = PROGRESS_LINE;
+            } else if (strcmp(optarg, "json") == 0) {
+                options.progress = PROGRESS_JSON;
+            } else {
+                fprintf(stderr, "Error: unknown progress format '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G': {
+            char *end;
+            long fd = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+                fprintf(stderr, "Error: invalid progress descriptor '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options.progressFd = fd;
+            break;
+        }
+        case 'H':
+            if (strcmp(optarg, "letters") == 0) {
+                options.histogramMode = HISTOGRAM_LETTERS;
+            } else if (strcmp(optarg, "bytes") == 0) {
+                options.histogramMode = HISTOGRAM_BYTES;
+            } else if (strcmp(optarg, "utf8") == 0) {
+                options.histogramMode = HISTOGRAM_UTF8;
+            } else {
+                fprintf(stderr, "Error: unknown histogram mode '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            options.alphabet = optarg;
+            break;
+        case 'X':
+            if (strcmp(optarg, "fold") == 0) {
+                options.foldCase = 1;
+            } else if (strcmp(optarg, "sensitive") == 0) {
+                options.foldCase = 0;
+            } else {
+                fprintf(stderr, "Error: unknown case policy '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z': {
+            char *end;
+            long k = strtol(optarg, &end, 10), n = 0;
+            if (*end == '/') n = strtol(end + 1, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 || n > HISTOGRAM_MAX_SHARDS || k < 1 || k > n) {
+                fprintf(stderr, "Error: invalid shard '%s', expected K/N with 1 <= K <= N.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options.shard = k;
+            options.numShards = n;
+            break;
+        }
+        case 'W':
+            options.coordinator = optarg;
+            break;
+        case 'y': {
+            char *end;
+            long retries = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || retries < 0 || retries > HISTOGRAM_MAX_RETRIES) {
+                fprintf(stderr, "Error: invalid retry count '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            options.retries = retries;
+            break;
+        }
+        case 'l':
+            options.listen = optarg;
+            break;
+        case 'q':
+            options.logLevel = LEVEL_ERROR;
+            break;
+        case 'v':
+            if (options.logLevel < LEVEL_DEBUG) options.logLevel++;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
         }
     }
-
-    // Wait until all children have terminated
-    printf("Waiting for all child processes to terminate...\n");
-    while (numTerminated < numChildren) {
-        sleep(1); // Sleep and rely on SIGCHLD handler to update count
-    }
-
-    printf("All child processes have terminated.\n");
-    return 0;
+    return histogramRun(&options, argc - optind, argv + optind);
 }
@@ -0,0 +1,1071 @@
+/**
+ * The process pool: forking, placing and replacing workers, handing them
+ * tasks, splitting large files and retrying failed inputs.
+ */
+#include "engine.h"
+
+#define RING_EVENT_TAG (UINT32_MAX - 1) // epoll tag of the ring's eventfd
+#define SCAN_EVENT_TAG (UINT32_MAX - 2) // epoll tag of the directory scan's eventfd
+#define NUMA_DEFER 4            // Inputs held per node for a worker there
+#define MIN_RESPAWNS 16         // Crashed workers replaced per run, or one per worker in larger pools
+#define BATCH_SMALL_FILE (64 << 10) // Files smaller than this are batched
+#define BATCH_BYTES (1 << 20)   // Total input bytes per batch
+
+/**
+ * Task message sent from the parent to a worker over its task pipe.
+ * The header is followed by pathLen bytes of the input path (no terminator).
+ */
+struct TaskHeader {
+    int task;       // Task number, in the order inputs are scheduled
+    int pathLen;    // Length of the path that follows
+    int batchLeft;  // Tasks of the same batch that follow this one
+    int reserved;   // Zero; keeps offset 8-byte aligned
+    int64_t offset; // First byte of the range to count
+    int64_t length; // Length of the range, or -1 for the whole file
+};
+
+struct ChildContext *children = NULL; // Every child process, indexed by slot
+static int numChildren = 0;    // Number of child processes created
+static int childCapacity = 0;  // Allocated entries in children
+static int *pidSlots = NULL;   // Open-addressed PID -> slot map, holds slot + 1 or 0
+static int pidSlotCount = 0;   // Size of pidSlots, a power of two
+static int numTerminated = 0;  // Number of child processes that have terminated
+static int numReplaced = 0;    // Workers forked into the slot of a crashed one
+static int respawnsLeft = 0;   // Crashed workers that may still be replaced
+static sigset_t parentSigmask; // Signal mask to restore in forked children
+struct QueuedTask pending[MAX_BATCH + 1]; // Inputs picked that no worker has taken yet
+static int numPending = 0;     // Number of entries in pending
+static struct QueuedTask deferred[MAX_NUMA_NODES][NUMA_DEFER]; // Inputs held for a worker on their node
+static int numDeferred[MAX_NUMA_NODES];
+static int totalDeferred = 0;
+static int numBusy = 0;        // Number of workers with tasks in flight
+static struct SplitInput splits[MAX_WORKERS]; // Split inputs with ranges in flight
+static int numSplits = 0;      // Number of entries in splits
+static int splitTask = 0;      // Split input whose ranges are being handed out, 0 if none
+static const char *splitPath = NULL; // Its path, owned by its SplitInput
+static off_t splitSize, splitNext, splitRange; // Its size, next range offset and range length
+struct RetryTask *retries = NULL; // Tasks waiting for their retry
+static int numRetries = 0;
+static int retryCapacity = 0;
+
+/**
+ * Hashes a PID into the pidSlots table.
+ */
+static unsigned pidHash(pid_t pid) {
+    return ((unsigned)pid * 2654435761u) & (pidSlotCount - 1);
+}
+
+/**
+ * Looks up the children slot of a PID.
+ * @return The slot, or -1 if the PID is not one of our children
+ */
+static int findChild(pid_t pid) {
+    if (pidSlotCount == 0) return -1;
+    for (unsigned h = pidHash(pid); pidSlots[h] != 0; h = (h + 1) & (pidSlotCount - 1)) {
+        if (children[pidSlots[h] - 1].pid == pid) return pidSlots[h] - 1;
+    }
+    return -1;
+}
+
+/**
+ * Adds a child to the children array and the PID map, growing both as needed.
+ * The array may move, so callers must not hold ChildContext pointers across it.
+ * @return The new child's slot
+ */
+static int addChild(pid_t pid) {
+    if (numChildren == childCapacity) {
+        childCapacity = childCapacity ? childCapacity * 2 : 16;
+        children = (struct ChildContext *)realloc(children, childCapacity * sizeof(struct ChildContext));
+
+        // Keep the PID map at most half full
+        free(pidSlots);
+        pidSlotCount = childCapacity * 2;
+        pidSlots = (int *)calloc(pidSlotCount, sizeof(int));
+        if (!children || !pidSlots) {
+            perror("Failed to allocate child table");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < numChildren; i++) {
+            unsigned h = pidHash(children[i].pid);
+            while (pidSlots[h] != 0) h = (h + 1) & (pidSlotCount - 1);
+            pidSlots[h] = i + 1;
+        }
+    }
+
+    int slot = numChildren++;
+    memset(&children[slot], 0, sizeof(children[slot]));
+    children[slot].pid = pid;
+    children[slot].resultFd = children[slot].taskFd = -1;
+
+    unsigned h = pidHash(pid);
+    while (pidSlots[h] != 0) h = (h + 1) & (pidSlotCount - 1);
+    pidSlots[h] = slot + 1;
+    return slot;
+}
+
+/**
+ * Puts a replacement worker into the slot of a dead one and rebuilds the PID
+ * map without the old PID, which reapChildren() then only counts.
+ * @return The slot
+ */
+static int replaceChild(int slot, pid_t pid) {
+    memset(&children[slot], 0, sizeof(children[slot]));
+    children[slot].pid = pid;
+    children[slot].resultFd = children[slot].taskFd = -1;
+    memset(pidSlots, 0, pidSlotCount * sizeof(int));
+    for (int i = 0; i < numChildren; i++) {
+        unsigned h = pidHash(children[i].pid);
+        while (pidSlots[h] != 0) h = (h + 1) & (pidSlotCount - 1);
+        pidSlots[h] = i + 1;
+    }
+    numReplaced++;
+    return slot;
+}
+
+/**
+ * Reaps every terminated child and updates the termination count. Called from
+ * the parent's event loop when the SIGCHLD signalfd becomes readable, so unlike
+ * a signal handler it is free to print and touch any state.
+ */
+static void reapChildren(void) {
+    int child_status;
+    pid_t child_pid;
+
+    // Loop to process all terminated children without blocking
+    while ((child_pid = waitpid(-1, &child_status, WNOHANG)) > 0) {
+        LOG(LEVEL_DEBUG, "Parent caught SIGCHLD from child process %d.\n", child_pid);
+        numTerminated++;
+
+        int slot = findChild(child_pid);
+        if (slot != -1) {
+            children[slot].reaped = 1;
+            children[slot].exitStatus = child_status;
+        }
+
+        if (WIFSIGNALED(child_status) && slot != -1 && slot < numWorkers) {
+            LOG(LEVEL_ERROR, "Error: Worker %d (PID: %d) was killed by signal %d (%s).\n", slot, child_pid,
+                             WTERMSIG(child_status), strsignal(WTERMSIG(child_status)));
+        } else if (WIFSIGNALED(child_status)) {
+            LOG(LEVEL_INFO, "Child %d was killed by signal %d (%s).\n", child_pid,
+                            WTERMSIG(child_status), strsignal(WTERMSIG(child_status)));
+        } else if (slot != -1 && slot < numWorkers) {
+            LOG(LEVEL_DEBUG, "Worker %d (PID: %d) exited.\n", slot, child_pid);
+        }
+    }
+}
+
+/**
+ * Demo delay: with --simulate-delay, sleeps 10 + 3 * (task - 1) seconds after
+ * a task so that concurrent workers and signals can be watched. Does nothing
+ * by default.
+ */
+void delayTask(int task) {
+    if (!simulateDelay) return;
+    LOG(LEVEL_INFO, "Child process sleeping for %d seconds.\n", 10 + 3 * (task - 1));
+    sleep(10 + 3 * (task - 1));
+}
+
+/**
+ * Worker main loop: pulls batches of tasks from the task pipe until the parent
+ * closes it, and sends one result message back per task. A whole batch is
+ * read before any of it is processed, so the parent never waits on a worker
+ * that is busy counting; pipe results of a batch, each followed by its
+ * histogram pairs, go back in one write (with --simulate-delay, each before
+ * its sleep).
+ * @param w Index of this worker in the pool
+ * @param taskFd Read end of the worker's task pipe
+ * @param resultFd Write end of the worker's result pipe, or -1 to publish to the shared ring
+ */
+static void runWorker(int w, int taskFd, int resultFd) {
+#if ENABLE_STATS
+    if (statsTable) threadStats = &statsTable[w + 1];
+#endif
+    placeWorker(w);
+    // Ctrl-C reaches the whole process group, but the parent decides what
+    // stops: a worker finishes its tasks until the parent closes its pipe
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    struct TaskHeader headers[MAX_BATCH];
+    char *paths = (char *)malloc(MAX_BATCH * PATH_MAX);
+    size_t outCapacity = MAX_BATCH * sizeof(struct ResultMessage);
+    char *out = (char *)malloc(outCapacity); // Results of a batch and their pairs
+    if (!paths || !out) {
+        perror("Failed to allocate task buffer");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t got;
+
+    LOG(LEVEL_DEBUG, "Worker %d (PID: %d) started.\n", w, getpid());
+    while ((got = readFull(taskFd, &headers[0], sizeof(headers[0]))) > 0) {
+        int count = headers[0].batchLeft + 1;
+        int valid = count >= 1 && count <= MAX_BATCH;
+        for (int i = 0; i < count && valid; i++) {
+            struct TaskHeader *header = &headers[i];
+            char *path = paths + (size_t)i * PATH_MAX;
+            valid = (i == 0 || readFull(taskFd, header, sizeof(*header)) == sizeof(*header)) &&
+                    header->batchLeft == count - 1 - i &&
+                    header->pathLen >= 0 && header->pathLen < PATH_MAX &&
+                    readFull(taskFd, path, header->pathLen) == header->pathLen;
+            if (valid) path[header->pathLen] = '\0';
+        }
+        if (!valid) {
+            LOG(LEVEL_ERROR, "Worker %d received a malformed task.\n", w);
+            break;
+        }
+
+        // With --input=uring the whole batch is queued first, so files
+        // further down are read while the first ones are counted
+        int streams[MAX_BATCH];
+        for (int i = 0; i < count; i++) {
+            streams[i] = uringQueue(paths + (size_t)i * PATH_MAX, headers[i].offset, headers[i].length);
+        }
+
+        size_t used = 0;
+        int broken = 0;
+        for (int i = 0; i < count; i++) {
+            struct TaskHeader *header = &headers[i];
+            const char *path = paths + (size_t)i * PATH_MAX;
+            struct ResultMessage result;
+            memset(&result, 0, sizeof(result));
+            result.version = RESULT_VERSION;
+            result.task = header->task;
+            if (streams[i] >= 0) {
+                result.status = uringFinish(streams[i], result.counts);
+            } else if (header->length >= 0) {
+                result.status = processRange(path, header->offset, header->length, result.counts);
+            } else {
+                result.status = processFile(path, result.counts);
+            }
+            const struct HistogramPair *pairs = NULL;
+            if (result.status == 0 && collectPairs(&pairs, &result.numPairs) < 0) result.status = STATUS_RETRY;
+            STATS_ADD(files, 1);
+            if (resultFd == -1) {
+                STATS_BEGIN(timer);
+                publishResult(w, &result); // The ring is only used without pairs
+                STATS_END(STAGE_TRANSFER, timer, 0);
+            } else {
+                size_t size = sizeof(result) + result.numPairs * sizeof(*pairs);
+                while (used + size > outCapacity) {
+                    outCapacity *= 2;
+                    out = (char *)realloc(out, outCapacity);
+                    if (!out) {
+                        perror("Failed to allocate result buffer");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                memcpy(out + used, &result, sizeof(result));
+                memcpy(out + used + sizeof(result), pairs, result.numPairs * sizeof(*pairs));
+                used += size;
+            }
+
+            if (result.status == 0) {
+                // The result leaves before the sleep, so the parent drains it
+                // while this worker is still busy
+                if (simulateDelay && resultFd != -1 && (broken = sendResults(resultFd, out, &used)) < 0) break;
+                delayTask(header->task);
+                LOG(LEVEL_DEBUG, "Child process completed for %s.\n", path);
+            }
+        }
+        if (broken < 0 || (resultFd != -1 && sendResults(resultFd, out, &used) < 0)) break;
+    }
+    if (got < 0) perror("Error reading task pipe");
+
+    free(paths);
+    free(out);
+    close(taskFd);
+    if (resultFd != -1) close(resultFd);
+    exit(0);
+}
+
+/**
+ * Sends a batch of tasks to a worker in one write and records them as the
+ * worker's tasks in flight. Paths must be shorter than PATH_MAX.
+ * @param count Number of tasks, at most MAX_BATCH
+ * @param offset First byte to count, for a single range task
+ * @param length Number of bytes to count, or -1 for whole files
+ * @return 0 on success, -1 if the worker's pipe is broken
+ */
+static int dispatchTasks(int w, const struct QueuedTask *tasks, int count, off_t offset, off_t length) {
+    static char message[MAX_BATCH * (sizeof(struct TaskHeader) + PATH_MAX)];
+    size_t used = 0;
+    for (int i = 0; i < count; i++) {
+        struct TaskHeader header = { tasks[i].task, (int)strlen(tasks[i].path), count - 1 - i, 0,
+                                     offset, length };
+        memcpy(message + used, &header, sizeof(header));
+        memcpy(message + used + sizeof(header), tasks[i].path, header.pathLen);
+        used += sizeof(header) + header.pathLen;
+    }
+
+    struct ChildContext *worker = &children[w];
+    STATS_BEGIN(timer);
+    int written = worker->taskFd == -1 ? -1 : writeFull(worker->taskFd, message, used);
+    STATS_END(STAGE_TRANSFER, timer, 1);
+    if (written < 0) {
+        if (worker->taskFd != -1) perror("Error writing task to pipe");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        worker->tasks[i].task = tasks[i].task;
+        worker->tasks[i].path = strdup(tasks[i].path);
+        worker->tasks[i].cacheable = tasks[i].cacheable;
+        worker->tasks[i].key = tasks[i].key;
+        worker->tasks[i].attempts = tasks[i].attempts;
+        worker->tasks[i].offset = offset;
+        worker->tasks[i].length = length;
+    }
+    worker->numTasks = count;
+    worker->nextTask = 0;
+    clock_gettime(CLOCK_MONOTONIC, &worker->started);
+    numBusy++;
+    STATS_SAMPLE(busyGauge, numBusy);
+    STATS_SAMPLE(pendingGauge, count);
+    for (int i = 0; i < count; i++) countPlacement(w, &tasks[i]);
+    if (count == 1) {
+        LOG(LEVEL_DEBUG, "Parent dispatched %s to worker %d (PID: %d)\n", tasks[0].path, w, worker->pid);
+    } else {
+        LOG(LEVEL_DEBUG, "Parent dispatched a batch of %d files starting with %s to worker %d (PID: %d)\n",
+                         count, tasks[0].path, w, worker->pid);
+    }
+    return 0;
+}
+
+/**
+ * Forks a one-off child for a "SIG" argument that waits to be interrupted,
+ * then sends it SIGINT from the parent.
+ */
+static void spawnSignalChild(void) {
+    STATS_BEGIN(timer);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error forking child process");
+        return;
+    } else if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &parentSigmask, NULL);
+        signal(SIGINT, SIG_DFL); // The parent's stop handler would keep it alive
+        LOG(LEVEL_INFO, "Child process (PID: %d) waiting for signal.\n", getpid());
+        sleep(10);
+        _exit(0); // Don't flush stdio buffers inherited from the parent
+    }
+    STATS_END(STAGE_FORK, timer, 1);
+    addChild(pid);
+    LOG(LEVEL_INFO, "Parent sending SIGINT to child %d\n", pid);
+    kill(pid, SIGINT);
+}
+
+/**
+ * Queues a task that failed transiently or lost its worker for another
+ * attempt after an exponential backoff, and takes ownership of its path.
+ */
+static void queueRetry(const struct InFlightTask *task, char *path) {
+    if (numRetries == retryCapacity) {
+        retryCapacity = retryCapacity ? retryCapacity * 2 : 16;
+        retries = (struct RetryTask *)realloc(retries, retryCapacity * sizeof(*retries));
+        if (!retries) {
+            perror("Failed to allocate retry queue");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct RetryTask *retry = &retries[numRetries++];
+    memset(retry, 0, sizeof(*retry));
+    retry->input.path = path;
+    retry->input.task = task->task;
+    retry->input.size = -1;
+    retry->input.cacheable = task->cacheable;
+    retry->input.key = task->key;
+    retry->input.attempts = task->attempts + 1;
+    retry->offset = task->offset;
+    retry->length = task->length;
+    long delay = retryDelay(retry->input.attempts);
+    clock_gettime(CLOCK_MONOTONIC, &retry->due);
+    retry->due.tv_sec += delay / 1000;
+    retry->due.tv_nsec += delay % 1000 * 1000000;
+    if (retry->due.tv_nsec >= 1000000000) {
+        retry->due.tv_sec++;
+        retry->due.tv_nsec -= 1000000000;
+    }
+    LOG(LEVEL_NOTICE, "Retrying %s in %ld ms (attempt %d of %d).\n", path, delay,
+                      retry->input.attempts + 1, maxRetries + 1);
+}
+
+/**
+ * Milliseconds until the retry due soonest, 0 if one is due now, -1 if none
+ * is queued; usable as an epoll_wait() timeout.
+ * @param index Receives the index of that retry
+ */
+static int nextRetry(int *index) {
+    if (numRetries == 0) return -1;
+    int soonest = 0;
+    for (int i = 1; i < numRetries; i++) {
+        const struct timespec *due = &retries[i].due, *best = &retries[soonest].due;
+        if (due->tv_sec < best->tv_sec || (due->tv_sec == best->tv_sec && due->tv_nsec < best->tv_nsec)) {
+            soonest = i;
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long wait = (retries[soonest].due.tv_sec - now.tv_sec) * 1000ll +
+                     (retries[soonest].due.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    *index = soonest;
+    return wait > 0 ? (int)wait : 0;
+}
+
+/**
+ * Finds the split record for a task.
+ * @return The record, or NULL if the task is not split
+ */
+static struct SplitInput *findSplit(int task) {
+    for (int i = 0; i < numSplits; i++) {
+        if (splits[i].task == task) return &splits[i];
+    }
+    return NULL;
+}
+
+/**
+ * Decides whether an input should be split into byte ranges and, if so,
+ * starts handing out its ranges. Splitting needs a regular file of at least
+ * splitThreshold bytes, a free split record and more than one worker.
+ * @return 1 if the input was split, 0 if it should be processed whole
+ */
+static int startSplit(const struct QueuedTask *input) {
+    int task = input->task;
+    const char *path = input->path;
+    struct stat st;
+    if (splitThreshold <= 0 || numWorkers < 2 || numSplits == MAX_WORKERS) return 0;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < splitThreshold) return 0;
+    if (!canSplitFile(path, st.st_size)) return 0;
+
+    // One range per worker, rounded up to whole pages
+    off_t page = sysconf(_SC_PAGESIZE);
+    splitRange = (st.st_size + numWorkers - 1) / numWorkers;
+    splitRange = (splitRange + page - 1) / page * page;
+    splitSize = st.st_size;
+    splitNext = 0;
+    splitTask = task;
+
+    struct SplitInput *split = &splits[numSplits++];
+    memset(split, 0, sizeof(*split));
+    split->task = task;
+    split->path = strdup(path);
+    split->cacheable = input->cacheable;
+    split->key = input->key;
+    splitPath = split->path;
+    split->partsLeft = (splitSize + splitRange - 1) / splitRange;
+    LOG(LEVEL_INFO, "Splitting %s into %d ranges of %lld bytes.\n", path, split->partsLeft,
+                    (long long)splitRange);
+    return 1;
+}
+
+/**
+ * Picks the next input into pending. "SIG" entries get their one-off child,
+ * paths too long for the task pipe are dropped and large files start a
+ * split here, so none of them ever sit in pending.
+ * @return 1 if an input was added to pending, 0 if none is available now or a split started
+ */
+static int pullPending(void) {
+    struct QueuedTask input;
+    while (pickInput(&input, 0)) {
+        LOG(LEVEL_DEBUG, "Processing file/command %s...\n", input.path);
+        if (strcmp(input.path, "SIG") == 0) {
+            spawnSignalChild();
+            free(input.path);
+            continue;
+        }
+        if (strlen(input.path) >= PATH_MAX) {
+            LOG(LEVEL_ERROR, "Path too long, skipping: %s\n", input.path);
+            free(input.path);
+            continue;
+        }
+        if (startSplit(&input)) {
+            free(input.path);
+            return 0;
+        }
+        pending[numPending++] = input;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Dispatches an input held for a node to worker w.
+ * @param node Node whose inputs to take, or -1 for the first node with any
+ * @return 0 on success, -1 if the worker's pipe is broken
+ */
+static int dispatchDeferred(int w, int node) {
+    for (int n = 0; node < 0 && n < MAX_NUMA_NODES; n++) {
+        if (numDeferred[n] > 0) node = n;
+    }
+    struct QueuedTask *held = deferred[node];
+    if (dispatchTasks(w, held, 1, 0, -1) < 0) return -1;
+    free(held[0].path);
+    memmove(held, held + 1, --numDeferred[node] * sizeof(held[0]));
+    totalDeferred--;
+    return 0;
+}
+
+/**
+ * Tells whether --schedule=batched may put a picked input in a batch.
+ */
+static int isBatchable(const struct QueuedTask *input) {
+    return input->size >= 0 && input->size < BATCH_SMALL_FILE;
+}
+
+/**
+ * Counts the tasks the process pool has queued for its workers: picked and
+ * held inputs, retries and the ranges of a split input still to hand out.
+ */
+static uint64_t queuedTasks(void) {
+    uint64_t queued = numPending + totalDeferred + lpt.count + numRetries;
+    if (splitTask) queued += (splitSize - splitNext + splitRange - 1) / splitRange;
+    return queued;
+}
+
+/**
+ * Pulls work off the queue until some is handed to worker w: a retry that is
+ * due, else the next range of the input being split, if any, else the next
+ * input, together with the small files that follow it under
+ * --schedule=batched. With --numa=auto, an input cached on another node is
+ * held for a worker there (up to NUMA_DEFER per node), and held inputs go to
+ * any worker once nothing else is left. Nothing is handed out once a stop
+ * has been requested.
+ */
+static void scheduleNext(int w) {
+    while (!children[w].numTasks && !stopRequested) {
+        int r;
+        if (nextRetry(&r) == 0) {
+            struct RetryTask *retry = &retries[r];
+            if (dispatchTasks(w, &retry->input, 1, retry->offset, retry->length) < 0) break;
+            free(retry->input.path);
+            retries[r] = retries[--numRetries];
+            continue;
+        }
+        if (splitTask != 0) {
+            off_t length = splitSize - splitNext < splitRange ? splitSize - splitNext : splitRange;
+            struct QueuedTask range = { (char *)splitPath, splitTask, length, 0 };
+            if (dispatchTasks(w, &range, 1, splitNext, length) < 0) break; // Leave it for a live worker
+            splitNext += length;
+            if (splitNext >= splitSize) splitTask = 0;
+            continue;
+        }
+
+        int node = workerNode(w);
+        if (numaRouting && numDeferred[node] > 0) {
+            if (dispatchDeferred(w, node) < 0) break;
+            continue;
+        }
+        if (numPending == 0 && !pullPending()) {
+            if (splitTask != 0) continue;
+            if (totalDeferred > 0 && dispatchDeferred(w, -1) == 0) continue;
+            break;
+        }
+        int home = pending[0].homeNode - 1;
+        if (numaRouting && home >= 0 && home != node && topology.nodeWorkers[home] > 0 &&
+            numDeferred[home] < NUMA_DEFER) {
+            deferred[home][numDeferred[home]++] = pending[0];
+            totalDeferred++;
+            memmove(pending, pending + 1, --numPending * sizeof(pending[0]));
+            continue;
+        }
+
+        int count = 1;
+        if (schedulePolicy == SCHEDULE_BATCHED && isBatchable(&pending[0])) {
+            off_t bytes = pending[0].size;
+            while (count < MAX_BATCH) {
+                if (count == numPending && (splitTask != 0 || !pullPending())) break;
+                if (!isBatchable(&pending[count]) || bytes + pending[count].size > BATCH_BYTES) break;
+                bytes += pending[count++].size;
+            }
+        }
+        if (dispatchTasks(w, pending, count, 0, -1) < 0) break; // Leave them for a live worker
+        for (int i = 0; i < count; i++) free(pending[i].path);
+        numPending -= count;
+        memmove(pending, pending + count, numPending * sizeof(pending[0]));
+    }
+}
+
+/**
+ * Records the outcome of the oldest of worker w's tasks in flight, and marks
+ * the worker idle once its whole batch has reported. Whole files are saved
+ * right away; ranges of a split file are summed until the last one arrives.
+ * Tasks that failed transiently or lost their worker are queued for a retry
+ * while they have attempts left.
+ * @param status A TaskStatus, 0 on success
+ * @param counts Histogram computed by the worker, unused on failure
+ * @param pairs Wide buckets that came with it, numPairs of them
+ */
+static void completeTask(int w, int status, const uint64_t counts[26],
+                  const struct HistogramPair *pairs, uint32_t numPairs) {
+    struct ChildContext *worker = &children[w];
+    struct InFlightTask *done = &worker->tasks[worker->nextTask++];
+    int task = done->task;
+    char *path = done->path;
+    done->path = NULL;
+    if (status == 0 && done->cacheable) cacheStore(&done->key, counts);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - worker->started.tv_sec) +
+                     (now.tv_nsec - worker->started.tv_nsec) / 1e9;
+    if (worker->nextTask == worker->numTasks) {
+        worker->numTasks = worker->nextTask = 0;
+        numBusy--;
+    }
+    if ((status == STATUS_RETRY || status == STATUS_CRASHED) && done->attempts < maxRetries &&
+        !stopRequested) {
+        queueRetry(done, path);
+        return;
+    }
+
+    struct SplitInput *split = findSplit(task);
+    if (!split) {
+        if (status == 0) {
+            LOG(LEVEL_INFO, "Parent read histogram of %s from worker %d after %.6f s.\n", path, w, elapsed);
+            saveHistogram(worker->pid, task, path, counts, pairs, numPairs);
+        } else {
+            LOG(LEVEL_ERROR, "Worker %d failed to process %s.\n", w, path);
+            saveFailure(task, path, status);
+        }
+        free(path);
+        return;
+    }
+    free(path);
+
+    if (status == 0) {
+        for (int i = 0; i < 26; i++) split->counts[i] += counts[i];
+    } else {
+        split->failed = status;
+    }
+    if (--split->partsLeft > 0) return;
+
+    if (!split->failed) {
+        if (split->cacheable) cacheStore(&split->key, split->counts);
+        LOG(LEVEL_INFO, "Parent merged all ranges of %s.\n", split->path);
+        saveHistogram(worker->pid, task, split->path, split->counts, NULL, 0); // Wide modes don't split
+    } else {
+        LOG(LEVEL_ERROR, "Failed to process one or more ranges of %s.\n", split->path);
+        saveFailure(task, split->path, split->failed);
+    }
+    free(split->path);
+    *split = splits[--numSplits];
+}
+
+/**
+ * Handles a result message from worker w and hands the worker its next task.
+ * @param pairs The result's numPairs histogram pairs
+ */
+static void handleResult(int w, struct ResultMessage *result, const struct HistogramPair *pairs) {
+    if (result->version != RESULT_VERSION) {
+        LOG(LEVEL_ERROR, "Error: Worker %d sent result version %u, expected %d.\n",
+                         w, result->version, RESULT_VERSION);
+        result->status = STATUS_FAILED;
+    }
+    completeTask(w, result->status, result->counts, pairs, result->numPairs);
+    if (!children[w].numTasks) scheduleNext(w); // Pull the next task for this worker
+}
+
+/**
+ * Handles every result waiting in the shared ring, skipping the slots of
+ * workers that died while publishing.
+ * @return Number of results handled
+ */
+static int drainResultRing(void) {
+    struct ResultMessage result;
+    int w, handled = 0;
+    for (;;) {
+        if (consumeResult(&w, &result)) {
+            handleResult(w, &result, NULL);
+            handled++;
+        } else if (!skipAbandonedSlot()) {
+            break;
+        }
+    }
+    return handled;
+}
+
+/**
+ * With the shared ring there is no pipe EOF to notice a dead worker, so after
+ * reaping, any reaped worker still owning a task (once the ring is drained)
+ * died before reporting it.
+ */
+static void failReapedWorkers(void) {
+    drainResultRing();
+    for (int w = 0; w < numWorkers; w++) {
+        while (children[w].reaped && children[w].numTasks) {
+            LOG(LEVEL_ERROR, "Error: Worker %d (PID: %d) exited without reporting task %d.\n",
+                             w, children[w].pid, children[w].tasks[children[w].nextTask].task);
+            completeTask(w, STATUS_CRASHED, NULL, NULL, 0);
+        }
+        if (children[w].reaped && children[w].taskFd != -1) {
+            close(children[w].taskFd);
+            children[w].taskFd = -1;
+        }
+    }
+}
+
+/**
+ * Records every input the process pool didn't get to as skipped: pending
+ * and held inputs, retries still waiting and split inputs with ranges that
+ * never reported, and with drainSource whatever the input source has left.
+ */
+void skipQueued(int drainSource) {
+    for (int i = 0; i < numPending; i++) {
+        saveFailure(pending[i].task, pending[i].path, STATUS_SKIPPED);
+        free(pending[i].path);
+    }
+    numPending = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        for (int i = 0; i < numDeferred[node]; i++) {
+            saveFailure(deferred[node][i].task, deferred[node][i].path, STATUS_SKIPPED);
+            free(deferred[node][i].path);
+        }
+        numDeferred[node] = 0;
+    }
+    totalDeferred = 0;
+    for (int i = 0; i < numRetries; i++) {
+        // A range belongs to its split input, which is recorded below
+        if (!findSplit(retries[i].input.task)) {
+            saveFailure(retries[i].input.task, retries[i].input.path, STATUS_SKIPPED);
+        }
+        free(retries[i].input.path);
+    }
+    numRetries = 0;
+    for (int i = 0; i < numSplits; i++) {
+        saveFailure(splits[i].task, splits[i].path, STATUS_SKIPPED);
+        free(splits[i].path);
+    }
+    numSplits = 0;
+    splitTask = 0;
+
+    struct QueuedTask input;
+    while (drainSource && pickInput(&input, 1)) {
+        if (strcmp(input.path, "SIG") != 0) saveFailure(input.task, input.path, STATUS_SKIPPED);
+        free(input.path);
+    }
+}
+
+/**
+ * Drops the stdio buffers a worker inherits from the parent, so the exit() at
+ * the end of runWorker() can neither write the parent's pending results a
+ * second time nor move the offset of the input list it shares with it. Only a
+ * replacement worker, forked after these are opened, has any.
+ */
+static void forgetParentStreams(void) {
+    FILE *streams[] = { results.out, results.entries, results.strings, results.pairs, source.list };
+    for (int i = 0; i < 5; i++) {
+        if (streams[i]) __fpurge(streams[i]);
+    }
+}
+
+/**
+ * Forks worker w with its task pipe and, without the shared ring, its result
+ * pipe, retrying fork() on the errors that may pass. Slots below numChildren
+ * belong to dead workers, which the new one replaces.
+ * @return 0, or -1 if the pipes or the process could not be created
+ */
+static int startWorker(int w, int epollFd, int useSharedRing) {
+    int resultPipe[2] = { -1, -1 }, taskPipe[2] = { -1, -1 };
+    pid_t pid = -1, parent = getpid();
+    // A dead predecessor's claim would hide the new worker's
+    if (useSharedRing) atomic_store(&resultRing->claims[w], 0);
+    STATS_BEGIN(forkTimer);
+    if ((!useSharedRing && pipe(resultPipe) < 0) || pipe(taskPipe) < 0) {
+        LOG(LEVEL_ERROR, "Error creating the pipes of worker %d: %s\n", w, strerror(errno));
+    } else {
+        for (int attempt = 0; (pid = fork()) < 0 && failureStatus(errno) == STATUS_RETRY &&
+                              attempt < maxRetries;) {
+            sleepMilliseconds(retryDelay(++attempt));
+        }
+        if (pid < 0) LOG(LEVEL_ERROR, "Error forking worker %d: %s\n", w, strerror(errno));
+    }
+    if (pid < 0) {
+        int fds[] = { resultPipe[0], resultPipe[1], taskPipe[0], taskPipe[1] };
+        for (int i = 0; i < 4; i++) {
+            if (fds[i] != -1) close(fds[i]);
+        }
+        return -1;
+    } else if (pid == 0) { // Worker process
+        // A worker waiting for room in a full result ring would spin forever
+        // once the parent is gone, so it goes down with the parent; a parent
+        // that died before prctl() has already handed it to another process
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) _exit(EXIT_FAILURE);
+        sigprocmask(SIG_SETMASK, &parentSigmask, NULL);
+        // Drop the parent's ends of every pipe inherited, so each worker
+        // sees EOF on its task pipe as soon as the parent closes it
+        for (int k = 0; k < numChildren; k++) {
+            if (children[k].resultFd != -1) close(children[k].resultFd);
+            if (children[k].taskFd != -1) close(children[k].taskFd);
+        }
+        forgetParentStreams();
+        if (resultPipe[0] != -1) close(resultPipe[0]);
+        close(taskPipe[1]);
+        runWorker(w, taskPipe[0], resultPipe[1]);
+    }
+
+    // Parent process
+    STATS_END(STAGE_FORK, forkTimer, 1);
+    LOG(LEVEL_DEBUG, "Parent process created worker %d with PID: %d\n", w, pid);
+    close(taskPipe[0]);   // Close read end of the task pipe in parent
+    int slot = w < numChildren ? replaceChild(w, pid) : addChild(pid);
+    children[slot].taskFd = taskPipe[1];
+    if (!useSharedRing) {
+        close(resultPipe[1]); // Close write end of the result pipe in parent
+        children[slot].resultFd = resultPipe[0];
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, resultPipe[0], &ev);
+    }
+    return 0;
+}
+
+/**
+ * Forks a replacement for every worker that died, once its tasks have been
+ * failed and its pipes closed, and gives it work. Until the task queue is
+ * closed a worker only loses its pipes by dying, though it may not have been
+ * reaped yet. Each replacement spends one of respawnsLeft, so inputs that
+ * keep crashing their workers end up CRASHED instead of emptying the pool or
+ * forking forever.
+ */
+static void respawnWorkers(int epollFd, int useSharedRing) {
+    for (int w = 0; w < numWorkers && respawnsLeft > 0 && !stopRequested; w++) {
+        struct ChildContext *worker = &children[w];
+        if (worker->numTasks || worker->taskFd != -1 || worker->resultFd != -1) continue;
+        respawnsLeft--;
+        if (startWorker(w, epollFd, useSharedRing) < 0) continue;
+        LOG(LEVEL_NOTICE, "Replaced worker %d with PID %d (%d replacements left).\n", w, children[w].pid,
+                          respawnsLeft);
+        scheduleNext(w);
+    }
+}
+
+/**
+ * Runs the whole job on the process pool: forks the workers, then hands out
+ * inputs and collects results in one epoll loop until every worker has
+ * exited. With no worker forked, the threads engine counts instead.
+ * @return The exit status
+ */
+int runProcessesMode(int useSharedRing) {
+    // Block SIGCHLD and receive it through a signalfd instead, so children
+    // are reaped from the same epoll loop that collects their results
+    LOG(LEVEL_DEBUG, "Registering SIGCHLD signalfd...\n");
+    sigset_t chldMask;
+    sigemptyset(&chldMask);
+    sigaddset(&chldMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldMask, &parentSigmask);
+    int sigFd = signalfd(-1, &chldMask, SFD_CLOEXEC);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigFd < 0 || epollFd < 0) {
+        perror("Error creating event loop");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX; // Tag for the signalfd; workers use their slot
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, sigFd, &ev);
+
+    if (useSharedRing) {
+        createResultRing();
+        ev.events = EPOLLIN;
+        ev.data.u32 = RING_EVENT_TAG;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, ringEventFd, &ev);
+    }
+
+    // A worker that dies mid-task must not kill the parent with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // Start the worker pool. Failing to create a worker's pipes or to fork it
+    // (after retries, for the errors that may pass) leaves the pool smaller
+    LOG(LEVEL_DEBUG, "Starting %d worker processes...\n", numWorkers);
+    int poolSize = numWorkers;
+    for (int w = 0; w < poolSize; w++) {
+        if (startWorker(w, epollFd, useSharedRing) < 0) {
+            numWorkers = w;
+            break;
+        }
+    }
+    if (numWorkers == 0) {
+        LOG(LEVEL_ERROR, "Error: no worker process could be started; counting with threads instead.\n");
+        sigprocmask(SIG_SETMASK, &parentSigmask, NULL);
+        close(epollFd);
+        close(sigFd);
+        if (useSharedRing) {
+            close(ringEventFd);
+            munmap(resultRing, sizeof(struct ResultRing));
+            resultRing = NULL;
+        }
+        numWorkers = poolSize;
+        numaRouting = 0;
+        return runThreadsMode();
+    }
+    if (numWorkers < poolSize) {
+        LOG(LEVEL_NOTICE, "Continuing with %d of %d workers.\n", numWorkers, poolSize);
+        memset(topology.nodeWorkers, 0, sizeof(topology.nodeWorkers));
+        for (int w = 0; w < numWorkers; w++) topology.nodeWorkers[workerNode(w)]++;
+    }
+
+    // The workers exist now, so neither the writer thread nor the results
+    // file's stdio buffer can be duplicated by fork()
+    startWriter();
+    if (binaryOutput) openResults();
+    if (coordinatorAddress) connectCoordinator();
+    openCache();
+
+    // Traversal threads are started after fork() for the same reason; their
+    // eventfd wakes the event loop when files turn up for idle workers
+    int scanFd = -1;
+    if (scan.numRoots > 0) {
+        scanFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (scanFd < 0) {
+            perror("Error creating scan eventfd");
+            exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = SCAN_EVENT_TAG;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, scanFd, &ev);
+    }
+    startScan(scanFd);
+
+    // Hand out tasks: every worker gets one, then each result pulls the next
+    for (int w = 0; w < numWorkers; w++) scheduleNext(w);
+
+    // Event loop: results are drained as soon as a worker writes them, and
+    // children are reaped as the signalfd reports them. Once nothing is in
+    // flight the task pipes are closed, which tells the workers to exit.
+    int queueClosed = 0, stopAnnounced = 0;
+    struct HistogramPair *resultPairs = NULL; // Pairs of the result being handled
+    uint32_t resultPairsCapacity = 0;
+    respawnsLeft = numWorkers > MIN_RESPAWNS ? numWorkers : MIN_RESPAWNS;
+    while (numBusy > 0 || numTerminated < numChildren + numReplaced) {
+        if (stopRequested && !stopAnnounced) {
+            LOG(LEVEL_NOTICE, "Stopping once the %d busy workers are done; interrupt again to stop now.\n",
+                              numBusy);
+            stopAnnounced = 1;
+        }
+        int inputsLeft = !stopRequested && (splitTask != 0 || numPending > 0 || totalDeferred > 0 ||
+                                            lpt.count > 0 || numRetries > 0 || !source.exhausted);
+        int liveWorkers = 0;
+        for (int w = 0; w < numWorkers; w++) liveWorkers += children[w].taskFd != -1;
+        reportProgress(numBusy, liveWorkers, queuedTasks(), 0);
+        // Idle workers with inputs left are waiting for the directory scan
+        if (numBusy == 0 && !queueClosed && (!inputsLeft || !liveWorkers)) {
+            if (inputsLeft) {
+                LOG(LEVEL_ERROR, "Error: No workers left, remaining inputs not processed.\n");
+            }
+            for (int w = 0; w < numWorkers; w++) {
+                if (children[w].taskFd != -1) close(children[w].taskFd);
+                children[w].taskFd = -1;
+            }
+            queueClosed = 1;
+            LOG(LEVEL_DEBUG, "Waiting for all child processes to terminate...\n");
+        }
+
+        // Announce that we may sleep, then look at the ring once more so a
+        // result published just before the announcement isn't missed
+        if (useSharedRing) {
+            atomic_store(&resultRing->consumerWaiting, 1);
+            if (drainResultRing() > 0) {
+                atomic_store(&resultRing->consumerWaiting, 0);
+                continue;
+            }
+        }
+
+        // Wake up for the next retry if a worker is free to take it, and for
+        // the next progress report
+        int r, retryWait = numBusy < liveWorkers && !stopRequested ? nextRetry(&r) : -1;
+        int timeout = progressTimeout();
+        if (timeout < 0 || (retryWait >= 0 && retryWait < timeout)) timeout = retryWait;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+        if (retryWait >= 0 && nextRetry(&r) == 0) {
+            for (int w = 0; w < numWorkers; w++) {
+                if (children[w].taskFd != -1 && !children[w].numTasks) scheduleNext(w);
+            }
+        }
+
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u32 == UINT32_MAX) {
+                struct signalfd_siginfo info;
+                while (read(sigFd, &info, sizeof(info)) < 0 && errno == EINTR) {}
+                reapChildren();
+                if (useSharedRing) failReapedWorkers();
+                continue;
+            }
+            if (events[e].data.u32 == SCAN_EVENT_TAG) {
+                uint64_t wakeups;
+                while (read(scanFd, &wakeups, sizeof(wakeups)) < 0 && errno == EINTR) {}
+                for (int w = 0; w < numWorkers; w++) {
+                    if (children[w].taskFd != -1 && !children[w].numTasks) scheduleNext(w);
+                }
+                continue;
+            }
+            if (events[e].data.u32 == RING_EVENT_TAG) {
+                uint64_t wakeups;
+                while (read(ringEventFd, &wakeups, sizeof(wakeups)) < 0 && errno == EINTR) {}
+                drainResultRing();
+                continue;
+            }
+            int w = events[e].data.u32;
+            if (children[w].resultFd == -1) continue; // Closed earlier in this batch
+
+            struct ResultMessage result;
+            STATS_BEGIN(timer);
+            ssize_t got = readFull(children[w].resultFd, &result, sizeof(result));
+            if (got > 0 && result.numPairs > 0) {
+                got = -1;
+                if (result.numPairs <= MAX_RESULT_PAIRS) {
+                    if (result.numPairs > resultPairsCapacity) {
+                        free(resultPairs);
+                        resultPairsCapacity = result.numPairs;
+                        resultPairs = (struct HistogramPair *)malloc(resultPairsCapacity * sizeof(*resultPairs));
+                        if (!resultPairs) {
+                            perror("Failed to allocate histogram pairs");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    size_t size = result.numPairs * sizeof(*resultPairs);
+                    if (readFull(children[w].resultFd, resultPairs, size) == (ssize_t)size) got = 1;
+                }
+            }
+            STATS_END(STAGE_TRANSFER, timer, 1);
+            if (got <= 0) {
+                // EOF (or a broken message): the worker is gone
+                while (children[w].numTasks) {
+                    LOG(LEVEL_ERROR, "Error: Worker %d (PID: %d) exited without reporting task %d.\n",
+                                     w, children[w].pid, children[w].tasks[children[w].nextTask].task);
+                    completeTask(w, STATUS_CRASHED, NULL, NULL, 0);
+                }
+                close(children[w].resultFd); // Also removes it from the epoll set
+                if (children[w].taskFd != -1) close(children[w].taskFd);
+                children[w].resultFd = children[w].taskFd = -1;
+                continue;
+            }
+            handleResult(w, &result, resultPairs);
+        }
+        // Before the loop condition looks at the workers left
+        if (!queueClosed) respawnWorkers(epollFd, useSharedRing);
+    }
+
+    free(resultPairs);
+    reportProgress(0, numWorkers, queuedTasks(), 1);
+    skipQueued(!stopRequested);
+    stopScan();
+    closeCache();
+    stopWriter();
+    if (binaryOutput) closeResults();
+    if (scanFd != -1) close(scanFd);
+    close(epollFd);
+    close(sigFd);
+    if (useSharedRing) {
+        close(ringEventFd);
+        munmap(resultRing, sizeof(struct ResultRing));
+    }
+    LOG(LEVEL_DEBUG, "All child processes have terminated.\n");
+    int uplinkStatus = closeUplink();
+    int status = finishRun();
+    reportStats();
+    return uplinkStatus < 0 ? EXIT_FAILURE : status;
+}
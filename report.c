@@ -0,0 +1,523 @@
+/**
+ * Log records, the --stats instrumentation and report, the --progress
+ * reports and the summary at the end of a run.
+ */
+#include "engine.h"
+
+#define PROGRESS_INTERVAL_MS 250 // Status line refresh on a terminal
+#define PROGRESS_PIPE_INTERVAL_MS 1000 // Progress reports to a file or pipe
+
+static int progressTerminal = 0;       // Whether progressFd is a terminal
+static int logClearsLine[3];           // Per stdout/stderr: shares the terminal of the status line
+enum LogLevel logLevel = LEVEL_NOTICE;             // Set by -q and -v
+
+/**
+ * Writes one log record with a single write(). Workers, threads and the
+ * parent share stdout, and a record of up to PIPE_BUF bytes lands in one
+ * piece even on a pipe, so lines never interleave; nothing is left in a
+ * stdio buffer to be duplicated by fork(). Longer records are truncated.
+ * @param level LEVEL_ERROR records go to stderr, the rest to stdout
+ */
+void logMessage(enum LogLevel level, const char *format, ...) {
+    char record[PIPE_BUF];
+    int fd = level == LEVEL_ERROR ? STDERR_FILENO : STDOUT_FILENO;
+    // A record bound for the terminal of the status line first erases it;
+    // the next progress report draws it again below
+    int start = logClearsLine[fd] ? 4 : 0;
+    memcpy(record, "\r\033[K", start);
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record + start, sizeof(record) - start, format, args);
+    va_end(args);
+    if (length < 0) return;
+    length += start;
+    if ((size_t)length >= sizeof(record)) {
+        length = sizeof(record) - 1;
+        record[length - 1] = '\n';
+    }
+    while (write(fd, record, length) < 0 && errno == EINTR) {}
+}
+
+#if ENABLE_STATS
+static const char *const stageNames[NUM_STAGES] = {
+    "fork", "scan", "cache", "open", "read", "histogram", "decompress", "transfer", "output"
+};
+
+enum StatsFormat statsFormat = STATS_OFF;   // --stats
+struct WorkerStats *statsTable = NULL;      // Slot 0 for the parent, then one per worker
+static int statsSlots = 0;
+static struct timespec statsEpoch;          // Start of the run
+_Thread_local struct WorkerStats *threadStats = NULL; // This thread's slot, NULL for slot 0
+struct QueueGauge busyGauge;                // Workers busy, sampled at dispatch (parent)
+struct QueueGauge pendingGauge;             // Tasks in flight on a worker, sampled at dispatch
+struct QueueGauge writerGauge;              // .hist files queued for the writer thread
+struct QueueGauge scanGauge;                // Files queued by the directory scan
+static uint64_t nodeLocalTasks[MAX_NUMA_NODES]; // Inputs dispatched to a worker on their cache's node
+static uint64_t nodeRemoteTasks[MAX_NUMA_NODES]; // ... and to a worker on another node (parent)
+
+/**
+ * Returns the stats slot of the calling thread.
+ */
+struct WorkerStats *currentStats(void) {
+    return threadStats ? threadStats : &statsTable[0];
+}
+
+/**
+ * Nanoseconds from statsEpoch to a timestamp.
+ */
+static uint64_t sinceEpoch(const struct timespec *t) {
+    return (t->tv_sec - statsEpoch.tv_sec) * 1000000000ull + t->tv_nsec - statsEpoch.tv_nsec;
+}
+
+/**
+ * Charges the time since start to a stage of the calling thread's slot.
+ * @param calls Syscalls (or kernel calls) the stage made
+ */
+void addStageTime(enum Stage stage, const struct timespec *start, uint64_t calls) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct WorkerStats *stats = currentStats();
+    uint64_t begin = sinceEpoch(start) + 1, end = sinceEpoch(&now) + 1;
+    atomic_fetch_add_explicit(&stats->stageNanoseconds[stage], end - begin, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->stageCalls[stage], calls, memory_order_relaxed);
+
+    uint64_t first = atomic_load_explicit(&stats->firstNanoseconds, memory_order_relaxed);
+    while ((first == 0 || begin < first) &&
+           !atomic_compare_exchange_weak_explicit(&stats->firstNanoseconds, &first, begin,
+                                                  memory_order_relaxed, memory_order_relaxed)) {}
+    uint64_t last = atomic_load_explicit(&stats->lastNanoseconds, memory_order_relaxed);
+    while (end > last &&
+           !atomic_compare_exchange_weak_explicit(&stats->lastNanoseconds, &last, end,
+                                                  memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+/**
+ * Records one depth sample of a queue.
+ */
+void sampleGauge(struct QueueGauge *gauge, uint64_t depth) {
+    gauge->samples++;
+    gauge->sum += depth;
+    if (depth > gauge->max) gauge->max = depth;
+}
+
+/**
+ * Counts a dispatched input whose cache node is known as local or remote
+ * to the worker that got it, under the worker's node.
+ */
+void countPlacement(int w, const struct QueuedTask *task) {
+    if (!statsTable || task->homeNode == 0) return;
+    int node = workerNode(w);
+    if (task->homeNode - 1 == node) {
+        nodeLocalTasks[node]++;
+    } else {
+        nodeRemoteTasks[node]++;
+    }
+}
+
+/**
+ * Allocates the stats table before the workers are forked (and before the
+ * threads engine starts). --progress reads its counters too.
+ * @param slots One for the parent plus one per worker or thread
+ * @return 0, or -1 if the table could not be allocated
+ */
+int startStats(int slots) {
+    clock_gettime(CLOCK_MONOTONIC, &statsEpoch);
+    if (statsFormat == STATS_OFF && progressFormat == PROGRESS_OFF) return 0;
+    statsSlots = slots;
+    void *table = mmap(NULL, statsSlots * sizeof(struct WorkerStats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("Error allocating statistics");
+        return -1;
+    }
+    statsTable = (struct WorkerStats *)table; // mmap() memory is zeroed
+    return 0;
+}
+
+/**
+ * Writes one queue gauge in the --stats format.
+ */
+static void reportGauge(FILE *out, const char *name, const struct QueueGauge *gauge, int last) {
+    double mean = gauge->samples ? (double)gauge->sum / gauge->samples : 0;
+    if (statsFormat == STATS_TEXT) {
+        fprintf(out, "  %-10s mean %8.2f  max %8" PRIu64 "  samples %" PRIu64 "\n",
+                name, mean, gauge->max, gauge->samples);
+    } else if (statsFormat == STATS_JSON) {
+        fprintf(out, "    \"%s\": { \"mean\": %.3f, \"max\": %" PRIu64 ", \"samples\": %" PRIu64 " }%s\n",
+                name, mean, gauge->max, gauge->samples, last ? "" : ",");
+    } else {
+        fprintf(out, "parallel_queue_depth_mean{queue=\"%s\"} %.3f\n", name, mean);
+        fprintf(out, "parallel_queue_depth_max{queue=\"%s\"} %" PRIu64 "\n", name, gauge->max);
+    }
+}
+
+/**
+ * Writes the per-node summary of the --stats report: the workers placed on
+ * each node, what they counted, and how many of their inputs were cached on
+ * their own node or on another one (known with --numa=auto only).
+ */
+static void reportNodes(FILE *out) {
+    uint64_t files[MAX_NUMA_NODES] = { 0 }, bytes[MAX_NUMA_NODES] = { 0 };
+    int workers[MAX_NUMA_NODES] = { 0 };
+    for (int s = 1; s < statsSlots; s++) {
+        int node = workerNode(s - 1);
+        workers[node]++;
+        files[node] += statsTable[s].files;
+        bytes[node] += statsTable[s].bytes;
+    }
+
+    if (statsFormat == STATS_TEXT) {
+        fprintf(out, "Nodes:\n");
+    } else if (statsFormat == STATS_JSON) {
+        fprintf(out, "  \"nodes\": [\n");
+    } else {
+        fprintf(out, "# TYPE parallel_node_workers gauge\n"
+                     "# TYPE parallel_node_files_total counter\n"
+                     "# TYPE parallel_node_bytes_total counter\n"
+                     "# TYPE parallel_node_inputs_total counter\n");
+    }
+    int numNodes = topology.numNodes > 0 ? topology.numNodes : 1;
+    for (int node = 0; node < numNodes; node++) {
+        if (workers[node] == 0) continue;
+        if (statsFormat == STATS_TEXT) {
+            fprintf(out, "  node %-3d workers %4d  files %8" PRIu64 "  bytes %12" PRIu64
+                         "  local %8" PRIu64 "  remote %8" PRIu64 "\n", node, workers[node], files[node],
+                    bytes[node], nodeLocalTasks[node], nodeRemoteTasks[node]);
+        } else if (statsFormat == STATS_JSON) {
+            int more = 0;
+            for (int next = node + 1; next < numNodes && !more; next++) more = workers[next] > 0;
+            fprintf(out, "    { \"node\": %d, \"workers\": %d, \"files\": %" PRIu64 ", \"bytes\": %" PRIu64
+                         ", \"local\": %" PRIu64 ", \"remote\": %" PRIu64 " }%s\n", node, workers[node],
+                    files[node], bytes[node], nodeLocalTasks[node], nodeRemoteTasks[node], more ? "," : "");
+        } else {
+            fprintf(out, "parallel_node_workers{node=\"%d\"} %d\n", node, workers[node]);
+            fprintf(out, "parallel_node_files_total{node=\"%d\"} %" PRIu64 "\n", node, files[node]);
+            fprintf(out, "parallel_node_bytes_total{node=\"%d\"} %" PRIu64 "\n", node, bytes[node]);
+            fprintf(out, "parallel_node_inputs_total{node=\"%d\",cache=\"local\"} %" PRIu64 "\n",
+                    node, nodeLocalTasks[node]);
+            fprintf(out, "parallel_node_inputs_total{node=\"%d\",cache=\"remote\"} %" PRIu64 "\n",
+                    node, nodeRemoteTasks[node]);
+        }
+    }
+    if (statsFormat == STATS_JSON) fprintf(out, "  ]\n");
+}
+
+/**
+ * Writes the --stats report to stderr, so it can be kept apart from the
+ * progress output, and releases the table. Slots are labelled "parent" and
+ * by worker (or thread) index; "total" sums them.
+ */
+void reportStats(void) {
+    if (!statsTable) return;
+    if (statsFormat == STATS_OFF) { // Only kept for --progress
+        munmap(statsTable, statsSlots * sizeof(struct WorkerStats));
+        statsTable = NULL;
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall = sinceEpoch(&now) / 1e9;
+
+    // Slot statsSlots is the total
+    struct WorkerStats total;
+    memset(&total, 0, sizeof(total));
+    for (int s = 0; s < statsSlots; s++) {
+        for (int i = 0; i < NUM_STAGES; i++) {
+            total.stageNanoseconds[i] += statsTable[s].stageNanoseconds[i];
+            total.stageCalls[i] += statsTable[s].stageCalls[i];
+        }
+        total.bytes += statsTable[s].bytes;
+        total.files += statsTable[s].files;
+    }
+
+    FILE *out = stderr;
+    if (statsFormat == STATS_TEXT) {
+        fprintf(out, "Statistics after %.3f s (%s):\n", wall, "stage time in ms, syscalls in parentheses");
+        fprintf(out, "%-8s %8s %12s %9s %9s", "slot", "files", "bytes", "busy-from", "busy-to");
+        for (int i = 0; i < NUM_STAGES; i++) fprintf(out, " %17s", stageNames[i]);
+        fprintf(out, "\n");
+    } else if (statsFormat == STATS_JSON) {
+        fprintf(out, "{\n  \"wallSeconds\": %.6f,\n  \"slots\": [\n", wall);
+    } else {
+        fprintf(out, "# TYPE parallel_wall_seconds gauge\nparallel_wall_seconds %.6f\n", wall);
+        fprintf(out, "# TYPE parallel_stage_seconds_total counter\n"
+                     "# TYPE parallel_stage_calls_total counter\n"
+                     "# TYPE parallel_bytes_total counter\n"
+                     "# TYPE parallel_files_total counter\n");
+    }
+
+    for (int s = 0; s <= statsSlots; s++) {
+        struct WorkerStats *stats = s < statsSlots ? &statsTable[s] : &total;
+        char label[16];
+        if (s == 0) {
+            snprintf(label, sizeof(label), "parent");
+        } else if (s == statsSlots) {
+            snprintf(label, sizeof(label), "total");
+        } else {
+            snprintf(label, sizeof(label), "%d", s - 1);
+        }
+        double first = stats->firstNanoseconds ? (stats->firstNanoseconds - 1) / 1e9 : 0;
+        double last = stats->lastNanoseconds ? (stats->lastNanoseconds - 1) / 1e9 : 0;
+
+        if (statsFormat == STATS_TEXT) {
+            fprintf(out, "%-8s %8" PRIu64 " %12" PRIu64, label, (uint64_t)stats->files,
+                    (uint64_t)stats->bytes);
+            if (s < statsSlots) {
+                fprintf(out, " %9.3f %9.3f", first, last);
+            } else {
+                fprintf(out, " %9s %9s", "", "");
+            }
+            for (int i = 0; i < NUM_STAGES; i++) {
+                fprintf(out, " %9.3f (%5" PRIu64 ")", stats->stageNanoseconds[i] / 1e6,
+                        (uint64_t)stats->stageCalls[i]);
+            }
+            fprintf(out, "\n");
+        } else if (statsFormat == STATS_JSON) {
+            fprintf(out, "    { \"slot\": \"%s\", \"files\": %" PRIu64 ", \"bytes\": %" PRIu64,
+                    label, (uint64_t)stats->files, (uint64_t)stats->bytes);
+            if (s < statsSlots) fprintf(out, ", \"busyFrom\": %.6f, \"busyTo\": %.6f", first, last);
+            fprintf(out, ", \"stages\": {");
+            for (int i = 0; i < NUM_STAGES; i++) {
+                fprintf(out, "%s \"%s\": { \"seconds\": %.6f, \"calls\": %" PRIu64 " }",
+                        i ? "," : "", stageNames[i], stats->stageNanoseconds[i] / 1e9,
+                        (uint64_t)stats->stageCalls[i]);
+            }
+            fprintf(out, " } }%s\n", s < statsSlots ? "," : "");
+        } else if (s < statsSlots) { // Prometheus sums series itself
+            for (int i = 0; i < NUM_STAGES; i++) {
+                fprintf(out, "parallel_stage_seconds_total{slot=\"%s\",stage=\"%s\"} %.9f\n",
+                        label, stageNames[i], stats->stageNanoseconds[i] / 1e9);
+                fprintf(out, "parallel_stage_calls_total{slot=\"%s\",stage=\"%s\"} %" PRIu64 "\n",
+                        label, stageNames[i], (uint64_t)stats->stageCalls[i]);
+            }
+            fprintf(out, "parallel_bytes_total{slot=\"%s\"} %" PRIu64 "\n", label, (uint64_t)stats->bytes);
+            fprintf(out, "parallel_files_total{slot=\"%s\"} %" PRIu64 "\n", label, (uint64_t)stats->files);
+        }
+    }
+
+    if (statsFormat == STATS_TEXT) {
+        fprintf(out, "Queue depths:\n");
+    } else if (statsFormat == STATS_JSON) {
+        fprintf(out, "  ],\n  \"queues\": {\n");
+    } else {
+        fprintf(out, "# TYPE parallel_queue_depth_mean gauge\n# TYPE parallel_queue_depth_max gauge\n");
+    }
+    reportGauge(out, "busy", &busyGauge, 0);
+    reportGauge(out, "inflight", &pendingGauge, 0);
+    reportGauge(out, "writer", &writerGauge, 0);
+    reportGauge(out, "scan", &scanGauge, 1);
+    if (statsFormat == STATS_JSON) fprintf(out, "  },\n");
+    reportNodes(out);
+    if (statsFormat == STATS_JSON) fprintf(out, "}\n");
+
+    munmap(statsTable, statsSlots * sizeof(struct WorkerStats));
+    statsTable = NULL;
+}
+#endif
+
+/**
+ * Logs what the run could not count.
+ * @return The exit status: EXIT_FAILURE if any input wasn't counted, any
+ *         directory under the -r roots couldn't be listed, any .hist file
+ *         couldn't be written or the run was interrupted
+ */
+int finishRun(void) {
+    uint64_t uncounted = 0;
+    for (int status = STATUS_FAILED; status < NUM_STATUSES; status++) uncounted += statusCounts[status];
+    if (stopRequested) {
+        LOG(LEVEL_NOTICE, "Interrupted: saved the %" PRIu64 " results counted so far.\n",
+                          (uint64_t)statusCounts[STATUS_COUNTED]);
+    }
+    if (uncounted > 0) {
+        LOG(LEVEL_NOTICE, "Counted %" PRIu64 " inputs; %" PRIu64 " could not be read, %" PRIu64 " kept failing, "
+                          "%" PRIu64 " lost their worker and %" PRIu64 " were skipped.\n",
+                          (uint64_t)statusCounts[STATUS_COUNTED], (uint64_t)statusCounts[STATUS_FAILED],
+                          (uint64_t)statusCounts[STATUS_RETRY], (uint64_t)statusCounts[STATUS_CRASHED],
+                          (uint64_t)statusCounts[STATUS_SKIPPED]);
+    }
+    if (scan.failedDirs > 0) {
+        LOG(LEVEL_NOTICE, "%" PRIu64 " director%s could not be listed; the files in them were not counted.\n",
+                          (uint64_t)scan.failedDirs, scan.failedDirs == 1 ? "y" : "ies");
+    }
+    if (lostOutputs > 0) {
+        LOG(LEVEL_ERROR, "Error: %" PRIu64 " .hist files could not be written.\n", (uint64_t)lostOutputs);
+    }
+    return uncounted > 0 || scan.failedDirs > 0 || lostOutputs > 0 || stopRequested ? EXIT_FAILURE : 0;
+}
+
+struct ProgressState progress;
+
+/**
+ * Checks the --progress descriptor and notes whether it is a terminal, and
+ * which of stdout and stderr share it. Called before any worker starts, so
+ * the log records of every worker know to erase the status line.
+ * @return 0, or -1 if the descriptor is not open
+ */
+int startProgress(void) {
+    if (progressFormat == PROGRESS_OFF) return 0;
+    struct stat line;
+    if (fstat(progressFd, &line) < 0) {
+        fprintf(stderr, "Error: progress descriptor %d is not open.\n", progressFd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &progress.started);
+    progress.last = progress.started;
+    progressTerminal = isatty(progressFd);
+    if (!progressTerminal || progressFormat != PROGRESS_LINE) return 0;
+    for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+        struct stat st;
+        logClearsLine[fd] = isatty(fd) && fstat(fd, &st) == 0 && st.st_rdev == line.st_rdev;
+    }
+    return 0;
+}
+
+/**
+ * @return Milliseconds until the next progress report is due, 0 if it is, or
+ *         -1 without --progress
+ */
+int progressTimeout(void) {
+    if (progressFormat == PROGRESS_OFF) return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long interval = progressTerminal && progressFormat == PROGRESS_LINE ? PROGRESS_INTERVAL_MS
+                                                                       : PROGRESS_PIPE_INTERVAL_MS;
+    long elapsed = (now.tv_sec - progress.last.tv_sec) * 1000 + (now.tv_nsec - progress.last.tv_nsec) / 1000000;
+    return elapsed >= interval ? 0 : interval - elapsed;
+}
+
+/**
+ * Estimates how many inputs this node counts in all, from what the input
+ * source has handed out and what it has left: the rest of the command line,
+ * the rest of the --files-from list (by the share of its bytes still unread)
+ * and the files the scan has queued once it has finished.
+ * @param exact Set if every input has been handed out, so the count is final
+ * @return The estimate, or 0 while there is nothing to go by (e.g. a scan still running)
+ */
+static uint64_t expectedInputs(int *exact) {
+    uint64_t taken = inputsTaken, expected = 0;
+    pthread_mutex_lock(&source.lock);
+    *exact = source.exhausted;
+    double left = source.argc - source.next; // Source positions, of every shard
+    int known = !source.listPath || source.listDone || source.listSize > 0;
+    if (known && source.listPath && !source.listDone && source.list) {
+        off_t read = ftello(source.list);
+        if (read > 0) left += (double)source.listEntries * (source.listSize - read) / read;
+        if (read <= 0) known = 0;
+    } else if (known && source.listPath && !source.listDone) {
+        known = 0; // Not opened yet
+    }
+    if (scan.numRoots > 0) {
+        pthread_mutex_lock(&scan.lock);
+        known = known && scan.done;
+        left += scan.count;
+        pthread_mutex_unlock(&scan.lock);
+    }
+    // Scaled by this node's share of the positions handed out so far
+    if (*exact) {
+        expected = taken;
+    } else if (known && source.lastTask > 0) {
+        expected = taken + (uint64_t)(left * taken / source.lastTask);
+    }
+    pthread_mutex_unlock(&source.lock);
+    return expected;
+}
+
+/**
+ * Sums the input bytes counted so far from the stats slots of every worker.
+ */
+static uint64_t countedBytes(void) {
+    uint64_t bytes = 0;
+#if ENABLE_STATS
+    for (int s = 0; statsTable && s < statsSlots; s++) bytes += statsTable[s].bytes;
+#endif
+    return bytes;
+}
+
+/**
+ * Formats a byte count with a binary unit, e.g. "12.3 MiB".
+ */
+static void formatBytes(char *text, size_t size, double bytes) {
+    static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    int unit = 0;
+    while (bytes >= 1024 && unit < 5) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(text, size, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
+
+/**
+ * Writes a --progress report if one is due: inputs done out of the expected
+ * total, bytes counted and their rate, the estimated time left, busy workers
+ * and queued inputs. Everything comes from counters the run keeps anyway, so
+ * a report costs no syscalls per input.
+ * @param busy Workers (or threads, or shards) busy right now
+ * @param workers Workers in the pool
+ * @param queued Inputs waiting for a worker
+ * @param final Write the report whether or not it is due, and end the status line
+ */
+void reportProgress(int busy, int workers, uint64_t queued, int final) {
+    if (progressFormat == PROGRESS_OFF || (!final && progressTimeout() != 0)) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - progress.started.tv_sec) + (now.tv_nsec - progress.started.tv_nsec) / 1e9;
+    double interval = (now.tv_sec - progress.last.tv_sec) + (now.tv_nsec - progress.last.tv_nsec) / 1e9;
+    uint64_t bytes = countedBytes();
+    if (interval > 0) {
+        double rate = (bytes - progress.lastBytes) / interval;
+        progress.rate = progress.reports ? 0.7 * progress.rate + 0.3 * rate : rate;
+    }
+    progress.last = now;
+    progress.lastBytes = bytes;
+    progress.reports++;
+
+    uint64_t done = 0;
+    for (int status = 0; status < NUM_STATUSES; status++) done += statusCounts[status];
+    uint64_t failed = done - statusCounts[STATUS_COUNTED];
+    int exact;
+    uint64_t total = expectedInputs(&exact);
+    if (total < done) total = done;
+    // From the mean rate so far, which cache hits and file sizes even out
+    double eta = total > 0 && done > 0 ? (total - done) * elapsed / done : -1;
+
+    char report[512];
+    int length;
+    if (progressFormat == PROGRESS_JSON) {
+        length = snprintf(report, sizeof(report),
+                          "{ \"elapsed\": %.3f, \"done\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"total\": ",
+                          elapsed, done, failed);
+        length += total > 0 ? snprintf(report + length, sizeof(report) - length, "%" PRIu64, total)
+                            : snprintf(report + length, sizeof(report) - length, "null");
+        length += snprintf(report + length, sizeof(report) - length,
+                           ", \"exact\": %s, \"bytes\": %" PRIu64 ", \"bytesPerSecond\": %.0f, \"eta\": ",
+                           exact ? "true" : "false", bytes, progress.rate);
+        length += eta >= 0 ? snprintf(report + length, sizeof(report) - length, "%.1f", eta)
+                           : snprintf(report + length, sizeof(report) - length, "null");
+        length += snprintf(report + length, sizeof(report) - length,
+                           ", \"busy\": %d, \"workers\": %d, \"queued\": %" PRIu64 ", \"final\": %s }\n",
+                           busy, workers, queued, final ? "true" : "false");
+    } else {
+        const char *erase = progressTerminal ? "\r\033[K" : "";
+        length = total > 0 ? snprintf(report, sizeof(report), "%s%" PRIu64 "/%s%" PRIu64 " files", erase,
+                                      done, exact ? "" : "~", total)
+                           : snprintf(report, sizeof(report), "%s%" PRIu64 " files", erase, done);
+        if (failed > 0) length += snprintf(report + length, sizeof(report) - length, " (%" PRIu64 " failed)", failed);
+        char counted[16], rate[16];
+        formatBytes(counted, sizeof(counted), bytes);
+        formatBytes(rate, sizeof(rate), progress.rate);
+        length += snprintf(report + length, sizeof(report) - length, "  %s  %s/s", counted, rate);
+        if (eta >= 0 && !final) {
+            long seconds = (long)(eta + 0.5);
+            length += snprintf(report + length, sizeof(report) - length, "  ETA %ld:%02ld:%02ld", seconds / 3600,
+                               seconds / 60 % 60, seconds % 60);
+        }
+        length += snprintf(report + length, sizeof(report) - length, "  %d/%d busy  %" PRIu64 " queued%s", busy,
+                           workers, queued, progressTerminal && !final ? "" : "\n");
+    }
+    if (length >= (int)sizeof(report)) length = sizeof(report) - 1;
+    while (write(progressFd, report, length) < 0 && errno == EINTR) {}
+    if (final) {
+        logClearsLine[STDOUT_FILENO] = logClearsLine[STDERR_FILENO] = 0;
+        progressFormat = PROGRESS_OFF;
+    }
+}
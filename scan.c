@@ -0,0 +1,527 @@
+/**
+ * Where inputs come from: the command line and --files-from list, the -r
+ * directory scan, sharding, and the --schedule=lpt window.
+ */
+#include "engine.h"
+
+#define DIRENT_BUFFER_SIZE (32 << 10) // getdents64() buffer per traversal thread
+#define NUMA_PROBE_MIN (1 << 20) // Files this large are checked for the node caching them
+
+/**
+ * Record returned by getdents64(2). glibc only exposes it through readdir().
+ */
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct DirScan scan = { .lock = PTHREAD_MUTEX_INITIALIZER, .dirsReady = PTHREAD_COND_INITIALIZER,
+                        .notFull = PTHREAD_COND_INITIALIZER, .notEmpty = PTHREAD_COND_INITIALIZER,
+                        .numThreads = DEFAULT_SCAN_THREADS, .maxSize = -1, .eventFd = -1 };
+
+struct InputSource source = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, NULL, '\n' };
+
+/**
+ * Pushes a directory for a traversal thread to list; takes ownership of path
+ * and of a reference to parent. Call with scan.lock held.
+ */
+static void pushScanDir(char *path, size_t nameOffset, struct DirHandle *parent) {
+    if (scan.numDirs == scan.dirCapacity) {
+        scan.dirCapacity = scan.dirCapacity ? scan.dirCapacity * 2 : 64;
+        scan.dirs = (struct ScanDir *)realloc(scan.dirs, scan.dirCapacity * sizeof(struct ScanDir));
+        if (!scan.dirs) {
+            perror("Failed to allocate directory stack");
+            exit(EXIT_FAILURE);
+        }
+    }
+    scan.dirs[scan.numDirs++] = (struct ScanDir){ path, nameOffset, parent };
+    pthread_cond_signal(&scan.dirsReady);
+}
+
+/**
+ * Wakes the parent's event loop, if it is waiting for scan results.
+ */
+static void notifyScanEvent(void) {
+    uint64_t one = 1;
+    if (scan.eventFd != -1 && write(scan.eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error signalling scan eventfd");
+    }
+}
+
+/**
+ * Queues a discovered file for the scheduler, waiting while the queue is
+ * full so a huge tree doesn't pile up in memory. Takes ownership of path.
+ */
+void pushScannedFile(char *path) {
+    pthread_mutex_lock(&scan.lock);
+    while (scan.count == SCAN_QUEUE_SIZE) pthread_cond_wait(&scan.notFull, &scan.lock);
+    scan.files[(scan.head + scan.count) % SCAN_QUEUE_SIZE] = path;
+    int wasEmpty = scan.count++ == 0;
+    STATS_SAMPLE(scanGauge, scan.count);
+    pthread_cond_signal(&scan.notEmpty);
+    pthread_mutex_unlock(&scan.lock);
+    if (wasEmpty) notifyScanEvent();
+}
+
+/**
+ * Takes the next discovered file off the scan queue.
+ * @param wait Whether to block until a file arrives or the scan finishes
+ * @param done Receives 1 if the queue is empty and no more files will come
+ * @return A malloc()ed path, or NULL if none is queued
+ */
+static char *nextScannedFile(int wait, int *done) {
+    char *path = NULL;
+    pthread_mutex_lock(&scan.lock);
+    while (wait && scan.count == 0 && !scan.done) pthread_cond_wait(&scan.notEmpty, &scan.lock);
+    if (scan.count > 0) {
+        path = scan.files[scan.head];
+        scan.head = (scan.head + 1) % SCAN_QUEUE_SIZE;
+        scan.count--;
+        pthread_cond_signal(&scan.notFull);
+    }
+    *done = !path && scan.done;
+    pthread_mutex_unlock(&scan.lock);
+    return path;
+}
+
+/**
+ * Hashes a directory identity into the scan.visited table.
+ */
+static size_t dirIdHash(dev_t dev, ino_t ino, size_t capacity) {
+    return ((size_t)ino * 2654435761u ^ (size_t)dev) & (capacity - 1);
+}
+
+/**
+ * Records a directory as visited.
+ * @return 1 if it was new, 0 if it had been seen before
+ */
+static int markVisited(dev_t dev, ino_t ino) {
+    pthread_mutex_lock(&scan.lock);
+    if ((scan.visitedCount + 1) * 2 > scan.visitedCapacity) {
+        // Keep the table at most half full, rehashing into one twice the size
+        size_t capacity = scan.visitedCapacity ? scan.visitedCapacity * 2 : 1024;
+        struct DirId *table = (struct DirId *)calloc(capacity, sizeof(struct DirId));
+        if (!table) {
+            perror("Failed to allocate visited directory set");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < scan.visitedCapacity; i++) {
+            struct DirId *id = &scan.visited[i];
+            if (id->ino == 0) continue;
+            size_t h = dirIdHash(id->dev, id->ino, capacity);
+            while (table[h].ino != 0) h = (h + 1) & (capacity - 1);
+            table[h] = *id;
+        }
+        free(scan.visited);
+        scan.visited = table;
+        scan.visitedCapacity = capacity;
+    }
+
+    int isNew = 1;
+    size_t h = dirIdHash(dev, ino, scan.visitedCapacity);
+    for (; scan.visited[h].ino != 0; h = (h + 1) & (scan.visitedCapacity - 1)) {
+        if (scan.visited[h].ino == ino && scan.visited[h].dev == dev) {
+            isNew = 0;
+            break;
+        }
+    }
+    if (isNew) {
+        scan.visited[h].dev = dev;
+        scan.visited[h].ino = ino;
+        scan.visitedCount++;
+    }
+    pthread_mutex_unlock(&scan.lock);
+    return isNew;
+}
+
+/**
+ * Drops a reference to an open directory, closing it with the last one.
+ */
+static void releaseDirHandle(struct DirHandle *handle) {
+    if (!handle || atomic_fetch_sub(&handle->refs, 1) != 1) return;
+    close(handle->fd);
+    free(handle);
+}
+
+/**
+ * Lists one directory with getdents64(). Subdirectories go on the directory
+ * stack and regular files that pass the size filter onto the file queue.
+ * d_type saves an fstatat() per entry unless the entry is a symlink, the
+ * file system doesn't report types, or a size filter needs st_size. A
+ * directory that can't be opened or read counts as failed in the summary
+ * and the exit status.
+ */
+static void scanDirectory(const struct ScanDir *scanDir, char *buffer) {
+    const char *dir = scanDir->path;
+    // Below the roots a directory is only entered through a symlink with
+    // --symlinks=follow; O_NOFOLLOW also stops one swapped in since listing
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int fd = !scanDir->parent ? open(dir, flags)
+           : openat(scanDir->parent->fd, dir + scanDir->nameOffset,
+                    flags | (scan.symlinks == SYMLINKS_FOLLOW ? 0 : O_NOFOLLOW));
+    int error = errno;
+    releaseDirHandle(scanDir->parent);
+    if (fd < 0) {
+        LOG(LEVEL_ERROR, "Error opening directory %s: %s\n", dir, strerror(error));
+        scan.failedDirs++;
+        return;
+    }
+    if (scan.symlinks == SYMLINKS_FOLLOW) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !markVisited(st.st_dev, st.st_ino)) {
+            close(fd);
+            return;
+        }
+    }
+    struct DirHandle *handle = (struct DirHandle *)malloc(sizeof(struct DirHandle));
+    if (!handle) {
+        perror("Failed to allocate directory handle");
+        exit(EXIT_FAILURE);
+    }
+    handle->fd = fd;
+    atomic_init(&handle->refs, 1);
+
+    size_t dirLength = strlen(dir);
+    while (dirLength > 1 && dir[dirLength - 1] == '/') dirLength--;
+    int sizeFilter = scan.minSize > 0 || scan.maxSize >= 0;
+
+    long got;
+    for (;;) {
+        STATS_BEGIN(timer);
+        got = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE);
+        STATS_END(STAGE_SCAN, timer, 1);
+        if (got <= 0) break;
+        for (long pos = 0; pos < got;) {
+            struct LinuxDirent64 *entry = (struct LinuxDirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            int isDir = entry->d_type == DT_DIR;
+            int isFile = entry->d_type == DT_REG;
+            struct stat st;
+            int haveStat = 0;
+            if (entry->d_type == DT_UNKNOWN) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                haveStat = 1;
+                isDir = S_ISDIR(st.st_mode);
+                isFile = S_ISREG(st.st_mode);
+            }
+            if (entry->d_type == DT_LNK || (haveStat && S_ISLNK(st.st_mode))) {
+                if (scan.symlinks == SYMLINKS_SKIP || fstatat(fd, name, &st, 0) < 0) continue;
+                haveStat = 1;
+                isDir = S_ISDIR(st.st_mode) && scan.symlinks == SYMLINKS_FOLLOW;
+                isFile = S_ISREG(st.st_mode);
+            }
+            if (!isDir && !isFile) continue; // FIFOs, sockets and devices aren't inputs
+
+            if (isFile && sizeFilter) {
+                if (!haveStat && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                if (st.st_size < scan.minSize) continue;
+                if (scan.maxSize >= 0 && st.st_size > scan.maxSize) continue;
+            }
+
+            size_t nameLength = strlen(name);
+            if (dirLength + 1 + nameLength >= PATH_MAX) {
+                LOG(LEVEL_ERROR, "Path too long, skipping: %s/%s\n", dir, name);
+                continue;
+            }
+            char *path = (char *)malloc(dirLength + nameLength + 2);
+            if (!path) {
+                perror("Failed to allocate path");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(path, dir, dirLength);
+            path[dirLength] = '/';
+            memcpy(path + dirLength + 1, name, nameLength + 1);
+
+            if (isDir) {
+                atomic_fetch_add(&handle->refs, 1);
+                pthread_mutex_lock(&scan.lock);
+                pushScanDir(path, dirLength + 1, handle);
+                pthread_mutex_unlock(&scan.lock);
+            } else {
+                pushScannedFile(path);
+            }
+        }
+    }
+    if (got < 0) {
+        LOG(LEVEL_ERROR, "Error reading directory %s: %s\n", dir, strerror(errno));
+        scan.failedDirs++;
+    }
+    releaseDirHandle(handle);
+}
+
+/**
+ * Traversal thread: lists directories until the stack is empty and no other
+ * thread is still listing one (and so might push more).
+ */
+static void *runScanThread(void *arg) {
+    (void)arg;
+    char *buffer = (char *)malloc(DIRENT_BUFFER_SIZE);
+    if (!buffer) {
+        perror("Failed to allocate directory buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&scan.lock);
+    for (;;) {
+        while (scan.numDirs == 0 && scan.activeWalkers > 0) {
+            pthread_cond_wait(&scan.dirsReady, &scan.lock);
+        }
+        if (scan.numDirs == 0) break;
+        struct ScanDir dir = scan.dirs[--scan.numDirs];
+        scan.activeWalkers++;
+        pthread_mutex_unlock(&scan.lock);
+
+        scanDirectory(&dir, buffer);
+        free(dir.path);
+
+        pthread_mutex_lock(&scan.lock);
+        if (--scan.activeWalkers == 0 && scan.numDirs == 0) {
+            pthread_cond_broadcast(&scan.dirsReady);
+        }
+    }
+    if (!scan.done) {
+        scan.done = 1;
+        pthread_cond_broadcast(&scan.notEmpty);
+        notifyScanEvent();
+    }
+    pthread_mutex_unlock(&scan.lock);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Starts the directory scan over the -r roots. Without roots the scan is
+ * simply marked done.
+ * @param eventFd eventfd to signal as files arrive, or -1
+ */
+void startScan(int eventFd) {
+    scan.eventFd = eventFd;
+    if (scan.numRoots == 0) {
+        scan.done = 1;
+        return;
+    }
+    for (int i = 0; i < scan.numRoots; i++) pushScanDir(strdup(scan.roots[i]), 0, NULL);
+
+    LOG(LEVEL_INFO, "Scanning %d director%s with %d threads...\n", scan.numRoots,
+                    scan.numRoots == 1 ? "y" : "ies", scan.numThreads);
+    scan.threads = (pthread_t *)calloc(scan.numThreads, sizeof(pthread_t));
+    if (!scan.threads) {
+        perror("Failed to allocate scan threads");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < scan.numThreads; t++) {
+        int rc = pthread_create(&scan.threads[t], NULL, runScanThread, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "Error creating scan thread: %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Waits for the traversal threads once the scan is done and frees its state.
+ * A scan cut short (every worker died) is left to process exit.
+ */
+void stopScan(void) {
+    if (!scan.threads || !scan.done) return;
+    for (int t = 0; t < scan.numThreads; t++) pthread_join(scan.threads[t], NULL);
+    free(scan.threads);
+    free(scan.dirs);
+    free(scan.visited);
+    scan.threads = NULL;
+}
+
+struct LptWindow lpt = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Takes the next path from the input source and gives it a task number:
+ * command-line paths, then the --files-from list, then the files found by
+ * the directory scan. The list is opened on first use, i.e. only after the
+ * workers have been forked. Empty list entries are skipped. Safe to call
+ * from several threads.
+ * @param task Receives the task number
+ * @param wait Whether to block until the scan finds another file, rather
+ *             than return NULL with source.exhausted still clear
+ * @return A malloc()ed path the caller must free, or NULL if no input is available
+ */
+static char *nextSourcePath(int *task, int wait) {
+    char *path = NULL;
+    pthread_mutex_lock(&source.lock);
+    while (!path && !source.exhausted) {
+        if (source.next < source.argc) {
+            path = strdup(source.argv[source.next++]);
+            break;
+        }
+        if (!source.listPath || source.listDone) {
+            path = nextScannedFile(wait, &source.exhausted);
+            break;
+        }
+        if (!source.list) {
+            source.list = strcmp(source.listPath, "-") == 0 ? stdin : fopen(source.listPath, "r");
+            if (!source.list) {
+                LOG(LEVEL_ERROR, "Error opening file list %s: %s\n", source.listPath, strerror(errno));
+                source.listDone = 1;
+                continue;
+            }
+            struct stat st;
+            if (fstat(fileno(source.list), &st) == 0 && S_ISREG(st.st_mode)) source.listSize = st.st_size;
+        }
+
+        ssize_t length = getdelim(&source.entry, &source.entryCapacity, source.delimiter, source.list);
+        if (length < 0) {
+            if (ferror(source.list)) perror("Error reading file list");
+            if (source.list != stdin) fclose(source.list);
+            free(source.entry);
+            source.entry = NULL;
+            source.listDone = 1;
+            continue;
+        }
+        source.listEntries++;
+        if (length > 0 && source.entry[length - 1] == source.delimiter) source.entry[--length] = '\0';
+        if (length > 0) path = strdup(source.entry);
+    }
+    if (path) *task = ++source.lastTask;
+    pthread_mutex_unlock(&source.lock);
+    return path;
+}
+
+/**
+ * Maps a key to one of numBuckets buckets with Lamping and Veach's jump
+ * consistent hash: going from N to N + 1 buckets moves only 1/(N + 1) of
+ * the keys, all of them to the new bucket.
+ */
+static int jumpHash(uint64_t key, int numBuckets) {
+    int64_t bucket = -1, next = 0;
+    while (next < numBuckets) {
+        bucket = next;
+        key = key * 2862933555777941757ull + 1;
+        next = (bucket + 1) * ((double)(1ll << 31) / (double)((key >> 33) + 1));
+    }
+    return bucket;
+}
+
+/**
+ * Returns the shard an input belongs to, from the 64-bit FNV-1a hash of its
+ * path, so every node agrees without talking to the others.
+ */
+static int shardOf(const char *path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ull;
+    }
+    return jumpHash(hash, numShards);
+}
+
+/**
+ * Hands out the next input path of this node's shard and gives it a task
+ * number. Inputs of other shards still use up their task numbers, so a task
+ * number names the same input on every node given the same inputs. Nothing
+ * more is handed out once a stop has been requested.
+ * @param task Receives the task number
+ * @param wait Passed on to nextSourcePath()
+ * @return A malloc()ed path the caller must free, or NULL if no input is available
+ */
+static char *nextInputPath(int *task, int wait) {
+    char *path;
+    if (stopRequested) return NULL;
+    while ((path = nextSourcePath(task, wait)) && numShards > 0 && shardOf(path) != shardIndex) {
+        free(path);
+    }
+    if (path && strcmp(path, "SIG") != 0) inputsTaken++;
+    return path;
+}
+
+/**
+ * Stats a picked input if the schedule or the cache needs to know about it,
+ * and records its size (-1 for anything but a regular file) and cache key.
+ * With --numa=auto, large files are also probed for the node caching them.
+ */
+static void statInput(struct QueuedTask *input) {
+    struct stat st;
+    input->size = -1;
+    input->cacheable = 0;
+    input->homeNode = 0;
+    input->attempts = 0;
+    if (schedulePolicy == SCHEDULE_FIFO && cache.fd == -1 && !numaRouting) return;
+    if (stat(input->path, &st) < 0) return;
+    if (S_ISREG(st.st_mode)) input->size = st.st_size;
+    setCacheKey(input, &st);
+    if (numaRouting && input->size >= NUMA_PROBE_MIN) {
+        input->homeNode = probeFileNode(input->path, input->size);
+    }
+}
+
+/**
+ * Picks the next input according to schedulePolicy. With --schedule=lpt the
+ * window is topped up from the input source and its largest file comes out
+ * first, so memory stays bounded however many inputs there are; only the
+ * first input of an empty window is waited for.
+ * @param wait Passed on to nextInputPath()
+ * @return 1 if an input was picked, 0 if none is available
+ */
+static int pickScheduledInput(struct QueuedTask *input, int wait) {
+    if (schedulePolicy != SCHEDULE_LPT) {
+        input->path = nextInputPath(&input->task, wait);
+        if (!input->path) return 0;
+        statInput(input);
+        return 1;
+    }
+
+    pthread_mutex_lock(&lpt.lock);
+    while (lpt.count < SCHEDULE_WINDOW) {
+        struct QueuedTask next;
+        next.path = nextInputPath(&next.task, wait && lpt.count == 0);
+        if (!next.path) break;
+        statInput(&next);
+
+        // Sift up
+        int i = lpt.count++;
+        while (i > 0 && lpt.heap[(i - 1) / 2].size < next.size) {
+            lpt.heap[i] = lpt.heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        lpt.heap[i] = next;
+    }
+
+    int picked = lpt.count > 0;
+    if (picked) {
+        *input = lpt.heap[0];
+        // Sift the last entry down from the root
+        struct QueuedTask last = lpt.heap[--lpt.count];
+        int i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= lpt.count) break;
+            if (child + 1 < lpt.count && lpt.heap[child + 1].size > lpt.heap[child].size) child++;
+            if (lpt.heap[child].size <= last.size) break;
+            lpt.heap[i] = lpt.heap[child];
+            i = child;
+        }
+        if (lpt.count > 0) lpt.heap[i] = last;
+    }
+    pthread_mutex_unlock(&lpt.lock);
+    return picked;
+}
+
+/**
+ * Picks the next input that needs counting. Inputs the result cache can
+ * answer are saved on the spot and never reach a worker.
+ * @param wait Passed on to nextInputPath()
+ * @return 1 if an input was picked, 0 if none is available
+ */
+int pickInput(struct QueuedTask *input, int wait) {
+    while (pickScheduledInput(input, wait)) {
+        uint64_t counts[26];
+        if (!input->cacheable || !cacheLookup(&input->key, counts)) return 1;
+        LOG(LEVEL_INFO, "Found %s in the result cache.\n", input->path);
+        saveHistogram(getpid(), input->task, input->path, counts, NULL, 0);
+        free(input->path);
+    }
+    return 0;
+}
@@ -0,0 +1,370 @@
+/**
+ * The threads engine: one work-stealing deque per thread, fed from the
+ * input source.
+ */
+#include "engine.h"
+
+#define THREAD_REFILL_BATCH 16 // Inputs a thread takes from the input source at a time
+
+/**
+ * Split input shared by the threads counting its ranges.
+ */
+struct ThreadSplit {
+    pthread_mutex_t lock;
+    struct SplitInput state;
+};
+
+/**
+ * One unit of work for the threaded engine: a whole file or a byte range.
+ */
+struct ThreadTask {
+    int task;                  // Task number of the input
+    char *path;                // Whole file: its path, owned by the task; range: NULL
+    struct ThreadSplit *split; // Range: the split input it belongs to; whole file: NULL
+    off_t offset;              // First byte of the range
+    off_t length;              // Length of the range, or -1 for the whole file
+    int cacheable;             // Whole file: whether to cache the result under key
+    struct CacheKey key;
+};
+
+/**
+ * Per-thread task deque. The owner pushes and pops at the tail and thieves
+ * steal from the head, so an idle thread takes the work its owner would get
+ * to last.
+ */
+struct TaskDeque {
+    pthread_mutex_t lock;
+    struct ThreadTask *items;
+    int head;     // Next task to steal
+    int tail;     // One past the owner's next task
+    int capacity;
+};
+
+static struct TaskDeque *deques; // One deque per thread
+static _Atomic int threadsBusy; // Threads counting a task right now
+
+/**
+ * Makes room for n more tasks at the tail of a deque, compacting or growing
+ * it as needed. Only the owner pushes, and thieves only take from the head,
+ * so the room lasts until the owner's next pushes.
+ * @return 0, or -1 if the deque could not grow
+ */
+static int reserveTasks(struct TaskDeque *deque, int n) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail + n > deque->capacity && deque->head > 0) {
+        memmove(deque->items, deque->items + deque->head,
+                (deque->tail - deque->head) * sizeof(struct ThreadTask));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    int reserved = deque->tail + n <= deque->capacity;
+    if (!reserved) {
+        int capacity = deque->capacity ? deque->capacity * 2 : 16;
+        while (capacity < deque->tail + n) capacity *= 2;
+        struct ThreadTask *items = (struct ThreadTask *)realloc(deque->items,
+                                                                capacity * sizeof(struct ThreadTask));
+        if (items) {
+            deque->items = items;
+            deque->capacity = capacity;
+            reserved = 1;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return reserved ? 0 : -1;
+}
+
+/**
+ * Adds a task to the tail of a deque, into room made by reserveTasks().
+ */
+static void pushTask(struct TaskDeque *deque, struct ThreadTask task) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * Pulls up to THREAD_REFILL_BATCH inputs from the input source into thread
+ * t's deque, waiting only for the first, so a thread doesn't sit on inputs
+ * while the scan queue slowly fills. Large files are split into one range
+ * per thread, which the other threads then steal. Inputs are pushed in reverse so the owner, which
+ * pops from the tail, runs them in the order the schedule picked them.
+ * @return Number of tasks added
+ */
+static int refillDeque(int t) {
+    struct QueuedTask inputs[THREAD_REFILL_BATCH];
+    int numInputs = 0;
+    while (numInputs < THREAD_REFILL_BATCH && pickInput(&inputs[numInputs], numInputs == 0)) {
+        LOG(LEVEL_DEBUG, "Processing file/command %s...\n", inputs[numInputs].path);
+        if (strcmp(inputs[numInputs].path, "SIG") == 0) {
+            LOG(LEVEL_NOTICE, "Skipping SIG: there are no child processes in threads mode.\n");
+            free(inputs[numInputs].path);
+            continue;
+        }
+        numInputs++;
+    }
+
+    int added = 0;
+    for (int i = numInputs - 1; i >= 0; i--) {
+        int taskNumber = inputs[i].task;
+        char *path = inputs[i].path;
+        struct stat st;
+        struct ThreadSplit *split = NULL;
+        off_t range = 0;
+        if (splitThreshold > 0 && numWorkers >= 2 && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size >= splitThreshold && canSplitFile(path, st.st_size)) {
+            // One range per thread, rounded up to whole pages; without the
+            // memory for the ranges the file is counted whole
+            off_t page = sysconf(_SC_PAGESIZE);
+            range = (st.st_size + numWorkers - 1) / numWorkers;
+            range = (range + page - 1) / page * page;
+            split = (struct ThreadSplit *)calloc(1, sizeof(struct ThreadSplit));
+            if (split && reserveTasks(&deques[t], (st.st_size + range - 1) / range) < 0) {
+                free(split);
+                split = NULL;
+            }
+        }
+        if (!split) {
+            if (reserveTasks(&deques[t], 1) < 0) {
+                LOG(LEVEL_ERROR, "Error queueing %s: %s\n", path, strerror(ENOMEM));
+                saveFailure(taskNumber, path, STATUS_RETRY);
+                free(path);
+                continue;
+            }
+            struct ThreadTask task = { taskNumber, path, NULL, 0, -1, inputs[i].cacheable,
+                                       inputs[i].key };
+            pushTask(&deques[t], task);
+            added++;
+            continue;
+        }
+
+        pthread_mutex_init(&split->lock, NULL);
+        split->state.task = taskNumber;
+        split->state.path = path;
+        split->state.cacheable = inputs[i].cacheable;
+        split->state.key = inputs[i].key;
+        split->state.partsLeft = (st.st_size + range - 1) / range;
+        LOG(LEVEL_INFO, "Splitting %s into %d ranges of %lld bytes.\n", path,
+                        split->state.partsLeft, (long long)range);
+        for (off_t offset = 0; offset < st.st_size; offset += range) {
+            off_t length = st.st_size - offset < range ? st.st_size - offset : range;
+            struct ThreadTask task = { taskNumber, NULL, split, offset, length, 0 };
+            pushTask(&deques[t], task);
+            added++;
+        }
+    }
+    return added;
+}
+
+/**
+ * Takes the next task for thread t: from the tail of its own deque, else
+ * stolen from the head of another thread's deque, else freshly pulled from
+ * the input source.
+ * @return 1 if a task was taken, 0 if there is no work left or a stop was requested
+ */
+static int takeTask(int t, struct ThreadTask *task) {
+    if (stopRequested) return 0;
+    do {
+        for (int i = 0; i < numWorkers; i++) {
+            struct TaskDeque *deque = &deques[(t + i) % numWorkers];
+            int found = 0;
+            pthread_mutex_lock(&deque->lock);
+            if (deque->head < deque->tail) {
+                *task = i == 0 ? deque->items[--deque->tail] : deque->items[deque->head++];
+                found = 1;
+            }
+            pthread_mutex_unlock(&deque->lock);
+            if (found) return 1;
+        }
+    } while (refillDeque(t) > 0);
+    return 0;
+}
+
+/**
+ * Thread main loop: counts tasks into a thread-local histogram until there is
+ * no work left anywhere, then saves or merges each result.
+ */
+static void *runThread(void *arg) {
+    int t = (int)(intptr_t)arg;
+#if ENABLE_STATS
+    if (statsTable) threadStats = &statsTable[t + 1];
+#endif
+    placeWorker(t);
+    struct ThreadTask task;
+
+    while (takeTask(t, &task)) {
+        threadsBusy++;
+        struct ThreadSplit *split = task.split;
+        const char *path = split ? split->state.path : task.path;
+        uint64_t counts[26];
+        struct timespec started, now;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int stream = uringQueue(path, task.offset, task.length);
+        int status = stream >= 0      ? uringFinish(stream, counts)
+                   : task.length >= 0 ? processRange(path, task.offset, task.length, counts)
+                                      : processFile(path, counts);
+        const struct HistogramPair *pairs = NULL;
+        uint32_t numPairs = 0;
+        if (status == 0 && collectPairs(&pairs, &numPairs) < 0) status = STATUS_RETRY;
+        // Retried in place: the other threads keep stealing this one's tasks
+        for (int attempt = 1; status == STATUS_RETRY && attempt <= maxRetries && !stopRequested; attempt++) {
+            long delay = retryDelay(attempt);
+            LOG(LEVEL_NOTICE, "Retrying %s in %ld ms (attempt %d of %d).\n", path, delay, attempt + 1,
+                              maxRetries + 1);
+            sleepMilliseconds(delay);
+            status = task.length >= 0 ? processRange(path, task.offset, task.length, counts)
+                                      : processFile(path, counts);
+            if (status == 0 && collectPairs(&pairs, &numPairs) < 0) status = STATUS_RETRY;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+        STATS_ADD(files, 1);
+
+        if (!split) {
+            if (status == 0) {
+                if (task.cacheable) cacheStore(&task.key, counts);
+                LOG(LEVEL_INFO, "Thread %d computed histogram of %s after %.6f s.\n", t, path, elapsed);
+                saveHistogram(getpid(), task.task, path, counts, pairs, numPairs);
+                delayTask(task.task);
+            } else {
+                LOG(LEVEL_ERROR, "Thread %d failed to process %s.\n", t, path);
+                saveFailure(task.task, path, status);
+            }
+            free(task.path);
+            threadsBusy--;
+            continue;
+        }
+
+        // Merge this range into the shared split record; the last one saves
+        pthread_mutex_lock(&split->lock);
+        if (status == 0) {
+            for (int i = 0; i < 26; i++) split->state.counts[i] += counts[i];
+        } else {
+            split->state.failed = status;
+        }
+        int done = --split->state.partsLeft == 0;
+        pthread_mutex_unlock(&split->lock);
+        if (!done) {
+            threadsBusy--;
+            continue;
+        }
+
+        if (!split->state.failed) {
+            if (split->state.cacheable) cacheStore(&split->state.key, split->state.counts);
+            LOG(LEVEL_INFO, "Thread %d merged all ranges of %s.\n", t, path);
+            saveHistogram(getpid(), task.task, path, split->state.counts, NULL, 0);
+        } else {
+            LOG(LEVEL_ERROR, "Failed to process one or more ranges of %s.\n", path);
+            saveFailure(task.task, path, split->state.failed);
+        }
+        pthread_mutex_destroy(&split->lock);
+        free(split->state.path);
+        free(split);
+        threadsBusy--;
+    }
+    free(chunkBuffer);
+    free(compressedBuffer);
+    releaseArena(&inputArena);
+    closeUring();
+    return NULL;
+}
+
+/**
+ * Counts the tasks waiting in the deques of the threads engine.
+ */
+static uint64_t dequedTasks(void) {
+    uint64_t queued = 0;
+    for (int t = 0; t < numWorkers; t++) {
+        pthread_mutex_lock(&deques[t].lock);
+        queued += deques[t].tail - deques[t].head;
+        pthread_mutex_unlock(&deques[t].lock);
+    }
+    return queued;
+}
+
+/**
+ * Threaded engine: runs the same per-file work as the process pool on a
+ * pthread pool, with no pipes, fork() or signal handling. A thread that runs
+ * out of work steals from the other deques, and once they are all empty
+ * pulls the next few inputs into its own.
+ */
+void runThreadEngine(void) {
+    deques = (struct TaskDeque *)calloc(numWorkers, sizeof(struct TaskDeque));
+    if (!deques) {
+        perror("Failed to allocate thread engine state");
+        skipQueued(1); // Every input is recorded as skipped
+        return;
+    }
+    for (int t = 0; t < numWorkers; t++) pthread_mutex_init(&deques[t].lock, NULL);
+
+    LOG(LEVEL_DEBUG, "Starting %d worker threads...\n", numWorkers);
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    for (; started < numWorkers; started++) {
+        int rc = pthread_create(&threads[started], NULL, runThread, (void *)(intptr_t)started);
+        if (rc != 0) {
+            LOG(LEVEL_ERROR, "Error creating thread %d of %d: %s\n", started + 1, numWorkers, strerror(rc));
+            break;
+        }
+    }
+    // The threads that did start steal the work of the others; with none,
+    // this thread does it all
+    if (started == 0) runThread((void *)(intptr_t)0);
+    for (int t = 0; t < started; t++) {
+        // Wakes up for each progress report until the thread is done
+        struct timespec deadline;
+        int timeout;
+        while ((timeout = progressTimeout()) >= 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout / 1000;
+            deadline.tv_nsec += timeout % 1000 * 1000000l;
+            if (deadline.tv_nsec >= 1000000000l) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000l;
+            }
+            if (pthread_timedjoin_np(threads[t], NULL, &deadline) == 0) break;
+            reportProgress(threadsBusy, started, dequedTasks(), 0);
+        }
+        if (timeout < 0) pthread_join(threads[t], NULL);
+    }
+    reportProgress(0, started, dequedTasks(), 1);
+    LOG(LEVEL_DEBUG, "All worker threads have finished.\n");
+
+    // Tasks a stop left behind; a split input is recorded with its last range
+    for (int t = 0; t < numWorkers; t++) {
+        for (int i = deques[t].head; i < deques[t].tail; i++) {
+            struct ThreadTask *task = &deques[t].items[i];
+            if (!task->split) {
+                saveFailure(task->task, task->path, STATUS_SKIPPED);
+                free(task->path);
+            } else if (--task->split->state.partsLeft == 0) {
+                saveFailure(task->task, task->split->state.path, STATUS_SKIPPED);
+                pthread_mutex_destroy(&task->split->lock);
+                free(task->split->state.path);
+                free(task->split);
+            }
+        }
+        pthread_mutex_destroy(&deques[t].lock);
+        free(deques[t].items);
+    }
+    free(deques);
+}
+
+/**
+ * Runs the whole job on the threads engine, from opening the outputs to the
+ * stats report.
+ * @return The exit status
+ */
+int runThreadsMode(void) {
+    if (binaryOutput) openResults();
+    if (coordinatorAddress) connectCoordinator();
+    openCache();
+    startScan(-1);
+    runThreadEngine();
+    stopScan();
+    closeCache();
+    if (binaryOutput) closeResults();
+    int uplinkStatus = closeUplink();
+    int status = finishRun();
+    reportStats();
+    return uplinkStatus < 0 ? EXIT_FAILURE : status;
+}
@@ -0,0 +1,145 @@
+/**
+ * CPU and NUMA topology, worker placement, and the node caching a file.
+ */
+#include "engine.h"
+
+#define NUMA_PROBE_PAGES 16     // Cached pages sampled per file
+
+struct Topology topology;
+
+/**
+ * Parses a sysfs CPU list such as "0-3,8-11" and records node as the node of
+ * every CPU in it.
+ */
+static void parseCpuList(const char *list, int node) {
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list) break;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0) topology.nodeOfCpu[cpu] = node;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Reads the CPUs this process may use and the node of each from
+ * /sys/devices/system/node. Without that directory (no NUMA support) every
+ * CPU is on node 0.
+ */
+void readTopology(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    memset(&topology, 0, sizeof(topology));
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file) continue;
+        if (fgets(list, sizeof(list), file)) parseCpuList(list, node);
+        fclose(file);
+    }
+
+    // Deal the allowed CPUs out one node at a time
+    int taken[CPU_SETSIZE] = { 0 };
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (topology.nodeOfCpu[cpu] >= topology.numNodes) topology.numNodes = topology.nodeOfCpu[cpu] + 1;
+    }
+    int numAllowed = CPU_COUNT(&allowed);
+    while (topology.numCpus < numAllowed) {
+        for (int node = 0; node < topology.numNodes; node++) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed) && !taken[cpu] && topology.nodeOfCpu[cpu] == node) {
+                    taken[cpu] = 1;
+                    topology.cpus[topology.numCpus++] = cpu;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * NUMA node that worker (or thread) w is placed on; 0 before the topology
+ * has been read.
+ */
+int workerNode(int w) {
+    if (topology.numCpus == 0) return 0;
+    return topology.nodeOfCpu[topology.cpus[w % topology.numCpus]];
+}
+
+/**
+ * Places the calling worker process or thread: with --pin on its own CPU,
+ * with --numa=auto on the CPUs of its node, and with --numa=auto its memory
+ * (chunk buffers, the input arena, io_uring buffers) on that node. The
+ * memory policy is preferred rather than strict, so a full node spills
+ * over instead of failing allocations.
+ */
+void placeWorker(int w) {
+    if ((!pinWorkers && numaMode == NUMA_OFF) || topology.numCpus == 0) return;
+    int cpu = topology.cpus[w % topology.numCpus], node = topology.nodeOfCpu[cpu];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pinWorkers) {
+        CPU_SET(cpu, &set);
+    } else {
+        for (int i = 0; i < topology.numCpus; i++) {
+            if (topology.nodeOfCpu[topology.cpus[i]] == node) CPU_SET(topology.cpus[i], &set);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) perror("Error setting worker CPU affinity");
+
+    if (numaMode == NUMA_AUTO && topology.numNodes > 1) {
+        unsigned long mask = 1ul << node;
+        // maxnode counts one past the last bit the kernel reads
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) < 0) {
+            perror("Error setting worker memory policy");
+        }
+    }
+    LOG(LEVEL_DEBUG, "Worker %d placed on %s %d (node %d).\n", w, pinWorkers ? "CPU" : "node",
+                     pinWorkers ? cpu : node, node);
+}
+
+/**
+ * Finds the NUMA node whose page cache holds most of a file, by sampling up
+ * to NUMA_PROBE_PAGES of its pages that mincore() reports as cached and
+ * asking move_pages() where they live. Only cached pages are touched, so
+ * the probe never reads from the device.
+ * @return 1 + the node, or 0 if none of the sampled pages is cached
+ */
+int probeFileNode(const char *path, off_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return 0;
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + pageSize - 1) / pageSize;
+    void *addresses[NUMA_PROBE_PAGES];
+    int nodes[NUMA_PROBE_PAGES], count = 0;
+    for (int i = 0; i < NUMA_PROBE_PAGES; i++) {
+        char *page = (char *)mapped + pages * i / NUMA_PROBE_PAGES * pageSize;
+        unsigned char resident;
+        if (mincore(page, pageSize, &resident) == 0 && (resident & 1)) {
+            (void)*(volatile char *)page; // Map the cached page; a minor fault
+            addresses[count++] = page;
+        }
+    }
+
+    int votes[MAX_NUMA_NODES] = { 0 }, best = -1;
+    if (count > 0 && syscall(SYS_move_pages, 0, count, addresses, NULL, nodes, 0) == 0) {
+        for (int i = 0; i < count; i++) {
+            if (nodes[i] < 0 || nodes[i] >= MAX_NUMA_NODES) continue;
+            if (++votes[nodes[i]] > (best >= 0 ? votes[best] : 0)) best = nodes[i];
+        }
+    }
+    munmap(mapped, size);
+    return best + 1;
+}
@@ -0,0 +1,384 @@
+/**
+ * How results travel: the shared result ring between workers and the
+ * parent, and the wire records a shard sends its coordinator.
+ */
+#include "engine.h"
+
+#define CONNECT_ATTEMPTS 30     // Seconds a shard keeps trying to reach its coordinator
+
+struct ResultRing *resultRing = NULL;  // Shared result ring with --transport=shm, else NULL
+int ringEventFd = -1;                  // Wakes the parent when the ring has results
+
+/**
+ * Creates the shared result ring and its eventfd. Must run before the workers
+ * are forked so they inherit the mapping.
+ */
+void createResultRing(void) {
+    int fd = memfd_create("parallel-results", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, sizeof(struct ResultRing)) < 0) {
+        perror("Error creating result ring");
+        exit(EXIT_FAILURE);
+    }
+    resultRing = (struct ResultRing *)mmap(NULL, sizeof(struct ResultRing), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the memory alive
+    ringEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (resultRing == MAP_FAILED || ringEventFd < 0) {
+        perror("Error creating result ring");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t i = 0; i < RING_SLOTS; i++) {
+        atomic_store_explicit(&resultRing->slots[i].sequence, i, memory_order_relaxed);
+    }
+    atomic_store(&resultRing->head, 0);
+    atomic_store(&resultRing->tail, 0);
+    atomic_store(&resultRing->consumerWaiting, 0);
+}
+
+/**
+ * Publishes a result from worker w to the shared ring, and wakes the parent
+ * if it is about to sleep.
+ */
+void publishResult(int w, const struct ResultMessage *result) {
+    uint64_t pos = atomic_load_explicit(&resultRing->head, memory_order_relaxed);
+    struct RingSlot *slot;
+    for (;;) {
+        slot = &resultRing->slots[pos % RING_SLOTS];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)sequence - (int64_t)pos;
+        if (diff == 0) {
+            // Say which position we are taking before taking it, so the
+            // parent can tell a slot left unpublished by a dead worker
+            atomic_store(&resultRing->claims[w], pos + 1);
+            if (atomic_compare_exchange_weak_explicit(&resultRing->head, &pos, pos + 1,
+                                                      memory_order_seq_cst, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            sched_yield(); // Full; wait for the parent to drain it (workers die with the parent)
+            pos = atomic_load_explicit(&resultRing->head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&resultRing->head, memory_order_relaxed);
+        }
+    }
+
+    slot->worker = w;
+    slot->message = *result;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    atomic_store_explicit(&resultRing->claims[w], 0, memory_order_release);
+
+    if (atomic_exchange(&resultRing->consumerWaiting, 0)) {
+        uint64_t one = 1;
+        while (write(ringEventFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+}
+
+/**
+ * Takes the oldest published result off the ring. Parent only.
+ * @param w Receives the slot of the worker that published it
+ * @return 1 if a result was taken, 0 if the ring is empty
+ */
+int consumeResult(int *w, struct ResultMessage *result) {
+    uint64_t pos = atomic_load_explicit(&resultRing->tail, memory_order_relaxed);
+    struct RingSlot *slot = &resultRing->slots[pos % RING_SLOTS];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != pos + 1) return 0;
+
+    *w = slot->worker;
+    *result = slot->message;
+    atomic_store_explicit(&slot->sequence, pos + RING_SLOTS, memory_order_release);
+    atomic_store_explicit(&resultRing->tail, pos + 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Frees the slot at the tail of the ring if a worker took its position and
+ * died before publishing it, which would hold up every result behind it for
+ * good. The position is taken but unpublished, and no worker still running
+ * claims it, so its taker is dead. Parent only.
+ * @return 1 if a slot was skipped, 0 if the tail is free, published or
+ *         still being written
+ */
+int skipAbandonedSlot(void) {
+    uint64_t pos = atomic_load_explicit(&resultRing->tail, memory_order_relaxed);
+    struct RingSlot *slot = &resultRing->slots[pos % RING_SLOTS];
+    if (atomic_load(&slot->sequence) != pos || atomic_load(&resultRing->head) <= pos) return 0;
+    for (int w = 0; w < numWorkers; w++) {
+        if (!children[w].reaped && atomic_load(&resultRing->claims[w]) == pos + 1) return 0;
+    }
+    // A worker that published since cleared its claim after the sequence
+    if (atomic_load(&slot->sequence) != pos) return 0;
+
+    LOG(LEVEL_DEBUG, "Skipping result ring position %" PRIu64 ", abandoned by a dead worker.\n", pos);
+    atomic_store_explicit(&slot->sequence, pos + RING_SLOTS, memory_order_release);
+    atomic_store_explicit(&resultRing->tail, pos + 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Writes the results a worker has buffered to its result pipe.
+ * @param used Bytes buffered in out, reset to 0
+ * @return 0, or -1 if the pipe is broken
+ */
+int sendResults(int resultFd, const char *out, size_t *used) {
+    STATS_BEGIN(timer);
+    int written = writeFull(resultFd, out, *used);
+    STATS_END(STAGE_TRANSFER, timer, 1);
+    *used = 0;
+    if (written < 0) perror("Error writing result to pipe");
+    return written < 0 ? -1 : 0;
+}
+
+/**
+ * Stores the low bytes of value at out, least significant first.
+ */
+static void putLittle(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) out[i] = value >> (8 * i);
+}
+
+/**
+ * Reads a little-endian value of the given number of bytes.
+ */
+uint64_t getLittle(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+/**
+ * Stores value as a LEB128 varint: seven bits per byte, low bits first, the
+ * top bit set on every byte but the last.
+ * @return Bytes written, at most VARINT_MAX
+ */
+size_t putVarint(unsigned char *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = value | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/**
+ * Reads a LEB128 varint and advances *in past it.
+ * @param end End of the record being read
+ * @return 0 on success, -1 if the varint runs past end or 64 bits
+ */
+int getVarint(const unsigned char **in, const unsigned char *end, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && *in < end; shift += 7) {
+        unsigned char byte = *(*in)++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Writes the header of a record whose body of the given length follows it.
+ */
+void putWireHeader(unsigned char *out, enum WireType type, size_t length) {
+    memcpy(out, "HSTR", 4);
+    putLittle(out + 4, WIRE_VERSION, 2);
+    putLittle(out + 6, type, 2);
+    putLittle(out + 8, length, 4);
+}
+
+/**
+ * Resolves a "HOST:PORT" address; "[HOST]:PORT" for IPv6 literals, "PORT"
+ * alone for every local address when listening.
+ * @param passive Whether the address is to listen on
+ * @return getaddrinfo() results for freeaddrinfo(), or NULL after logging an error
+ */
+struct addrinfo *resolveAddress(const char *address, int passive) {
+    char host[256] = "";
+    const char *port = strrchr(address, ':'), *start = address;
+    if (port) {
+        size_t length = port - address;
+        if (length >= 2 && address[0] == '[' && address[length - 1] == ']') {
+            start++;
+            length -= 2;
+        }
+        if (length >= sizeof(host)) length = sizeof(host) - 1;
+        memcpy(host, start, length);
+        host[length] = '\0';
+        port++;
+    } else {
+        port = address;
+    }
+    if (!passive && host[0] == '\0') {
+        LOG(LEVEL_ERROR, "Error: '%s' is not a HOST:PORT address.\n", address);
+        return NULL;
+    }
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses);
+    if (rc != 0) {
+        LOG(LEVEL_ERROR, "Error resolving %s: %s\n", address, gai_strerror(rc));
+        return NULL;
+    }
+    return addresses;
+}
+
+struct Uplink uplink = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+/**
+ * Sends the buffered records. Call with uplink.lock held.
+ */
+static void flushUplink(void) {
+    STATS_BEGIN(timer);
+    if (writeFull(uplink.fd, uplink.buffer, uplink.used) < 0) {
+        LOG(LEVEL_ERROR, "Error sending results to the coordinator: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    STATS_END(STAGE_OUTPUT, timer, 1);
+    uplink.used = 0;
+}
+
+/**
+ * Makes room for a record with a body of up to maxBody bytes at the end of
+ * the buffer, sending the buffer first once it holds WIRE_FLUSH bytes. Call
+ * with uplink.lock held, then finishRecord().
+ * @return Where the body goes
+ */
+static unsigned char *beginRecord(size_t maxBody) {
+    if (uplink.used >= WIRE_FLUSH) flushUplink();
+    size_t needed = uplink.used + WIRE_HEADER_SIZE + maxBody;
+    if (needed > uplink.capacity) {
+        size_t capacity = uplink.capacity ? uplink.capacity * 2 : 2 * WIRE_FLUSH;
+        while (capacity < needed) capacity *= 2;
+        unsigned char *buffer = (unsigned char *)realloc(uplink.buffer, capacity);
+        if (!buffer) {
+            perror("Failed to allocate the coordinator buffer");
+            exit(EXIT_FAILURE);
+        }
+        uplink.buffer = buffer;
+        uplink.capacity = capacity;
+    }
+    return uplink.buffer + uplink.used + WIRE_HEADER_SIZE;
+}
+
+/**
+ * Puts the header in front of the body written after beginRecord().
+ */
+static void finishRecord(enum WireType type, size_t length) {
+    putWireHeader(uplink.buffer + uplink.used, type, length);
+    uplink.used += WIRE_HEADER_SIZE + length;
+}
+
+/**
+ * Connects to the coordinator given with --coordinator, retrying for
+ * CONNECT_ATTEMPTS seconds so shards may start before it, and introduces
+ * the shard. Must be called after the workers are forked.
+ */
+void connectCoordinator(void) {
+    struct addrinfo *addresses = resolveAddress(coordinatorAddress, 0);
+    if (!addresses) exit(EXIT_FAILURE);
+    int fd = -1, error = 0;
+    for (int attempt = 0; fd < 0 && attempt < CONNECT_ATTEMPTS; attempt++) {
+        if (attempt == 1) LOG(LEVEL_NOTICE, "Waiting for the coordinator at %s...\n", coordinatorAddress);
+        if (attempt > 0) sleep(1);
+        for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                error = errno;
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        LOG(LEVEL_ERROR, "Error connecting to the coordinator at %s: %s\n", coordinatorAddress, strerror(error));
+        exit(EXIT_FAILURE);
+    }
+
+    // A coordinator that goes away must fail the writes, not kill the shard
+    signal(SIGPIPE, SIG_IGN);
+    uplink.fd = fd;
+    int numLabels = classPolicy ? classPolicy->numClasses : 0;
+    pthread_mutex_lock(&uplink.lock);
+    unsigned char *body = beginRecord(4 * VARINT_MAX + numLabels), *p = body;
+    p += putVarint(p, shardIndex);
+    p += putVarint(p, numShards);
+    p += putVarint(p, histogramMode);
+    p += putVarint(p, numLabels);
+    if (numLabels > 0) memcpy(p, classPolicy->labels, numLabels);
+    finishRecord(WIRE_HELLO, p + numLabels - body);
+    flushUplink();
+    pthread_mutex_unlock(&uplink.lock);
+    LOG(LEVEL_INFO, "Connected to the coordinator at %s as shard %d/%d.\n",
+                    coordinatorAddress, shardIndex + 1, numShards);
+}
+
+/**
+ * Queues the RESULT record of an input for the coordinator.
+ * @param status A TaskStatus, 0 if counted
+ * @param counts Histogram of the input, ignored when status is nonzero
+ * @param pairs Wide buckets of the input, numPairs of them
+ */
+void sendResult(int task, int status, const char *path, const uint64_t counts[26],
+                const struct HistogramPair *pairs, uint32_t numPairs) {
+    size_t length = strlen(path);
+    pthread_mutex_lock(&uplink.lock);
+    unsigned char *body = beginRecord((30 + 2 * (size_t)numPairs) * VARINT_MAX + length), *p = body;
+    p += putVarint(p, task);
+    p += putVarint(p, status);
+    p += putVarint(p, length);
+    memcpy(p, path, length);
+    p += length;
+    if (status == 0) {
+        for (int i = 0; i < 26; i++) p += putVarint(p, counts[i]);
+        p += putVarint(p, numPairs);
+        for (uint32_t i = 0; i < numPairs; i++) {
+            p += putVarint(p, pairs[i].bucket);
+            p += putVarint(p, pairs[i].count);
+        }
+    }
+    finishRecord(WIRE_RESULT, p - body);
+    uplink.records++;
+    pthread_mutex_unlock(&uplink.lock);
+}
+
+/**
+ * Sends the END record and the records still buffered, and waits for the
+ * coordinator to confirm it merged every one of them.
+ * @return 0 if confirmed (or without --coordinator), -1 otherwise
+ */
+int closeUplink(void) {
+    if (uplink.fd < 0) return 0;
+    unsigned char *body = beginRecord(VARINT_MAX);
+    finishRecord(WIRE_END, putVarint(body, uplink.records));
+    flushUplink();
+    shutdown(uplink.fd, SHUT_WR);
+
+    unsigned char reply[WIRE_HEADER_SIZE + VARINT_MAX];
+    uint64_t confirmed = UINT64_MAX;
+    if (readFull(uplink.fd, reply, WIRE_HEADER_SIZE) == WIRE_HEADER_SIZE &&
+        memcmp(reply, "HSTR", 4) == 0 && getLittle(reply + 6, 2) == WIRE_END) {
+        size_t length = getLittle(reply + 8, 4);
+        const unsigned char *p = reply + WIRE_HEADER_SIZE;
+        if (length <= VARINT_MAX && readFull(uplink.fd, reply + WIRE_HEADER_SIZE, length) == (ssize_t)length &&
+            getVarint(&p, p + length, &confirmed) < 0) {
+            confirmed = UINT64_MAX;
+        }
+    }
+    close(uplink.fd);
+    uplink.fd = -1;
+    free(uplink.buffer);
+    if (confirmed != uplink.records) {
+        LOG(LEVEL_ERROR, "Error: the coordinator did not confirm the %" PRIu64 " results of shard %d/%d.\n",
+                         uplink.records, shardIndex + 1, numShards);
+        return -1;
+    }
+    LOG(LEVEL_NOTICE, "Sent %" PRIu64 " results to the coordinator at %s.\n", uplink.records, coordinatorAddress);
+    return 0;
+}
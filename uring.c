@@ -0,0 +1,410 @@
+/**
+ * The --input=uring reader, which keeps queueDepth chunk reads in flight.
+ */
+#include "engine.h"
+
+/**
+ * A file or range queued for io_uring reads. The submitter opens it when its
+ * first read is due and requests chunk after chunk; uringFinish() counts the
+ * chunks in file order as they complete.
+ */
+struct UringStream {
+    const char *path;               // Owned by the caller until uringFinish()
+    off_t offset;                   // First byte to count
+    off_t length;                   // Bytes to count, or -1 for the whole file
+    off_t next;                     // Next byte to request
+    off_t end;                      // Requests stop here
+    off_t fileSize;
+    int fd;                         // -1 until opened
+    int openError;                  // errno of a failed open(), reported by uringFinish()
+    int state;                      // STREAM_QUEUED, STREAM_READING or STREAM_DIRECT
+    int status;                     // A TaskStatus, nonzero once the file couldn't be opened or read
+    enum Compression compression;   // Found in the file's first bytes
+    unsigned inFlight;              // Reads issued and not yet counted
+};
+
+#define STREAM_QUEUED 0  // Not opened yet
+#define STREAM_READING 1 // Regular file being read through the ring
+#define STREAM_DIRECT 2  // Counted by uringFinish() without the ring (pipes, /proc, failures)
+
+/**
+ * One registered buffer and the read that fills it. Slots are handed out and
+ * counted in the same circular order, so a slot is free again once the
+ * reads issued before it have all been counted.
+ */
+struct UringSlot {
+    int stream;       // Index of the stream the read belongs to
+    off_t offset;     // File offset of the read
+    unsigned length;  // Bytes requested
+    int result;       // Bytes read or -errno, once done
+    int done;
+};
+
+/**
+ * The worker's io_uring instance: the rings shared with the kernel, the
+ * registered buffer pool, and the streams of the current batch.
+ */
+struct Uring {
+    int fd;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    char *buffers;            // queueDepth buffers of bufferSize bytes
+    size_t bufferSize;
+    struct iovec *iovecs;     // One per buffer
+    int registered;           // Buffers registered: READ_FIXED, else READV
+    struct UringSlot *slots;
+    unsigned issued, counted; // Reads issued and counted so far; slot = n % queueDepth
+    unsigned unsubmitted;     // SQEs queued but not passed to io_uring_enter() yet
+    int failed;               // io_uring_enter() failed: the ring is abandoned, reads may be in flight
+
+    struct UringStream streams[MAX_BATCH];
+    int numStreams;           // Streams queued in this batch
+    int submitStream;         // Stream the submitter is reading ahead in
+};
+
+static _Thread_local struct Uring *uring = NULL; // Created on first use by each worker
+static _Thread_local int uringBroken = 0; // io_uring couldn't be set up in this worker
+
+/**
+ * Checks once, in the parent, that the kernel lets this process use
+ * io_uring; containers and older kernels often don't.
+ * @return 0 if a ring can be created, else -1 with errno set
+ */
+int probeUring(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd < 0) return -1;
+    close(fd);
+    return 0;
+}
+
+/**
+ * Frees the calling thread's ring and buffers.
+ */
+void closeUring(void) {
+    if (!uring) return;
+    close(uring->fd); // Unregisters the buffers
+    if (uring->cqRing != uring->sqRing) munmap(uring->cqRing, uring->cqRingSize);
+    munmap(uring->sqRing, uring->sqRingSize);
+    munmap(uring->sqes, uring->sqesSize);
+    // Reads still in flight on a failed ring may land in the buffers
+    if (!uring->failed) munmap(uring->buffers, uring->bufferSize * queueDepth);
+    free(uring->iovecs);
+    free(uring->slots);
+    free(uring);
+    uring = NULL;
+}
+
+/**
+ * Creates the calling thread's ring with queueDepth entries and a pool of
+ * queueDepth chunk buffers, registered with the kernel so reads into them
+ * skip the per-I/O page pinning. Runs in each worker, never in the parent,
+ * since a ring must not be shared across fork().
+ * @return 1 if the ring is ready, 0 if io_uring is unusable here
+ */
+static int setupUring(void) {
+    if (uring) return 1;
+    if (uringBroken) return 0;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    struct Uring *u = (struct Uring *)calloc(1, sizeof(*u));
+    int fd = u ? syscall(__NR_io_uring_setup, queueDepth, &params) : -1;
+    if (fd < 0) {
+        LOG(LEVEL_DEBUG, "io_uring unavailable (%s); reading with read().\n", strerror(errno));
+        free(u);
+        uringBroken = 1;
+        return 0;
+    }
+    u->fd = fd;
+    u->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqRingSize > u->sqRingSize) u->sqRingSize = u->cqRingSize;
+        u->cqRingSize = u->sqRingSize;
+    }
+    u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    u->cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? u->sqRing
+              : mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_CQ_RING);
+    u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    u->bufferSize = chunkSize < (1u << 30) ? chunkSize : (1u << 30); // READ_FIXED's limit
+    u->buffers = (char *)mmap(NULL, u->bufferSize * queueDepth, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->iovecs = (struct iovec *)malloc(queueDepth * sizeof(struct iovec));
+    u->slots = (struct UringSlot *)calloc(queueDepth, sizeof(struct UringSlot));
+    if (u->sqRing == MAP_FAILED || u->cqRing == MAP_FAILED || u->sqes == MAP_FAILED ||
+        u->buffers == MAP_FAILED || !u->iovecs || !u->slots) {
+        LOG(LEVEL_ERROR, "Error setting up io_uring (%s); reading with read().\n", strerror(errno));
+        if (u->cqRing != MAP_FAILED && u->cqRing != u->sqRing) munmap(u->cqRing, u->cqRingSize);
+        if (u->sqRing != MAP_FAILED) munmap(u->sqRing, u->sqRingSize);
+        if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqesSize);
+        if (u->buffers != MAP_FAILED) munmap(u->buffers, u->bufferSize * queueDepth);
+        free(u->iovecs);
+        free(u->slots);
+        close(fd);
+        free(u);
+        uringBroken = 1;
+        return 0;
+    }
+
+    char *ring = (char *)u->sqRing;
+    u->sqHead = (unsigned *)(ring + params.sq_off.head);
+    u->sqTail = (unsigned *)(ring + params.sq_off.tail);
+    u->sqMask = (unsigned *)(ring + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(ring + params.sq_off.array);
+    ring = (char *)u->cqRing;
+    u->cqHead = (unsigned *)(ring + params.cq_off.head);
+    u->cqTail = (unsigned *)(ring + params.cq_off.tail);
+    u->cqMask = (unsigned *)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    for (int i = 0; i < queueDepth; i++) {
+        u->iovecs[i].iov_base = u->buffers + (size_t)i * u->bufferSize;
+        u->iovecs[i].iov_len = u->bufferSize;
+    }
+    // Registration pins the pool, which RLIMIT_MEMLOCK may forbid; plain
+    // vectored reads into the same buffers work regardless
+    u->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                            u->iovecs, queueDepth) == 0;
+    if (!u->registered) {
+        LOG(LEVEL_DEBUG, "Buffer registration failed (%s); using unregistered reads.\n", strerror(errno));
+    }
+    uring = u;
+    return 1;
+}
+
+/**
+ * Passes queued SQEs to the kernel and optionally waits for one completion.
+ * @return 0, or -1 if io_uring_enter() failed, which abandons the ring
+ */
+static int enterUring(unsigned minComplete) {
+    while (uring->unsubmitted > 0 || minComplete > 0) {
+        STATS_BEGIN(timer);
+        int n = syscall(__NR_io_uring_enter, uring->fd, uring->unsubmitted, minComplete,
+                        minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        STATS_END(STAGE_READ, timer, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Out of kernel resources: reap what is done and try again
+                if (minComplete) break;
+                sched_yield();
+                continue;
+            }
+            LOG(LEVEL_ERROR, "Error: io_uring_enter failed (%s); reading with read().\n", strerror(errno));
+            uring->failed = 1;
+            uringBroken = 1;
+            return -1;
+        }
+        uring->unsubmitted -= n;
+        if (minComplete) break;
+    }
+    return 0;
+}
+
+/**
+ * Marks the slots of every completion the kernel has posted as done.
+ * @return Number of completions reaped
+ */
+static unsigned reapUring(void) {
+    unsigned head = *uring->cqHead, reaped = 0;
+    unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, reaped++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cqMask];
+        struct UringSlot *slot = &uring->slots[cqe->user_data];
+        slot->result = cqe->res;
+        slot->done = 1;
+    }
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/**
+ * Opens a queued stream the way processFile() and processRange() would, and
+ * decides whether it is read through the ring. Failures are recorded in the
+ * stream and reported when it is counted.
+ */
+static void openStream(struct UringStream *s) {
+    LOG(LEVEL_DEBUG, "Opening file: %s\n", s->path);
+    s->state = STREAM_DIRECT;
+    STATS_BEGIN(openTimer);
+    s->fd = open(s->path, O_RDONLY);
+    struct stat st;
+    int statResult = s->fd >= 0 ? fstat(s->fd, &st) : -1;
+    STATS_END(STAGE_OPEN, openTimer, 2);
+    if (statResult < 0) {
+        if (s->fd >= 0) perror("Error reading file status");
+        if (s->fd < 0) s->openError = errno;
+        s->status = s->fd < 0 ? failureStatus(errno) : STATUS_FAILED;
+        return;
+    }
+    s->fileSize = S_ISREG(st.st_mode) ? st.st_size : 0;
+    if (s->length >= 0) {
+        // A compressed range takes whole frames, which processCompressed() finds
+        s->compression = sniffFile(s->fd);
+        s->end = s->offset + s->length;
+        if (s->compression == COMPRESSION_NONE) s->state = STREAM_READING;
+    } else if (s->fileSize > 0) {
+        s->end = s->fileSize; // Compression shows in the first chunk
+        s->state = STREAM_READING;
+    }
+    s->next = s->offset;
+}
+
+/**
+ * Issues reads while buffers are free, running ahead through the streams of
+ * the batch in order, so the next files are already being read while the
+ * current one is counted.
+ */
+static void fillUring(void) {
+    while (!uring->failed && uring->issued - uring->counted < (unsigned)queueDepth &&
+           uring->submitStream < uring->numStreams) {
+        struct UringStream *s = &uring->streams[uring->submitStream];
+        if (s->state == STREAM_QUEUED) openStream(s);
+        if (s->state != STREAM_READING || s->next >= s->end) {
+            uring->submitStream++;
+            continue;
+        }
+
+        unsigned index = uring->issued % queueDepth;
+        struct UringSlot *slot = &uring->slots[index];
+        slot->stream = uring->submitStream;
+        slot->offset = s->next;
+        slot->length = s->end - s->next < (off_t)uring->bufferSize ? (unsigned)(s->end - s->next)
+                                                                  : (unsigned)uring->bufferSize;
+        slot->done = 0;
+
+        unsigned tail = *uring->sqTail;
+        unsigned entry = tail & *uring->sqMask;
+        struct io_uring_sqe *sqe = &uring->sqes[entry];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = s->fd;
+        sqe->off = slot->offset;
+        sqe->user_data = index;
+        if (uring->registered) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uintptr_t)uring->iovecs[index].iov_base;
+            sqe->len = slot->length;
+            sqe->buf_index = index;
+        } else {
+            uring->iovecs[index].iov_len = slot->length;
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr = (uintptr_t)&uring->iovecs[index];
+            sqe->len = 1;
+        }
+        uring->sqArray[entry] = entry;
+        __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        s->next += slot->length;
+        s->inFlight++;
+        uring->issued++;
+        uring->unsubmitted++;
+    }
+    enterUring(0);
+}
+
+/**
+ * Queues a file, or bytes [offset, offset + length) of one, to be read
+ * through the calling thread's io_uring. Nothing is read until uringFinish()
+ * is called; queued streams must be finished in the order they were queued.
+ * @param path Must stay valid until the stream is finished
+ * @param length Bytes to count, or -1 for the whole file
+ * @return Stream to pass to uringFinish(), or -1 if the input should go
+ *         through processFile() or processRange() instead
+ */
+int uringQueue(const char *path, off_t offset, off_t length) {
+    if (inputMode != INPUT_URING || !setupUring() || uring->failed) return -1;
+    if (uring->submitStream == uring->numStreams && uring->issued == uring->counted) {
+        uring->numStreams = uring->submitStream = 0; // Previous batch all counted
+    }
+    if (uring->numStreams == MAX_BATCH) return -1;
+
+    struct UringStream *s = &uring->streams[uring->numStreams];
+    memset(s, 0, sizeof(*s));
+    s->path = path;
+    s->offset = length >= 0 ? offset : 0;
+    s->length = length;
+    s->fd = -1;
+    return uring->numStreams++;
+}
+
+/**
+ * Counts a queued stream: waits for its chunks in file order and feeds each
+ * to the histogram while the reads after it, of this file or the next ones
+ * in the batch, are still in flight. Once the ring has failed, the input is
+ * read by processFile() or processRange() instead.
+ * @param counts Output array of 26 letter counts; the wide buckets are left
+ *               for collectPairs()
+ * @return 0 on success, 1 if the input could not be read
+ */
+int uringFinish(int stream, uint64_t counts[26]) {
+    struct UringStream *s = &uring->streams[stream];
+    fillUring(); // Opens the stream if the submitter hasn't got to it yet
+    beginHistogram(counts);
+
+    while (s->inFlight > 0 || (s->state == STREAM_READING && s->next < s->end)) {
+        struct UringSlot *slot = &uring->slots[uring->counted % queueDepth];
+        while (!slot->done && !uring->failed) {
+            if (reapUring() == 0) enterUring(1);
+        }
+        if (uring->failed) break;
+        char *data = (char *)uring->iovecs[uring->counted % queueDepth].iov_base;
+        if (slot->result < 0) {
+            if (s->status == 0) {
+                LOG(LEVEL_ERROR, "Error reading file %s: %s\n", s->path, strerror(-slot->result));
+            }
+            s->status = 1;
+        } else if (slot->offset == 0 && s->length < 0) {
+            s->compression = detectCompression((unsigned char *)data, slot->result);
+        }
+        if (s->compression != COMPRESSION_NONE) {
+            s->end = s->next; // Decompressed below, from the start of the file
+        } else if (s->status == 0) {
+            // Regular files only read short at the end; finish the chunk
+            // with pread() if one ever does anything else
+            size_t got = slot->result;
+            while (got > 0 && got < slot->length) {
+                ssize_t n = pread(s->fd, data + got, slot->length - got, slot->offset + got);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                got += n;
+            }
+            if (got < slot->length) s->end = s->next; // The file shrank
+            HistogramAccumulate(data, got, counts);
+        }
+        slot->done = 0;
+        s->inFlight--;
+        uring->counted++;
+        if (s->status) s->end = s->next;
+        fillUring();
+    }
+
+    int status = s->status;
+    if (uring->failed) {
+        // This stream and the rest of the batch are read again without the ring
+        if (s->fd >= 0) close(s->fd);
+        return s->length >= 0 ? processRange(s->path, s->offset, s->length, counts)
+                              : processFile(s->path, counts);
+    }
+    if (s->fd < 0) {
+        LOG(LEVEL_ERROR, "Error opening file %s: %s\n", s->path, strerror(s->openError));
+    } else if (status == 0 && s->compression != COMPRESSION_NONE) {
+        status = processCompressed(s->fd, s->compression, s->fileSize, s->offset, s->length, counts);
+    } else if (status == 0 && s->state == STREAM_DIRECT) {
+        status = streamHistogram(s->fd, counts); // Pipes, FIFOs, /proc and empty files
+    }
+    endHistogram(counts);
+    if (s->fd >= 0) close(s->fd);
+    return status;
+}